@@ -1,4 +1,12 @@
 #include "james_ecap.h"
+#include "james_captive.h"
+#include "james_garden.h"
+#include "james_headers.h"
+#include "james_probes.h"
+#include "james_shared.h"
+#include "james_sketch.h"
+#include "james_stats.h"
+#include "james_http.h"
 #include <iostream>
 #include <fstream>
 #include <libecap/common/registry.h>
@@ -20,9 +28,6 @@
 #include <libecap/common/body.h>
 
 
-#define CAPTIVE_TIMEOUT 3600
-
-
 
 
 namespace Adapter { // not required, but adds clarity
@@ -31,6 +36,9 @@ namespace Adapter { // not required, but adds clarity
 
     class Service : public libecap::adapter::Service {
     public:
+        Service();
+        virtual ~Service();
+
         // About
         virtual std::string uri() const; // unique across all vendors
         virtual std::string tag() const; // changes with version and config
@@ -40,7 +48,6 @@ namespace Adapter { // not required, but adds clarity
         virtual void configure(const libecap::Options &cfg);
         virtual void reconfigure(const libecap::Options &cfg);
         virtual void setOne(const libecap::Name &name, const libecap::Area &valArea);
-        virtual void loadConfig(std::string conffile);
 
         // Lifecycle
         virtual void start(); // expect makeXaction() calls
@@ -58,11 +65,15 @@ namespace Adapter { // not required, but adds clarity
 
         std::string victim; // the text we want to replace
         std::string replacement; // what the replace the victim with
-        mysqlpp::Connection conn;
-        std::string dbhost;
-        std::string dbname;
-        std::string dblogin;
-        std::string dbpassw;
+        DbConfig dbConfig;
+        bool failOpen; // whether to allow clients while the database is down
+        std::string headerRulesFile; // replaces the default header rules
+        std::string subnetsFile; // subnet policies; none if empty
+        std::string portalUrl; // where blocked clients' checks are redirected
+        std::vector<std::string> gardenHosts; // reachable without a visit
+        Snapshot<ClientDbs> dbs; // client state shared by all transactions
+        Snapshot<HeaderRules> headerRules; // edits of the adapted header
+        Snapshot<WalledGarden> garden; // connectivity checks and open hosts
 
     };
 
@@ -110,19 +121,25 @@ namespace Adapter { // not required, but adds clarity
 
         // libecap::Callable API, via libecap::host::Xaction
         virtual bool callable() const;
-        mysqlpp::Connection sqlConn;
+
     protected:
 
         void stopVb(); // stops receiving vb (if we are receiving it)
         libecap::host::Xaction *lastHostCall(); // clears hostx
 
     private:
-        libecap::shared_ptr<const Service> sharedService; // configuration access
+        const Snapshot<ClientDbs>::Pointer dbs; // as of our creation
+        const Snapshot<HeaderRules>::Pointer headerRules; // as of our creation
+        const Snapshot<WalledGarden>::Pointer garden; // as of our creation
+        const XactionId id; // for tracing
         libecap::host::Xaction *hostx; // Host transaction rep
-        libecap::shared_ptr <libecap::Message> adapted;
+        uint64_t vbBytes; // virgin body bytes received, for tracing
+        uint64_t abBytes; // adapted body bytes sent, for tracing
 
+        bool answering; // sends a synthetic check answer from buffer
         std::string buffer; // for content adaptation
-        std::string clientIP; //client IP
+        ClientAddress client; // unknown if the host did not tell
+        std::string host; // the Host header of the request, for accounting
 
         typedef enum {
             opUndecided, opOn, opComplete, opNever, opWaiting
@@ -136,6 +153,7 @@ namespace Adapter { // not required, but adds clarity
         CaptiveState capState;
         libecap::Area ResponsePage(void);
         void cnStart(void);
+        void answerCheck(const WalledGarden::Answer &success);
         bool isCaptiveRequest(libecap::Area area);
 
         void noteContentAvailable(void);
@@ -148,6 +166,18 @@ namespace Adapter { // not required, but adds clarity
 
 } // namespace Adapter
 
+static Adapter::Counter CheckAnswers("captivating.check_answers");
+static Adapter::Counter GardenPasses("captivating.garden_passes");
+
+// captive portal visits by requested host, for describe()
+static Adapter::HeavyHitters HotHosts(30);
+
+Adapter::Service::Service() : failOpen(true) {
+}
+
+Adapter::Service::~Service() {
+}
+
 std::string Adapter::Service::uri() const {
     return "ecap://murka.cz/james/captivating";
 }
@@ -157,13 +187,46 @@ std::string Adapter::Service::tag() const {
 }
 
 void Adapter::Service::describe(std::ostream &os) const {
-    os << "A captivating adapter from " << PACKAGE_NAME << " v" << PACKAGE_VERSION;
+    os << "A captivating adapter from " << PACKAGE_NAME << " v" << PACKAGE_VERSION << "\n";
+    DumpStats(os);
+    if (const Snapshot<ClientDbs>::Pointer current = dbs.get())
+        current->dumpHotClients(os);
+    HotHosts.dump(os, "captivating.hot_host");
 }
 
 void Adapter::Service::configure(const libecap::Options &cfg) {
     FUNCENTER();
     Cfgtor cfgtor(*this);
     cfg.visitEachOption(cfgtor);
+
+    libecap::shared_ptr<HeaderRules> rules(new HeaderRules);
+    if (headerRulesFile.empty()) {
+        rules->parse(
+            "add X-Ecap " + libecap::MyHost().uri() + "\n"
+            "remove Accept-Encoding\n"
+            "remove Content-Disposition\n"
+            "set Content-Type text/html\n" // our page replaces the body
+            "add Warning 214 Transformation applied\n" // RFC 2616 14.46
+            "add X-Ecap JameseCapCaptivate\n",
+            Adapter::CfgErrorPrefix);
+    } else {
+        rules->load(headerRulesFile, Adapter::CfgErrorPrefix);
+    }
+
+    SubnetPolicies subnets;
+    if (!subnetsFile.empty())
+        subnets.load(subnetsFile, Adapter::CfgErrorPrefix);
+
+    libecap::shared_ptr<WalledGarden> walledGarden(new WalledGarden);
+    if (!portalUrl.empty())
+        walledGarden->portal(portalUrl);
+    for (std::vector<std::string>::const_iterator i = gardenHosts.begin(); i != gardenHosts.end(); ++i)
+        walledGarden->open(*i);
+
+    // transactions keep the old ones until they end
+    dbs.set(Snapshot<ClientDbs>::Pointer(new ClientDbs(dbConfig, failOpen, subnets)));
+    headerRules.set(rules);
+    garden.set(walledGarden);
 }
 
 void Adapter::Service::reconfigure(const libecap::Options &) {
@@ -171,46 +234,31 @@ void Adapter::Service::reconfigure(const libecap::Options &) {
     //loadConfig();
 }
 
-void Adapter::Service::loadConfig(std::string conffile) {
-    FUNCENTER();
-
-    char _buff[1024], tag[24], val[100];
-    std::ifstream cfg(conffile.c_str());
-
-    while (!cfg.eof()) {
-        cfg.getline(_buff, 1024);
-        if (_buff[0] != '#' && _buff[0] != '\n') {
-            //puts(_buff);
-            sscanf(_buff, "%s = \"%s", tag, val);
-            val[strlen(val) - 2] = 0;
-
-            if (!strcmp(tag, "dbhost")) {
-                if (dbhost.empty())
-                    dbhost.assign(val);
-            }
-            if (!strcmp(tag, "dbname")) {
-                if (dbname.empty())
-                    dbname.assign(val);
-            }
-            if (!strcmp(tag, "dblogin")) {
-                if (dblogin.empty())
-                    dblogin.assign(val);
-            }
-            if (!strcmp(tag, "dbpassw")) {
-                if (dbpassw.empty())
-                    dbpassw.assign(val);
-            }
-        }
-    }
-    cfg.close();
-}
-
 void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &valArea) {
     FUNCENTER();
     const std::string value = valArea.toString();
 
     if (name.image() == "config") {
-        loadConfig(value);
+        dbConfig.load(value, Adapter::CfgErrorPrefix);
+    } else if (name.image() == "db_failure") {
+        failOpen = ParseFailOpen(value, Adapter::CfgErrorPrefix);
+    } else if (name.image() == "header_rules") {
+        headerRulesFile = value;
+    } else if (name.image() == "subnets") {
+        subnetsFile = value;
+    } else if (name.image() == "portal_url") {
+        portalUrl = value;
+    } else if (name.image() == "walled_garden") {
+        gardenHosts.clear();
+        std::string::size_type start = 0;
+        while (start < value.size()) {
+            std::string::size_type end = value.find(',', start);
+            if (end == std::string::npos)
+                end = value.size();
+            if (end > start)
+                gardenHosts.push_back(value.substr(start, end - start));
+            start = end + 1;
+        }
     } else {
         if (name.assignedHostId())
             ; // skip host-standard options we do not know or care about
@@ -251,83 +299,41 @@ libecap::adapter::Xaction *Adapter::Service::makeXaction(libecap::host::Xaction
 
 void Adapter::Xaction::cnStart(void) {
     FUNCENTER();
-    int cn = 1;
-    char cntime[] = "0000-00-00 00:00:00";
-    time_t cntimestamp = 0;
-    mysqlpp::Row row;
-
     libecap::host::Xaction *x = hostx;
-    libecap::Area area = x->option(libecap::metaClientIp);
-    clientIP.assign(area.start);
-
-    if (!sqlConn.connected()) {
-        // check for post-configuration errors and inconsistencies
-        if (sqlConn.connect(sharedService->dbname.c_str(), sharedService->dbhost.c_str(), sharedService->dblogin.c_str(), sharedService->dbpassw.c_str())) {
-            std::cout << "SQL reconnect" << std::endl;
-        } else {
-            std::cerr << "DB connection failed: " << sqlConn.error() << std::endl;
-        }
-
-    }
-
-    std::string ip_query = "SELECT cn,cntime, UNIX_TIMESTAMP(cntime) AS cntimestamp FROM `clients` WHERE `ip`='";
-    ip_query.append(clientIP).append("'");
-
-    mysqlpp::Query query = sqlConn.query(ip_query);
-    mysqlpp::StoreQueryResult res = query.store(); //Problem
-
-    if (res) {
-        mysqlpp::StoreQueryResult::const_iterator it;
-        for (it = res.begin(); it != res.end(); ++it) {
-            row = *it;
-            cn = row[0];
-            strcpy(cntime, row[1]);
-            cntimestamp = atoi(row[2]);
-        }
-
-
-    } else {
-        std::cerr << "Failed to get item list: " << query.error() << std::endl;
-
-        //        mysqli_query($link, "INSERT INTO clients SET `ip`='" . $client_ip . "',`starttime`=NOW(),`time`=NOW(),`enabled`=0,`cn`=0,`url`='" . $_SERVER['SERVER_NAME '] . $_SERVER['REQUEST_URI '] . "'");
-        std::string ins_query = "INSERT INTO clients SET `ip`='";
-        ins_query.append(clientIP).append("',`starttime`=NOW(),`time`=NOW(),`enabled`=0,`cn`=0 ");
-        mysqlpp::Query query2 = sqlConn.query(ins_query);
-        query2.exec(); //Problem
-
+    client.parse(x->option(libecap::metaClientIp));
+
+    static const libecap::Name headerHost("Host");
+    typedef const libecap::RequestLine *CLRLP;
+    const libecap::Message &request = dynamic_cast<CLRLP> (&x->virgin().firstLine()) ?
+        x->virgin() : x->cause();
+    if (request.header().hasAny(headerHost)) {
+        host = request.header().value(headerHost).toString();
+        HotHosts.add(host);
     }
 
-
-    if (strlen(cntime) && strcmp(cntime, "0000-00-00 00:00:00")) {
-        if (time(NULL) - cntimestamp < CAPTIVE_TIMEOUT) {
-            cn = row[0] + 1;
-        }
-    }
-
-    char upquery[200];
-    sprintf(upquery, "UPDATE `clients` SET `cntime`=NOW(), `cn` = %d WHERE `ip`='%s'", cn, clientIP.c_str());
-    mysqlpp::Query query3 = sqlConn.query(upquery);
-    query3.exec();
-
-    if (cn % 2 == 0) {
+    JAMES_PROBE1(db_begin, id);
+    if (dbs->captiveVisit(client)) {
         capState = stAllowed;
     } else {
         capState = stBlocked;
     }
-
+    JAMES_PROBE2(db_end, id, capState == stAllowed);
 }
 
 /** constructor Xaction */
 Adapter::Xaction::Xaction(libecap::shared_ptr<Service> aService,
         libecap::host::Xaction *x) :
-sharedService(aService), hostx(x), receivingVb(opUndecided), sendingAb(opUndecided) {
+dbs(aService->dbs.get()), headerRules(aService->headerRules.get()), garden(aService->garden.get()),
+id(NextXactionId()), hostx(x), vbBytes(0), abBytes(0), answering(false),
+receivingVb(opUndecided), sendingAb(opUndecided) {
     FUNCENTER();
-    //    conn = &aService->conn;
-    sqlConn = sharedService->conn;
+    JAMES_PROBE1(xaction_create, id);
 }
 
 Adapter::Xaction::~Xaction() {
     FUNCENTER();
+    JAMES_PROBE3(xaction_end, id, vbBytes, abBytes);
+    dbs->account(client, host, vbBytes, abBytes);
     if (libecap::host::Xaction * x = hostx) {
         hostx = 0;
         x->adaptationAborted();
@@ -367,20 +373,7 @@ char* itoa(int i, char b[]) {
 
 libecap::Area Adapter::Xaction::ResponsePage(void) {
     FUNCENTER();
-    std::string errmsg = "<HTML><HEAD><TITLE>";
-    if (capState == stAllowed) {
-        errmsg += "Success";
-    } else {
-        errmsg += "Blocked";
-    }
-    errmsg += "</TITLE></HEAD><BODY>";
-    if (capState == stAllowed) {
-        errmsg += "Success";
-    } else {
-        errmsg += "Blocked";
-    }
-    errmsg += "</BODY></HTML>";
-    return libecap::Area::FromTempString(errmsg);
+    return libecap::Area::FromTempString(CaptivePage(capState == stAllowed));
 }
 
 /**
@@ -396,6 +389,22 @@ bool Adapter::Xaction::isCaptiveRequest(libecap::Area area) {
 void Adapter::Xaction::start() {
     FUNCENTER();
     Must(hostx);
+    JAMES_PROBE1(xaction_start, id);
+
+    typedef const libecap::RequestLine *CLRLP;
+    const libecap::Message &request = dynamic_cast<CLRLP> (&hostx->virgin().firstLine()) ?
+        hostx->virgin() : hostx->cause();
+    bool opened = false;
+    if (const WalledGarden::Answer *success = garden->classify(request, opened)) {
+        answerCheck(*success);
+        return;
+    }
+    if (opened) {
+        GardenPasses.add();
+        lastHostCall()->useVirgin();
+        return;
+    }
+
     if (hostx->virgin().body()) {
         receivingVb = opOn;
         hostx->vbMake(); // ask host to supply virgin body
@@ -412,32 +421,12 @@ void Adapter::Xaction::start() {
     libecap::shared_ptr<libecap::Message> adapted = hostx->virgin().clone();
     Must(adapted != 0);
 
-    // delete ContentLength header because we may change the length
-    // unknown length may have performance implications for the host
-    adapted->header().removeAny(libecap::headerContentLength);
-
-    // add a custom header
-    static const libecap::Name name("X-Ecap");
-    const libecap::Header::Value value =
-            libecap::Area::FromTempString(libecap::MyHost().uri());
-    adapted->header().add(name, value);
-
-    if (adapted->header().hasAny(libecap::Name("Accept-Encoding"))) //Nekomprimovat!
-        adapted->header().removeAny(libecap::Name("Accept-Encoding"));
-
-    const libecap::Name contentname("Content-Type");
-    const libecap::Name disp("Content-Disposition");
-    const libecap::Header::Value htmlvalue = libecap::Area::FromTempString("text/html");
-    adapted->header().removeAny(disp);
-    adapted->header().removeAny(contentname);
-    adapted->header().add(contentname, htmlvalue);
-
+    // the body is replaced by our page, which has the same length
+    // whatever the captive state turns out to be
+    if (adapted->body())
+        SetContentLength(adapted->header(), ResponsePage().size);
 
-
-    // Add Warning header to response, according to RFC 2616 14.46
-    static const libecap::Name warningName("Warning");
-    const libecap::Header::Value warningValue = libecap::Area::FromTempString("214 Transformation applied");
-    adapted->header().add(warningName, warningValue);
+    headerRules->apply(adapted->header());
 
     if (!adapted->body()) {
         sendingAb = opNever; // there is nothing to send
@@ -447,6 +436,29 @@ void Adapter::Xaction::start() {
     }
 }
 
+// answers a connectivity check at once, without reading the virgin body
+void Adapter::Xaction::answerCheck(const WalledGarden::Answer &success) {
+    FUNCENTER();
+    CheckAnswers.add();
+    cnStart();
+    const WalledGarden::Answer &answer = capState == stAllowed ? success : garden->blocked();
+
+    if (hostx->virgin().body())
+        hostx->vbDiscard();
+    receivingVb = opNever;
+
+    libecap::shared_ptr<libecap::Message> adapted = answer.response();
+    if (!answer.body.size) {
+        sendingAb = opNever; // there is nothing to send
+        lastHostCall()->useAdapted(adapted);
+        return;
+    }
+
+    answering = true;
+    buffer.assign(answer.body.start, answer.body.size);
+    hostx->useAdapted(adapted);
+}
+
 void Adapter::Xaction::stop() {
     FUNCENTER();
     hostx = 0;
@@ -463,7 +475,17 @@ void Adapter::Xaction::abDiscard() {
 
 void Adapter::Xaction::abMake() {
     FUNCENTER();
-    Must(sendingAb == opUndecided); // have not yet started or decided not to send
+    // have not yet started or decided not to send
+    Must(sendingAb == opUndecided || sendingAb == opWaiting);
+
+    if (answering) {
+        sendingAb = opOn;
+        hostx->noteAbContentAvailable();
+        hostx->noteAbContentDone(true);
+        sendingAb = opComplete;
+        return;
+    }
+
     Must(hostx->virgin().body()); // that is our only source of ab content
 
     // we are or were receiving vb
@@ -489,46 +511,25 @@ void Adapter::Xaction::abStopMaking() {
 
 libecap::Area Adapter::Xaction::abContent(size_type offset, size_type size) {
     Must(sendingAb == opOn || sendingAb == opComplete);
-    return ResponsePage();
-    return libecap::Area::FromTempString(buffer.substr(offset, size));
+    // the page is buffered once cnStart() has decided what it says
+    const libecap::Area content = libecap::Area::FromTempString(buffer.substr(offset, size));
+    JAMES_PROBE3(ab_content, id, offset, content.size);
+    return content;
 }
 
 void Adapter::Xaction::abContentShift(size_type size) {
     FUNCENTER();
     Must(sendingAb == opOn || sendingAb == opComplete);
+    abBytes += size;
     buffer.erase(0, size);
 }
 
 void Adapter::Xaction::noteContentAvailable() {
     FUNCENTER();
 
-    if (sendingAb == opWaiting) {
-        adapted = hostx->virgin().clone();
-        Must(adapted != 0);
-
-        libecap::FirstLine *firstLine = &(adapted->firstLine());
-        libecap::StatusLine *statusLine = dynamic_cast<libecap::StatusLine*> (firstLine);
-
-        // do not remove the Content-Length header in 'reqmod'
-        if (statusLine)
-            adapted->header().removeAny(libecap::headerContentLength);
-
-
-        const libecap::Name name("Content-Type");
-        const libecap::Name disp("Content-Disposition");
-        const libecap::Header::Value value = libecap::Area::FromTempString("text/html");
-        adapted->header().removeAny(disp);
-        adapted->header().removeAny(name);
-        adapted->header().add(name, value);
-
-
-        const libecap::Name xname("X-Ecap");
-        const libecap::Header::Value xvalue = libecap::Area::FromTempString("JameseCapCaptivate");
-        adapted->header().add(xname, xvalue);
-
-        hostx->useAdapted(adapted);
-    }
-    hostx->noteAbContentAvailable();
+    // start() has sent the adapted header already
+    if (sendingAb == opOn)
+        hostx->noteAbContentAvailable();
 }
 
 // finished reading the virgin body
@@ -537,13 +538,15 @@ void Adapter::Xaction::noteVbContentDone(bool atEnd) {
     FUNCENTER();
     Must(receivingVb == opOn);
     receivingVb = opComplete;
+
+    cnStart();
+    buffer = ResponsePage().toString();
+    noteContentAvailable();
+
     if (sendingAb == opOn) {
         hostx->noteAbContentDone(atEnd);
         sendingAb = opComplete;
     }
-
-    cnStart();
-    noteContentAvailable();
 }
 
 void Adapter::Xaction::noteVbContentAvailable() {
@@ -553,6 +556,8 @@ void Adapter::Xaction::noteVbContentAvailable() {
 
     // get all virgin body
     const libecap::Area vb = hostx->vbContent(0, libecap::nsize);
+    vbBytes += vb.size;
+    JAMES_PROBE2(vb_content, id, vb.size);
 
     if (sendingAb == opUndecided) {
 
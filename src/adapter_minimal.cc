@@ -1,4 +1,8 @@
 #include "james_ecap.h"
+#include "james_captive.h"
+#include "james_probes.h"
+#include "james_shared.h"
+#include "james_stats.h"
 #include <iostream>
 #include <fstream>
 #include <libecap/common/registry.h>
@@ -24,6 +28,9 @@ namespace Adapter { // not required, but adds clarity
 
     class Service : public libecap::adapter::Service {
     public:
+        Service();
+        virtual ~Service();
+
         // About
         virtual std::string uri() const; // unique across all vendors
         virtual std::string tag() const; // changes with version and config
@@ -33,7 +40,6 @@ namespace Adapter { // not required, but adds clarity
         virtual void configure(const libecap::Options &cfg);
         virtual void reconfigure(const libecap::Options &cfg);
         virtual void setOne(const libecap::Name &name, const libecap::Area &valArea);
-        virtual void loadConfig(std::string conffile);
 
         // Lifecycle
         virtual void start(); // expect makeXaction() calls
@@ -49,11 +55,9 @@ namespace Adapter { // not required, but adds clarity
     public:
         // Configuration storage
         std::string clientIP; //client IP
-        mysqlpp::Connection conn;
-        std::string dbhost;
-        std::string dbname;
-        std::string dblogin;
-        std::string dbpassw;
+        DbConfig dbConfig;
+        bool failOpen; // whether to pass messages while the database is down
+        Snapshot<ClientDbs> dbs; // client state shared by all transactions
     };
 
     // Calls Service::setOne() for each host-provided configuration option.
@@ -132,11 +136,11 @@ namespace Adapter { // not required, but adds clarity
         void noBodySupport() const;
 
     private:
-        libecap::shared_ptr<const Service> sharedService; // configuration access
+        const Snapshot<ClientDbs>::Pointer dbs; // as of our creation
+        const XactionId id; // for tracing
         libecap::host::Xaction *hostx; // Host transaction rep
 
         std::string buffer; // for content adaptation
-        mysqlpp::Connection conn;
 
         typedef enum {
             opUndecided, opOn, opComplete, opNever
@@ -147,6 +151,12 @@ namespace Adapter { // not required, but adds clarity
     static const std::string CfgErrorPrefix = "Minimal Adapter: configuration error: ";
 } // namespace Adapter
 
+Adapter::Service::Service() : failOpen(true) {
+}
+
+Adapter::Service::~Service() {
+}
+
 std::string Adapter::Service::uri() const {
     return "ecap://e-cap.org/ecap/services/sample/minimal";
 }
@@ -156,7 +166,8 @@ std::string Adapter::Service::tag() const {
 }
 
 void Adapter::Service::describe(std::ostream &os) const {
-    os << "A minimal adapter from " << PACKAGE_NAME << " v" << PACKAGE_VERSION;
+    os << "A minimal adapter from " << PACKAGE_NAME << " v" << PACKAGE_VERSION << "\n";
+    DumpStats(os);
 }
 
 void Adapter::Service::configure(const libecap::Options &cfg) {
@@ -164,56 +175,21 @@ void Adapter::Service::configure(const libecap::Options &cfg) {
     cfg.visitEachOption(cfgtor);
 
     // check for post-configuration errors and inconsistencies
-    if (conn.connect(dbname.c_str(), dbhost.c_str(), dblogin.c_str(), dbpassw.c_str())) {
-        //All Ok
-    } else {
-        std::cerr << "DB connection failed: " << conn.error() << std::endl;
-    }
-
+    // connects in background; transactions keep the old ones until they end
+    dbs.set(Snapshot<ClientDbs>::Pointer(new ClientDbs(dbConfig, failOpen)));
 }
 
 void Adapter::Service::reconfigure(const libecap::Options &) {
     // this service is not configurable
 }
 
-void Adapter::Service::loadConfig(std::string conffile) {
-
-    char _buff[1024], tag[24], val[100];
-    std::ifstream cfg(conffile.c_str());
-
-    while (!cfg.eof()) {
-        cfg.getline(_buff, 1024);
-        if (_buff[0] != '#' && _buff[0] != '\n') {
-            //puts(_buff);
-            sscanf(_buff, "%s = \"%s", tag, val);
-            val[strlen(val) - 2] = 0;
-
-            if (!strcmp(tag, "dbhost")) {
-                if (dbhost.empty())
-                    dbhost.assign(val);
-            }
-            if (!strcmp(tag, "dbname")) {
-                if (dbname.empty())
-                    dbname.assign(val);
-            }
-            if (!strcmp(tag, "dblogin")) {
-                if (dblogin.empty())
-                    dblogin.assign(val);
-            }
-            if (!strcmp(tag, "dbpassw")) {
-                if (dbpassw.empty())
-                    dbpassw.assign(val);
-            }
-        }
-    }
-    cfg.close();
-}
-
 void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &valArea) {
     const std::string value = valArea.toString();
 
     if (name == "config") {
-        loadConfig(value);
+        dbConfig.load(value, Adapter::CfgErrorPrefix);
+    } else if (name == "db_failure") {
+        failOpen = ParseFailOpen(value, Adapter::CfgErrorPrefix);
     } else {
         if (name.assignedHostId())
             ; // skip host-standard options we do not know or care about
@@ -250,18 +226,12 @@ libecap::adapter::Xaction *Adapter::Service::makeXaction(libecap::host::Xaction
 /** constructor Xaction */
 Adapter::Xaction::Xaction(libecap::shared_ptr<Service> aService,
         libecap::host::Xaction *x) :
-sharedService(aService),hostx(x),receivingVb(opUndecided), sendingAb(opUndecided) {
-
-  
-
-    if (!aService->conn.connected()) {
-        throw libecap::TextException(Adapter::CfgErrorPrefix + "database not connected");
-    }
-    
-    conn = aService->conn;    
+dbs(aService->dbs.get()), id(NextXactionId()), hostx(x), receivingVb(opUndecided), sendingAb(opUndecided) {
+    JAMES_PROBE1(xaction_create, id);
 }
 
 Adapter::Xaction::~Xaction() {
+    JAMES_PROBE3(xaction_end, id, 0, 0); // we never touch bodies
     if (libecap::host::Xaction * x = hostx) {
         hostx = 0;
         x->adaptationAborted();
@@ -279,18 +249,20 @@ void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &) const {
 
 void Adapter::Xaction::start() {
     Must(hostx);
+    JAMES_PROBE1(xaction_start, id);
     // make this adapter non-callable
     libecap::host::Xaction *x = hostx;
     hostx = 0;
 
-    libecap::Area area = x->option(libecap::metaClientIp);
-    std::string update_query = "UPDATE clients SET `time`=NOW() WHERE ip=\"";
-    update_query.append(area.start).append("\"");
-
- 
-    mysqlpp::Query query =  conn.query(update_query.c_str());
-    mysqlpp::StoreQueryResult res = query.store();
-
+    ClientAddress client;
+    client.parse(x->option(libecap::metaClientIp));
+    JAMES_PROBE1(db_begin, id);
+    const bool recorded = dbs->local().touch(dbs->identity(client));
+    JAMES_PROBE2(db_end, id, recorded);
+    if (!recorded && !dbs->failOpen) {
+        x->blockVirgin(); // fail closed
+        return;
+    }
 
     // tell the host to use the virgin message
     x->useVirgin();
@@ -1,6 +1,22 @@
 #include "james_ecap.h"
+#include "james_budget.h"
+#include "james_buffer.h"
+#include "james_cache.h"
+#include "james_frequency.h"
+#include "james_headers.h"
+#include "james_http.h"
+#include "james_inject.h"
+#include "james_probes.h"
+#include "james_shadow.h"
+#include "james_shared.h"
+#include "james_stats.h"
+#include "james_workers.h"
+#include <algorithm>
 #include <iostream>
+#include <cstdlib>
 #include <fstream>
+#include <sstream>
+#include <cctype>
 #include <libecap/common/registry.h>
 #include <libecap/common/errors.h>
 #include <libecap/common/message.h>
@@ -22,8 +38,45 @@ namespace Adapter { // not required, but adds clarity
 
     using libecap::size_type;
 
+    // Configuration storage; immutable once configured, so that
+    // transactions on any host thread may use it during reconfiguration.
+
+    class Config {
+    public:
+        Config();
+
+        std::string script; // file contains js code fragment or url
+        std::string victim; // the text we want to replace
+        std::string replacement; // markup injected before the closing body tag
+        size_type memoryCap; // per-transaction buffer limit; zero means unlimited
+        std::string spillDir; // where buffers above memoryCap spill; empty disables
+        size_type highWatermark; // stop taking vb when this much ab is buffered
+        size_type lowWatermark; // resume taking vb when ab drains to this level
+        size_type holdSize; // bodies up to this size are held to compute Content-Length
+        size_type memoryBudget; // all transactions together; zero means unlimited
+        HeaderRules headerRules; // edits of the adapted header
+        size_type cacheSize; // adapted body cache budget; zero disables caching
+        size_type cacheEntryMax; // larger bodies are not cached
+        uint64_t payloadVersion; // identifies the replacement markup
+        unsigned int workers; // threads adapting large bodies; zero adapts inline
+        size_type offloadSize; // bodies from this size on are adapted by workers
+        unsigned int injectPages; // pages per client and host that get the script; zero is all
+        time_t injectWindow; // seconds until injectPages starts over; zero is never
+        size_type injectClients; // clients and hosts the cap remembers
+        double shadowRate; // fraction of transactions also adapted the other way
+        uint64_t shadowMemory; // bytes of virgin copies shadowing may hold
+        double shadowCpu; // fraction of one core shadow runs may use
+        std::string shadowReplacement; // the alternative markup
+        bool shadowWhole; // the alternative injects into the whole body at once
+        libecap::shared_ptr<BodyCache> cache; // shared with later configurations
+        libecap::shared_ptr<FrequencyCap> frequencyCap; // nil unless capping
+        libecap::shared_ptr<ShadowBudget> shadow; // nil unless shadowing
+    };
+
     class Service : public libecap::adapter::Service {
     public:
+        Service();
+
         // About
         virtual std::string uri() const; // unique across all vendors
         virtual std::string tag() const; // changes with version and config
@@ -39,6 +92,12 @@ namespace Adapter { // not required, but adds clarity
         virtual void stop(); // no more makeXaction() calls until start()
         virtual void retire(); // no more makeXaction() calls
 
+        // Asynchronous transactions: bodies adapted by workers are
+        // delivered from the host's suspend/resume polling
+        virtual bool makesAsyncXactions() const;
+        virtual void suspend(timeval &timeout);
+        virtual void resume();
+
         // Scope (XXX: this may be changed to look at the whole header)
         virtual bool wantsUrl(const char *url) const;
 
@@ -46,13 +105,16 @@ namespace Adapter { // not required, but adds clarity
         virtual libecap::adapter::Xaction *makeXaction(libecap::host::Xaction *hostx);
 
     public:
-        // Configuration storage
-        std::string script; // file contains js code fragment or url
-        std::string victim; // the text we want to replace
-        std::string replacement; // what the replace the victim with
+        Snapshot<Config> config; // the current configuration
+        const libecap::shared_ptr<WorkerPool> pool; // outlives configurations
 
     protected:
         void setVictim(const std::string &value);
+        size_type parseSize(const libecap::Name &name, const std::string &value) const;
+        double parseFraction(const libecap::Name &name, const std::string &value) const;
+
+    private:
+        libecap::shared_ptr<Config> pending; // being configured
     };
 
     // Calls Service::setOne() for each host-provided configuration option.
@@ -70,6 +132,8 @@ namespace Adapter { // not required, but adds clarity
         Service &svc;
     };
 
+    class AdaptJob;
+
     class Xaction : public libecap::adapter::Xaction {
     public:
         Xaction(libecap::shared_ptr<Service> s, libecap::host::Xaction *x);
@@ -99,17 +163,55 @@ namespace Adapter { // not required, but adds clarity
 
         // libecap::Callable API, via libecap::host::Xaction
         virtual bool callable() const;
+        virtual void resume();
+
+        void wake(); // our job is done; asks the host to resume() us
 
     protected:
-        void adaptContent(std::string &chunk) const; // converts vb to ab
+        void adaptContent(std::string &chunk); // converts vb to ab
+        void consumeVb(); // adapts and buffers available vb unless paused
+        bool offloads(size_type size) const; // whether a worker should adapt
+        bool admits(); // whether the frequency cap lets the response have the script
+        void absorb(std::string &chunk, size_type size); // buffers adapted vb
+        void copyForShadow(const std::string &chunk); // keeps virgin chunk
+        void startShadow(); // gives the copy to a worker
+        void dropShadow(); // gives up on shadowing this transaction
+        void finishAb(); // tells the host there will be no more ab
+        void releaseHeld(); // sends the held adapted header with its length
+        std::string makeCacheKey(const libecap::Area &uri); // empty if uncacheable
+        void admitToCache(); // caches the adapted body if it is all there
         void stopVb(); // stops receiving vb (if we are receiving it)
         libecap::host::Xaction *lastHostCall(); // clears hostx
 
     private:
-        libecap::shared_ptr<const Service> sharedService; // configuration access
+        const Snapshot<Config>::Pointer config; // as of our creation
+        const libecap::shared_ptr<WorkerPool> pool;
+        const XactionId id; // for tracing
         libecap::host::Xaction *hostx; // Host transaction rep
-
-        std::string buffer; // for content adaptation
+        AdaptJob *job; // vb being adapted by a worker, at most one at a time
+
+        BodyBuffer buffer; // for content adaptation
+        bool bypassing; // the rest of vb is forwarded as is, without copying
+        bool pausedVb; // not taking vb until the host drains our buffer
+        bool injected; // the script went into the adapted body
+        bool vbAtEnd; // how the virgin body ended, valid after receivingVb
+
+        // adapted header withheld until its Content-Length is known
+        libecap::shared_ptr<libecap::Message> heldAdapted;
+        size_type virginSize; // known virgin body length when holding or caching
+        size_type vbConsumed; // virgin bytes adapted so far
+
+        std::string cacheKey; // empty unless the adapted body may be cached
+        std::string caching; // a copy of the adapted body for the cache
+        MemoryBudget::Share cachingShare; // caching bytes, against the budget
+        BodyCache::Body cached; // the adapted body served from the cache
+        size_type cachedShift; // how much of the cached body the host consumed
+        uint64_t abBytes; // adapted body bytes sent, for tracing
+
+        bool shadowing; // keeping a copy of vb for a shadow run
+        std::string shadowVirgin; // the vb adapted so far
+        std::vector<size_type> shadowChunks; // how we cut shadowVirgin
+        MemoryBudget::Share shadowShare; // shadowVirgin bytes, against the budget
 
         typedef enum {
             opUndecided, opOn, opComplete, opNever
@@ -118,11 +220,91 @@ namespace Adapter { // not required, but adds clarity
         OperationState sendingAb;
     };
 
+    // A piece of vb adapted on a worker thread. The vb stays with the host
+    // until its transaction takes the result back on the host thread, so
+    // a result that cannot be buffered is forwarded unadapted, as usual.
+
+    class AdaptJob : public WorkerPool::Job {
+    public:
+        AdaptJob(const Snapshot<Config>::Pointer &aConfig, Xaction *anOwner,
+            std::string &aChunk, size_type aSize);
+
+        virtual void run(); // converts chunk; on a worker thread
+        void deliver(); // tells the owner; on the host thread, once run
+
+        const Snapshot<Config>::Pointer config; // kept alive for run()
+        std::string chunk; // virgin, then adapted
+        const size_type size; // virgin bytes in chunk
+        bool injected; // whether run() inserted the replacement
+        Xaction *owner; // nil if the transaction ended meanwhile
+        bool delivered; // owner was told
+    };
+
+    // Adapts a copy of a whole virgin body both ways on a worker thread:
+    // again as the transaction did, cut into the same chunks, and the
+    // alternative way. Records how the outputs and CPU times compare.
+    // Nothing flows back to the transaction, which may be gone by then.
+
+    class ShadowJob : public WorkerPool::Job {
+    public:
+        ShadowJob(const Snapshot<Config>::Pointer &aConfig, std::string &aVirgin,
+            std::vector<size_type> &someChunks);
+        virtual ~ShadowJob(); // releases the copy
+
+        virtual void run(); // on a worker thread
+
+    private:
+        // the virgin body with markup injected into each chunk in turn
+        static std::string Adapt(const std::string &virgin,
+            const std::vector<size_type> &chunks, const std::string &markup, bool &injected);
+
+        const Snapshot<Config>::Pointer config; // kept alive for run()
+        std::string virgin;
+        std::vector<size_type> chunks; // piece sizes the transaction adapted
+        MemoryBudget::Share share; // virgin bytes, against the budget
+    };
+
     static const std::string CfgErrorPrefix =
             "Modifying Adapter: configuration error: ";
 
 } // namespace Adapter
 
+// jobs waiting for or taken by each worker, at most; more are adapted inline
+#define WORKER_DEPTH 16
+// transactions waiting for workers are checked on this often, at least
+#define WORKER_TICK_USEC 1000
+
+static Adapter::Counter BypassedXactions("modifying.bypassed_xactions");
+static Adapter::Counter PausedVb("modifying.paused_vb");
+static Adapter::Counter OverloadedXactions("modifying.overloaded_xactions");
+static Adapter::Counter OffloadedChunks("modifying.offloaded_chunks");
+static Adapter::Counter RetriedChunks("modifying.retried_chunks");
+static Adapter::Counter ShadowSampled("shadow.sampled");
+static Adapter::Counter ShadowAbandoned("shadow.abandoned");
+static Adapter::Counter ShadowBusy("shadow.busy_skips");
+static Adapter::Counter ShadowCompared("shadow.compared");
+static Adapter::Counter ShadowIdentical("shadow.identical");
+static Adapter::Counter ShadowDifferent("shadow.different");
+static Adapter::Counter ShadowPrimaryBytes("shadow.primary_bytes");
+static Adapter::Counter ShadowAlternativeBytes("shadow.alternative_bytes");
+static Adapter::Counter ShadowPrimaryInjected("shadow.primary_injected");
+static Adapter::Counter ShadowAlternativeInjected("shadow.alternative_injected");
+static Adapter::Counter ShadowPrimaryUsec("shadow.primary_usec");
+static Adapter::Counter ShadowAlternativeUsec("shadow.alternative_usec");
+static Adapter::Counter ShadowCompareUsec("shadow.compare_usec");
+
+Adapter::Config::Config() : memoryCap(1024 * 1024),
+highWatermark(256 * 1024), lowWatermark(64 * 1024), holdSize(64 * 1024),
+memoryBudget(256 * 1024 * 1024),
+cacheSize(16 * 1024 * 1024), cacheEntryMax(256 * 1024), payloadVersion(0),
+workers(0), offloadSize(64 * 1024), injectPages(0), injectWindow(0),
+injectClients(64 * 1024), shadowRate(0), shadowMemory(16 * 1024 * 1024),
+shadowCpu(0.1), shadowWhole(false) {
+}
+
+Adapter::Service::Service() : pool(new WorkerPool(WORKER_DEPTH)) {
+}
+
 std::string Adapter::Service::uri() const {
     return "ecap://murka.cz/james/modifying";
 }
@@ -132,23 +314,91 @@ std::string Adapter::Service::tag() const {
 }
 
 void Adapter::Service::describe(std::ostream &os) const {
-    os << "A modifying adapter from " << PACKAGE_NAME << " v" << PACKAGE_VERSION;
+    os << "A modifying adapter from " << PACKAGE_NAME << " v" << PACKAGE_VERSION << "\n";
+    DumpStats(os);
+    os << "budget.used_bytes: " << MemoryBudget::Used() << "\n";
 }
 
 void Adapter::Service::configure(const libecap::Options &cfg) {
+    pending.reset(new Config);
+    pending->headerRules.parse(
+            "add X-Ecap " + libecap::MyHost().uri() + "\n"
+            "remove Accept-Encoding\n" // we cannot inject into compressed bodies
+            "add Warning 214 Transformation applied\n", // RFC 2616 14.46
+            Adapter::CfgErrorPrefix);
     Cfgtor cfgtor(*this);
     cfg.visitEachOption(cfgtor);
 
     // check for post-configuration errors and inconsistencies
 
-    if (script.empty()) {
+    if (pending->script.empty()) {
         throw libecap::TextException(Adapter::CfgErrorPrefix + "script value is not set");
     }
+
+    if (pending->lowWatermark > pending->highWatermark) {
+        throw libecap::TextException(Adapter::CfgErrorPrefix +
+                "low_watermark exceeds high_watermark");
+    }
+
+    pending->payloadVersion = BodyCache::Version(pending->replacement);
+    if (pending->cacheSize) {
+        const Snapshot<Config>::Pointer old = config.get();
+        if (old && old->cache && old->cache->budget() == pending->cacheSize) {
+            pending->cache = old->cache; // keeps popular pages warm
+            if (old->payloadVersion != pending->payloadVersion)
+                pending->cache->clear(); // pages with the old script
+        } else {
+            pending->cache.reset(new BodyCache(pending->cacheSize));
+        }
+    }
+
+    if (pending->injectWindow && !pending->injectPages)
+        pending->injectPages = 1; // once per window
+    if (pending->injectPages) {
+        if (!pending->injectClients) {
+            throw libecap::TextException(Adapter::CfgErrorPrefix +
+                    "inject_clients must be positive");
+        }
+        const Snapshot<Config>::Pointer old = config.get();
+        if (old && old->frequencyCap && old->frequencyCap->same(pending->injectClients,
+                pending->injectPages, pending->injectWindow)) {
+            pending->frequencyCap = old->frequencyCap; // clients keep their counts
+        } else {
+            pending->frequencyCap.reset(new FrequencyCap(pending->injectClients,
+                    pending->injectPages, pending->injectWindow));
+        }
+    }
+
+    if (pending->shadowRate > 0) {
+        if (!pending->workers) {
+            throw libecap::TextException(Adapter::CfgErrorPrefix +
+                    "shadow_rate requires workers");
+        }
+        if (pending->shadowCpu <= 0) {
+            throw libecap::TextException(Adapter::CfgErrorPrefix +
+                    "shadow_cpu must be positive");
+        }
+        if (pending->shadowReplacement.empty())
+            pending->shadowReplacement = pending->replacement;
+        pending->shadow.reset(new ShadowBudget(pending->shadowRate,
+                pending->shadowMemory, pending->shadowCpu));
+    }
+
+    if (pending->workers > WORKER_LIMIT) {
+        std::ostringstream limit;
+        limit << WORKER_LIMIT;
+        throw libecap::TextException(Adapter::CfgErrorPrefix +
+                "workers exceeds " + limit.str());
+    }
+    pool->start(pending->workers); // keeps the threads of older configurations
+
+    MemoryBudget::Limit(pending->memoryBudget);
+    config.set(pending);
+    pending.reset();
 }
 
 void Adapter::Service::reconfigure(const libecap::Options &cfg) {
-    victim.clear();
-    replacement.clear();
+    // transactions keep using the old configuration until they end
     configure(cfg);
 }
 
@@ -156,8 +406,53 @@ void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &va
     const std::string value = valArea.toString();
 
     if (name == "script") {
-        script.append(value);
+        pending->script.append(value);
         setVictim(value);
+    } else if (name == "memory_cap") {
+        pending->memoryCap = parseSize(name, value);
+    } else if (name == "spill_dir") {
+        pending->spillDir = value;
+    } else if (name == "high_watermark") {
+        pending->highWatermark = parseSize(name, value);
+    } else if (name == "low_watermark") {
+        pending->lowWatermark = parseSize(name, value);
+    } else if (name == "hold_size") {
+        pending->holdSize = parseSize(name, value);
+    } else if (name == "memory_budget") {
+        pending->memoryBudget = parseSize(name, value);
+    } else if (name == "header_rules") {
+        pending->headerRules.clear(); // replaces the defaults
+        pending->headerRules.load(value, Adapter::CfgErrorPrefix);
+    } else if (name == "cache_size") {
+        pending->cacheSize = parseSize(name, value);
+    } else if (name == "cache_entry_max") {
+        pending->cacheEntryMax = parseSize(name, value);
+    } else if (name == "workers") {
+        pending->workers = parseSize(name, value);
+    } else if (name == "offload_size") {
+        pending->offloadSize = parseSize(name, value);
+    } else if (name == "inject_pages") {
+        pending->injectPages = parseSize(name, value);
+    } else if (name == "inject_window") {
+        pending->injectWindow = parseSize(name, value);
+    } else if (name == "inject_clients") {
+        pending->injectClients = parseSize(name, value);
+    } else if (name == "shadow_rate") {
+        pending->shadowRate = parseFraction(name, value);
+    } else if (name == "shadow_memory") {
+        pending->shadowMemory = parseSize(name, value);
+    } else if (name == "shadow_cpu") {
+        pending->shadowCpu = parseFraction(name, value);
+    } else if (name == "shadow_script") {
+        pending->shadowReplacement.append(LoadScript(value, Adapter::CfgErrorPrefix));
+    } else if (name == "shadow_inject") {
+        if (value == "whole")
+            pending->shadowWhole = true;
+        else if (value == "chunks")
+            pending->shadowWhole = false;
+        else
+            throw libecap::TextException(Adapter::CfgErrorPrefix +
+                "invalid shadow_inject value: " + value);
     } else {
         if (name.assignedHostId())
             ; // skip host-standard options we do not know or care about
@@ -167,40 +462,26 @@ void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &va
     }
 }
 
-void Adapter::Service::setVictim(const std::string &value) {
-    if (value.empty()) {
+libecap::size_type Adapter::Service::parseSize(const libecap::Name &name, const std::string &value) const {
+    char *end = 0;
+    const unsigned long size = strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end)
         throw libecap::TextException(Adapter::CfgErrorPrefix +
-                "empty script value is not allowed");
-    }
-
-    std::cout << "set victim\n";
-
-    if (value.find("http", value.size()) != std::string::npos) {
-        replacement.append("<script src=\"");
-        replacement.append(value);
-        replacement.append("\"></script>");
-    } else {
-        std::ifstream is(value.c_str(), std::ifstream::binary);
-
-        is.seekg(0, is.end);
-        int length = is.tellg();
-        is.seekg(0, is.beg);
-        char * buffer = new char [length];
-        is.read(buffer, length);
-        if (is) {
-            replacement.append("<script>");
-            replacement.append(buffer);
-            replacement.append("</script>");
-            is.close();
-        } else {
-            is.close();
-            throw libecap::TextException(Adapter::CfgErrorPrefix +
-                    "Can't read js fragment file: " + value);
-        }
-    }
-
+            "invalid " + name.image() + " value: " + value);
+    return size;
+}
 
+double Adapter::Service::parseFraction(const libecap::Name &name, const std::string &value) const {
+    char *end = 0;
+    const double fraction = strtod(value.c_str(), &end);
+    if (value.empty() || *end || !(fraction >= 0 && fraction <= 1))
+        throw libecap::TextException(Adapter::CfgErrorPrefix +
+            "invalid " + name.image() + " value: " + value);
+    return fraction;
+}
 
+void Adapter::Service::setVictim(const std::string &value) {
+    pending->replacement.append(LoadScript(value, Adapter::CfgErrorPrefix));
 }
 
 void Adapter::Service::start() {
@@ -218,6 +499,30 @@ void Adapter::Service::retire() {
     libecap::adapter::Service::stop();
 }
 
+// always, as workers may be turned on by reconfiguration
+bool Adapter::Service::makesAsyncXactions() const {
+    return true;
+}
+
+void Adapter::Service::suspend(timeval &timeout) {
+    // come back soon if a worker has or will have a body for us
+    if (pool->busy() && (timeout.tv_sec > 0 || timeout.tv_usec > WORKER_TICK_USEC)) {
+        timeout.tv_sec = 0;
+        timeout.tv_usec = WORKER_TICK_USEC;
+    }
+}
+
+void Adapter::Service::resume() {
+    std::vector<WorkerPool::Job*> jobs;
+    pool->completed(jobs);
+    for (std::vector<WorkerPool::Job*>::iterator i = jobs.begin(); i != jobs.end(); ++i) {
+        if (AdaptJob *job = dynamic_cast<AdaptJob*> (*i))
+            job->deliver();
+        else
+            delete *i; // a shadow run; it recorded its results
+    }
+}
+
 bool Adapter::Service::wantsUrl(const char *url) const {
     return true; // no-op is applied to all messages
 }
@@ -229,10 +534,23 @@ libecap::adapter::Xaction *Adapter::Service::makeXaction(libecap::host::Xaction
 /** constructor Xaction */
 Adapter::Xaction::Xaction(libecap::shared_ptr<Service> aService,
         libecap::host::Xaction *x) :
-sharedService(aService), hostx(x), receivingVb(opUndecided), sendingAb(opUndecided) {
+config(aService->config.get()), pool(aService->pool), id(NextXactionId()), hostx(x), job(0),
+bypassing(false), pausedVb(false), injected(false),
+vbAtEnd(false), virginSize(0), vbConsumed(0), cachedShift(0), abBytes(0), shadowing(false),
+receivingVb(opUndecided), sendingAb(opUndecided) {
+    buffer.configure(config->memoryCap, config->spillDir);
+    JAMES_PROBE1(xaction_create, id);
 }
 
 Adapter::Xaction::~Xaction() {
+    JAMES_PROBE3(xaction_end, id, vbConsumed, abBytes);
+    if (job) {
+        if (job->delivered)
+            delete job;
+        else
+            job->owner = 0; // deliver() deletes it
+    }
+    dropShadow();
     if (libecap::host::Xaction * x = hostx) {
         hostx = 0;
         x->adaptationAborted();
@@ -251,57 +569,97 @@ void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &) const {
 /* Zacatek procesu*/
 void Adapter::Xaction::start() {
     Must(hostx);
-    if (hostx->virgin().body()) {
-        receivingVb = opOn;
-        hostx->vbMake(); // ask host to supply virgin body
-    } else {
-        // we are not interested in vb if there is not one
-        receivingVb = opNever;
-    }
-
+    JAMES_PROBE1(xaction_start, id);
 
+    if (MemoryBudget::Exceeded()) {
+        // the script is optional; the proxy staying up is not
+        OverloadedXactions.add();
+        lastHostCall()->useVirgin();
+        return;
+    }
 
     libecap::Area uri;
+    bool isRequest = false;
     typedef const libecap::RequestLine *CLRLP;
-    if (CLRLP requestLine = dynamic_cast<CLRLP> (&hostx->virgin().firstLine()))
+    if (CLRLP requestLine = dynamic_cast<CLRLP> (&hostx->virgin().firstLine())) {
         uri = requestLine->uri();
-    else
+        isRequest = true;
+    } else
         if (CLRLP requestLine = dynamic_cast<CLRLP> (&hostx->cause().firstLine()))
         uri = requestLine->uri();
 
-
-    std::cout << "Modifing start: " << uri << std::endl;
-
+    if (!isRequest && !admits()) {
+        // the client got the script recently; do not even look at the body
+        lastHostCall()->useVirgin();
+        return;
+    }
 
     /* adapt message header */
 
     libecap::shared_ptr<libecap::Message> adapted = hostx->virgin().clone();
     Must(adapted != 0);
 
-    // delete ContentLength header because we may change the length
-    // unknown length may have performance implications for the host
-    adapted->header().removeAny(libecap::headerContentLength);
-
-    // add a custom header
-    static const libecap::Name name("X-Ecap");
-    const libecap::Header::Value value =
-            libecap::Area::FromTempString(libecap::MyHost().uri());
-    adapted->header().add(name, value);
-
-    if (adapted->header().hasAny(libecap::Name("Accept-Encoding"))) //Nekomprimovat!
-        adapted->header().removeAny(libecap::Name("Accept-Encoding"));
-
-    // Add Warning header to response, according to RFC 2616 14.46
-    static const libecap::Name warningName("Warning");
-    const libecap::Header::Value warningValue = libecap::Area::FromTempString("214 Transformation applied");
-    adapted->header().add(warningName, warningValue);
+    config->headerRules.apply(adapted->header());
+    // a response gets our ETag only with a body we inject into, or when
+    // it revalidates one (304); capped clients keep the origin's tags
+    const uint64_t version = config->payloadVersion;
+    if (isRequest || (!adapted->body() && RevalidatesInjected(hostx->cause().header(), version)))
+        RewriteValidators(adapted->header(), isRequest, version);
 
     if (!adapted->body()) {
+        // keep Content-Length: it describes a body we do not see (e.g., HEAD)
+        receivingVb = opNever; // we are not interested in vb if there is not one
         sendingAb = opNever; // there is nothing to send
         lastHostCall()->useAdapted(adapted);
-    } else {
+        return;
+    }
+
+    const bool injectable = !isRequest && Injectable(hostx->virgin());
+    if (injectable && config->cache) {
+        cacheKey = makeCacheKey(uri);
+        if (!cacheKey.empty() && (cached = config->cache->find(cacheKey))) {
+            // we injected into this very page before; skip the virgin body
+            cacheKey.clear();
+            hostx->vbDiscard();
+            receivingVb = opNever;
+            vbAtEnd = true;
+            RewriteValidators(adapted->header(), isRequest, version);
+            SetContentLength(adapted->header(), cached->size());
+            hostx->useAdapted(adapted);
+            return;
+        }
+    }
+
+    receivingVb = opOn;
+    hostx->vbMake(); // ask host to supply virgin body
+
+    if (!injectable) {
+        // we only edit the headers of requests and of responses other than
+        // pages; uploads, images and the like go through untouched,
+        // without copying, and keep their Content-Length
+        bypassing = true;
         hostx->useAdapted(adapted);
+        return;
+    }
+
+    if (config->shadow && config->shadow->sample()) {
+        shadowing = true;
+        ShadowSampled.add();
     }
+
+    if (KnownBodySize(hostx->virgin(), virginSize) && virginSize <= config->holdSize) {
+        // small body: send the header once we know the adapted length
+        // and whether the script went in
+        heldAdapted = adapted;
+        return;
+    }
+
+    // the header leaves before we see the closing body tag
+    RewriteValidators(adapted->header(), isRequest, version);
+    // delete ContentLength header because we may change the length
+    // unknown length may have performance implications for the host
+    adapted->header().removeAny(libecap::headerContentLength);
+    hostx->useAdapted(adapted);
 }
 
 void Adapter::Xaction::stop() {
@@ -320,17 +678,27 @@ void Adapter::Xaction::abMake() {
     Must(sendingAb == opUndecided); // have not yet started or decided not to send
     Must(hostx->virgin().body()); // that is our only source of ab content
 
+    sendingAb = opOn;
+    if (cached) {
+        hostx->noteAbContentAvailable();
+        finishAb(); // the whole body is in the cache
+        return;
+    }
+
     // we are or were receiving vb
     Must(receivingVb == opOn || receivingVb == opComplete);
 
-    sendingAb = opOn;
-    if (!buffer.empty())
+    if (!buffer.empty() || bypassing)
         hostx->noteAbContentAvailable();
+    if (receivingVb == opComplete && !pausedVb && !job)
+        finishAb(); // vb ended before the host asked for ab
 }
 
 void Adapter::Xaction::abMakeMore() {
     Must(receivingVb == opOn); // a precondition for receiving more vb
-    hostx->vbMakeMore();
+    // a slow client must not make us hold more than highWatermark
+    if (!pausedVb)
+        hostx->vbMakeMore();
 }
 
 void Adapter::Xaction::abStopMaking() {
@@ -341,85 +709,401 @@ void Adapter::Xaction::abStopMaking() {
 
 libecap::Area Adapter::Xaction::abContent(size_type offset, size_type size) {
     Must(sendingAb == opOn || sendingAb == opComplete);
-    return libecap::Area::FromTempString(buffer.substr(offset, size));
+    // adapted content comes first, followed by unadapted vb when bypassing
+    const libecap::Area content = cached ?
+        BodyCache::Content(cached, cachedShift + offset, size) :
+        (offset < buffer.size() || !bypassing) ?
+        buffer.content(offset, size) :
+        hostx->vbContent(offset - buffer.size(), size);
+    JAMES_PROBE3(ab_content, id, offset, content.size);
+    return content;
 }
 
 void Adapter::Xaction::abContentShift(size_type size) {
     Must(sendingAb == opOn || sendingAb == opComplete);
-    buffer.erase(0, size);
+    abBytes += size;
+    if (cached) {
+        cachedShift += size;
+        return;
+    }
+
+    const size_type buffered = std::min(size, buffer.size());
+    buffer.shift(buffered);
+    if (size > buffered) {
+        Must(bypassing);
+        hostx->vbContentShift(size - buffered);
+    }
+
+    if (pausedVb && buffer.size() <= config->lowWatermark) {
+        // the client caught up; take the vb that waited for us
+        pausedVb = false;
+        consumeVb();
+        if (receivingVb == opOn)
+            hostx->vbMakeMore();
+        else if (!pausedVb && !job)
+            finishAb(); // vb ended while we were paused
+        if (sendingAb == opOn)
+            hostx->noteAbContentAvailable();
+    }
 }
 
 void Adapter::Xaction::noteVbContentDone(bool atEnd) {
     Must(receivingVb == opOn);
     receivingVb = opComplete;
-    if (sendingAb == opOn) {
-        hostx->noteAbContentDone(atEnd);
-        sendingAb = opComplete;
-    }
+    vbAtEnd = atEnd;
+    if (job)
+        return; // resume() finishes once the worker is done
+    releaseHeld();
+    // while paused, the host still has vb that we have not adapted yet
+    if (!pausedVb)
+        finishAb();
 }
 
 void Adapter::Xaction::noteVbContentAvailable() {
     Must(receivingVb == opOn);
 
-    const libecap::Area vb = hostx->vbContent(0, libecap::nsize); // get all vb
-    std::string chunk = vb.toString(); // expensive, but simple
-    hostx->vbContentShift(vb.size); // we have a copy; do not need vb any more
-    adaptContent(chunk);
-    buffer += chunk; // buffer what we got
+    consumeVb();
 
     if (sendingAb == opOn)
         hostx->noteAbContentAvailable();
 }
 
-void Adapter::Xaction::adaptContent(std::string &chunk) const {
-    // this is oversimplified; production code should worry about arbitrary
-    // chunk boundaries, content encodings, service reconfigurations, etc.
+void Adapter::Xaction::consumeVb() {
+    if (bypassing || pausedVb || job)
+        return;
 
-    const std::string victim1 = "</body>";
-    const std::string victim2 = "</BODY>";
-    const std::string victim3 = "</Body>";
-    const std::string &replacement = sharedService->replacement;
+    // held bodies are small and cannot drain before we send the header
+    if (!heldAdapted && buffer.size() >= config->highWatermark) {
+        // leave vb with the host; its buffer limits will slow the origin
+        pausedVb = true;
+        PausedVb.add();
+        return;
+    }
 
-    std::cout << "Chunk\n";
-    //    std::cout << chunk;
+    const libecap::Area vb = hostx->vbContent(0, libecap::nsize); // get all vb
+    if (!vb.size)
+        return;
+    JAMES_PROBE2(vb_content, id, vb.size);
+    std::string chunk = vb.toString(); // expensive, but simple
+    if (shadowing)
+        copyForShadow(chunk);
+    if (offloads(vb.size)) {
+        // the vb stays with the host until the worker is done with it
+        job = new AdaptJob(config, this, chunk, vb.size);
+        if (pool->submit(job)) {
+            OffloadedChunks.add();
+            return;
+        }
+        chunk.swap(job->chunk); // the workers are busy; adapt it ourselves
+        delete job;
+        job = 0;
+    }
+    adaptContent(chunk);
+    absorb(chunk, vb.size);
+}
 
+// large bodies only: handing a chunk over costs a host round trip
+bool Adapter::Xaction::offloads(size_type size) const {
+    if (!config->workers || !config->offloadSize)
+        return false;
+    return virginSize >= config->offloadSize ||
+        vbConsumed + size >= config->offloadSize;
+}
 
+// only HTML pages count, as only they can carry the script
+bool Adapter::Xaction::admits() {
+    if (!config->frequencyCap)
+        return true;
+
+    const libecap::Message &virgin = hostx->virgin();
+    if (!virgin.body() || !Injectable(virgin))
+        return true;
+
+    // one key for the textual forms of an address, e.g. IPv4-mapped
+    ClientAddress client;
+    if (!client.parse(hostx->option(libecap::metaClientIp)) || !client.known())
+        return true; // we cannot tell clients apart
+
+    static const libecap::Name headerHost("Host");
+    const libecap::Header &request = hostx->cause().header();
+    const std::string host = request.hasAny(headerHost) ?
+        request.value(headerHost).toString() : std::string();
+    return config->frequencyCap->admit(client, host, time(NULL));
+}
 
+// takes the first size bytes of vb, adapted into chunk
+void Adapter::Xaction::absorb(std::string &chunk, size_type size) {
+    if (buffer.append(chunk)) { // buffer what we got
+        hostx->vbContentShift(size); // we have a copy; do not need vb any more
+        vbConsumed += size;
+        if (!cacheKey.empty()) {
+            if (caching.size() + chunk.size() <= config->cacheEntryMax) {
+                caching.append(chunk);
+            } else {
+                cacheKey.clear(); // too big to cache after all
+                std::string().swap(caching);
+            }
+            cachingShare.set(caching.size());
+        }
+    } else {
+        // we may not buffer more; leave vb (unadapted) with the host
+        // and forward it without copying once our buffer drains
+        bypassing = true;
+        admitToCache(); // drops the incomplete copy
+        dropShadow(); // what we send is no longer our adaptation
+        BypassedXactions.add();
+        releaseHeld();
+    }
+}
 
-    std::string::size_type pos = 0;
-    if ((pos = chunk.find(victim1, pos)) != std::string::npos) {
-        chunk.replace(pos, victim1.length(), replacement + "</body>");
-        pos += replacement.size();
-        std::cout << "body adapted\n";
+void Adapter::Xaction::releaseHeld() {
+    if (!heldAdapted)
+        return;
 
-    } else {
+    libecap::shared_ptr<libecap::Message> adapted = heldAdapted;
+    heldAdapted.reset();
 
-        pos = 0;
-        if ((pos = chunk.find(victim2, pos)) != std::string::npos) {
-            chunk.replace(pos, victim2.length(), replacement + "</BODY>");
-            pos += replacement.size();
-            std::cout << "BODY adapted\n";
-        } else {
+    if (injected)
+        RewriteValidators(adapted->header(), false, config->payloadVersion);
 
-            pos = 0;
-            if ((pos = chunk.find(victim3, pos)) != std::string::npos) {
-                chunk.replace(pos, victim3.length(), replacement + "</Body>");
-                pos += replacement.size();
-                std::cout << "Body adapted\n";
+    // what we adapted plus whatever virgin content we will forward as is
+    if ((receivingVb == opComplete && !vbAtEnd) || vbConsumed > virginSize)
+        adapted->header().removeAny(libecap::headerContentLength);
+    else
+        SetContentLength(adapted->header(), buffer.size() + (virginSize - vbConsumed));
+    hostx->useAdapted(adapted);
+}
 
-            }
+// the cache key of the adapted response body: URL, virgin validators and
+// length, and the payload version; empty if the response may not be cached
+std::string Adapter::Xaction::makeCacheKey(const libecap::Area &uri) {
+    const libecap::Message &virgin = hostx->virgin();
+    typedef const libecap::StatusLine *CLSLP;
+    const CLSLP statusLine = dynamic_cast<CLSLP> (&virgin.firstLine());
+    if (!statusLine || statusLine->statusCode() != 200 || !uri.size)
+        return std::string();
+    if (!KnownBodySize(virgin, virginSize) || virginSize > config->cacheEntryMax)
+        return std::string();
+
+    static const libecap::Name setCookie("Set-Cookie");
+    static const libecap::Name vary("Vary");
+    static const libecap::Name cacheControl("Cache-Control");
+    static const libecap::Name etag("ETag");
+    static const libecap::Name lastModified("Last-Modified");
+
+    const libecap::Header &header = virgin.header();
+    if (header.hasAny(setCookie) || header.hasAny(vary))
+        return std::string(); // the page may differ from client to client
+    if (header.hasAny(cacheControl)) {
+        std::string directives = header.value(cacheControl).toString();
+        std::transform(directives.begin(), directives.end(), directives.begin(), ::tolower);
+        if (directives.find("no-store") != std::string::npos ||
+                directives.find("no-cache") != std::string::npos ||
+                directives.find("private") != std::string::npos)
+            return std::string();
+    }
 
+    const std::string etagValue = header.hasAny(etag) ?
+        header.value(etag).toString() : std::string();
+    const std::string lastModifiedValue = header.hasAny(lastModified) ?
+        header.value(lastModified).toString() : std::string();
+    if (etagValue.empty() && lastModifiedValue.empty())
+        return std::string(); // we could not tell page versions apart
+
+    std::ostringstream key;
+    key << uri << '\n' << etagValue << '\n' << lastModifiedValue << '\n' <<
+        virginSize << '\n' << config->payloadVersion;
+    return key.str();
+}
 
-        }
+void Adapter::Xaction::admitToCache() {
+    if (cacheKey.empty())
+        return;
+    // after a truncated or bypassed body, caching has only a part; pages
+    // without the script are not ours to tag, so they are not kept
+    if (!bypassing && injected && vbAtEnd && vbConsumed == virginSize) {
+        std::string *body = new std::string;
+        body->swap(caching);
+        config->cache->insert(cacheKey, BodyCache::Body(body));
+    }
+    cacheKey.clear();
+    std::string().swap(caching);
+    cachingShare.set(0);
+}
+
+void Adapter::Xaction::copyForShadow(const std::string &chunk) {
+    if (!config->shadow->reserve(chunk.size())) {
+        dropShadow();
+        return;
+    }
+    shadowVirgin.append(chunk);
+    shadowChunks.push_back(chunk.size());
+    shadowShare.set(shadowVirgin.size());
+}
+
+void Adapter::Xaction::startShadow() {
+    if (!shadowing)
+        return;
+    shadowing = false;
+    shadowShare.set(0); // the job takes over
+    ShadowJob *shadow = new ShadowJob(config, shadowVirgin, shadowChunks);
+    if (!pool->submit(shadow)) {
+        ShadowBusy.add(); // production work comes first
+        delete shadow;
+    }
+}
+
+void Adapter::Xaction::dropShadow() {
+    if (!shadowing)
+        return;
+    shadowing = false;
+    ShadowAbandoned.add();
+    config->shadow->release(shadowVirgin.size());
+    std::string().swap(shadowVirgin);
+    std::vector<size_type>().swap(shadowChunks);
+    shadowShare.set(0);
+}
 
+void Adapter::Xaction::finishAb() {
+    admitToCache(); // all vb we took is adapted by now
+    startShadow(); // likewise
+    if (sendingAb == opOn) {
+        hostx->noteAbContentDone(vbAtEnd);
+        sendingAb = opComplete;
     }
+}
 
+void Adapter::Xaction::adaptContent(std::string &chunk) {
+    const bool found = InjectScript(chunk, config->replacement);
+    injected = injected || found;
+    JAMES_PROBE3(inject, id, found, chunk.size());
 }
 
 bool Adapter::Xaction::callable() const {
     return hostx != 0; // no point to call us if we are done
 }
 
+void Adapter::Xaction::wake() {
+    if (hostx)
+        hostx->resume();
+}
+
+// the host calls us back after wake()
+void Adapter::Xaction::resume() {
+    if (!job || !job->delivered)
+        return;
+    AdaptJob *done = job;
+    job = 0;
+    const bool failed = done->failed;
+    // the host may have stopped wanting ab meanwhile
+    const bool wanted = sendingAb == opUndecided || sendingAb == opOn;
+    if (hostx && wanted) {
+        if (failed) {
+            // the worker ran out of memory, most likely; a failed insert
+            // leaves the chunk as it was, so adapt it ourselves instead
+            RetriedChunks.add();
+            adaptContent(done->chunk);
+        } else {
+            injected = injected || done->injected;
+            JAMES_PROBE3(inject, id, done->injected, done->chunk.size());
+        }
+        absorb(done->chunk, done->size);
+    }
+    delete done;
+    if (!hostx || !wanted)
+        return;
+
+    consumeVb(); // the vb that came meanwhile, if any
+
+    // whether vb ended while we were working and we have adapted it all
+    const bool ended = receivingVb == opComplete && !pausedVb && !job;
+    if (receivingVb == opOn && !pausedVb)
+        hostx->vbMakeMore();
+    else if (ended)
+        releaseHeld();
+    if (sendingAb == opOn)
+        hostx->noteAbContentAvailable();
+    if (ended)
+        finishAb();
+}
+
+Adapter::AdaptJob::AdaptJob(const Snapshot<Config>::Pointer &aConfig, Xaction *anOwner,
+        std::string &aChunk, size_type aSize) :
+config(aConfig), size(aSize), injected(false), owner(anOwner), delivered(false) {
+    chunk.swap(aChunk);
+}
+
+void Adapter::AdaptJob::run() {
+    injected = InjectScript(chunk, config->replacement);
+}
+
+Adapter::ShadowJob::ShadowJob(const Snapshot<Config>::Pointer &aConfig, std::string &aVirgin,
+        std::vector<size_type> &someChunks) : config(aConfig) {
+    virgin.swap(aVirgin);
+    chunks.swap(someChunks);
+    share.set(virgin.size());
+}
+
+Adapter::ShadowJob::~ShadowJob() {
+    config->shadow->release(virgin.size());
+}
+
+void Adapter::ShadowJob::run() {
+    const uint64_t started = ShadowBudget::CpuNow();
+    bool primaryInjected = false;
+    const std::string primary = Adapt(virgin, chunks, config->replacement, primaryInjected);
+    const uint64_t primaryDone = ShadowBudget::CpuNow();
+
+    bool alternativeInjected = false;
+    const std::vector<size_type> whole(1, virgin.size());
+    const std::string alternative = Adapt(virgin, config->shadowWhole ? whole : chunks,
+        config->shadowReplacement, alternativeInjected);
+    const uint64_t alternativeDone = ShadowBudget::CpuNow();
+
+    const bool identical = primary == alternative;
+    const uint64_t compared = ShadowBudget::CpuNow();
+
+    ShadowCompared.add();
+    if (identical)
+        ShadowIdentical.add();
+    else
+        ShadowDifferent.add();
+    ShadowPrimaryBytes.add(primary.size());
+    ShadowAlternativeBytes.add(alternative.size());
+    if (primaryInjected)
+        ShadowPrimaryInjected.add();
+    if (alternativeInjected)
+        ShadowAlternativeInjected.add();
+    ShadowPrimaryUsec.add(primaryDone - started);
+    ShadowAlternativeUsec.add(alternativeDone - primaryDone);
+    ShadowCompareUsec.add(compared - alternativeDone);
+    config->shadow->charge(compared - started);
+}
+
+std::string Adapter::ShadowJob::Adapt(const std::string &virgin,
+        const std::vector<size_type> &chunks, const std::string &markup, bool &injected) {
+    std::string adapted;
+    adapted.reserve(virgin.size() + markup.size());
+    size_type offset = 0;
+    for (std::vector<size_type>::const_iterator i = chunks.begin(); i != chunks.end(); ++i) {
+        std::string chunk = virgin.substr(offset, *i);
+        if (InjectScript(chunk, markup))
+            injected = true;
+        adapted.append(chunk);
+        offset += *i;
+    }
+    return adapted;
+}
+
+void Adapter::AdaptJob::deliver() {
+    if (!owner) {
+        delete this; // nobody waits for us
+        return;
+    }
+    delivered = true;
+    owner->wake();
+}
+
 // tells the host that we are not interested in [more] vb
 // if the host does not know that already
 
@@ -1,8 +1,25 @@
 #include "james_ecap.h"
+#include "james_captive.h"
+#include "james_http.h"
+#include "james_probes.h"
+#include "james_shaper.h"
+#include "james_shared.h"
+#include "james_spool.h"
+#include "james_stats.h"
 #include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <set>
+#include <pthread.h>
+#include <regex.h>
 #include <libecap/common/message.h>
+#include <libecap/common/header.h>
+#include <libecap/common/names.h>
+#include <libecap/common/named_values.h>
+#include <libecap/common/options.h>
 #include <libecap/common/registry.h>
 #include <libecap/common/errors.h>
+#include <libecap/common/names.h>
 #include <libecap/adapter/service.h>
 #include <libecap/adapter/xaction.h>
 #include <libecap/host/xaction.h>
@@ -11,8 +28,79 @@ namespace Adapter { // not required, but adds clarity
 
 using libecap::size_type;
 
+// Learns the classes of shaped clients from the client database on a
+// background thread, so that no host thread waits for the database. A
+// client is queued when the shaper asks for the class of its bucket;
+// until the answer comes, the bucket keeps the default class.
+class Classifier {
+	public:
+		Classifier(const ClientDbs &aDbs, const libecap::shared_ptr<Shaper> &aShaper,
+			uint64_t aRate, uint64_t anEnabledRate, uint64_t aBurst);
+		~Classifier(); // drops the clients still queued
+
+		void queue(const ClientAddress &client); // never waits for the database
+
+	private:
+		Classifier(const Classifier &); // not implemented
+		Classifier &operator =(const Classifier &); // not implemented
+
+		static void *Run(void *classifier);
+		void run(); // the background thread loop
+
+		const ClientDbs &dbs;
+		const libecap::shared_ptr<Shaper> shaper;
+		const uint64_t rate; // for guests and clients we cannot look up
+		const uint64_t enabledRate; // for clients enabled in the database
+		const uint64_t burst;
+
+		pthread_mutex_t mutex; // protects the members below
+		pthread_cond_t wakeup;
+		pthread_t thread;
+		std::set<ClientAddress> queued;
+		bool stopping;
+};
+
+// Configuration storage; immutable once configured, so that transactions
+// on any host thread may use it while the service is reconfigured.
+class Config {
+	public:
+		Config();
+		~Config();
+
+		// whether a message with the given properties should be captured
+		bool wantsCapture(const std::string &url, const std::string &type,
+			const libecap::BodySize &size) const;
+
+		void setCaptureUrl(const std::string &pattern);
+
+		std::string captureDir; // where to spool captured bodies; empty disables capture
+		std::string captureType; // Content-Type prefix to capture; empty matches all
+		size_type captureMaxSize; // bytes to capture per body
+		size_type captureRing; // spool ring buffer size
+		Spool *spool; // capture writer; exists when capturing is enabled
+
+		uint64_t shapeRate; // per-client bytes per second; zero disables shaping
+		uint64_t shapeEnabledRate; // for clients enabled in the database
+		uint64_t shapeBurst; // bytes a client may send at once
+		DbConfig dbConfig; // where client classes come from
+		bool hasDb; // whether dbConfig was loaded
+		ClientDbs *dbs; // exists when shaping or accounting with a database
+		Classifier *classifier; // exists when shaping with a database
+
+		bool shapes() const { return shapeRate || shapeEnabledRate; }
+
+	private:
+		Config(const Config &); // not implemented
+		Config &operator =(const Config &); // not implemented
+
+		regex_t captureUrl; // URLs to capture
+		bool hasCaptureUrl; // whether captureUrl was compiled
+};
+
 class Service: public libecap::adapter::Service {
 	public:
+		Service();
+
 		// About
 		virtual std::string uri() const; // unique across all vendors
 		virtual std::string tag() const; // changes with version and config
@@ -21,23 +109,47 @@ class Service: public libecap::adapter::Service {
 		// Configuration
 		virtual void configure(const libecap::Options &cfg);
 		virtual void reconfigure(const libecap::Options &cfg);
+		void setOne(const libecap::Name &name, const libecap::Area &valArea);
 
 		// Lifecycle
 		virtual void start(); // expect makeXaction() calls
 		virtual void stop(); // no more makeXaction() calls until start()
 		virtual void retire(); // no more makeXaction() calls
 
+		// Asynchronous transactions: shaped ones wait for their tokens
+		virtual bool makesAsyncXactions() const;
+		virtual void suspend(timeval &timeout);
+		virtual void resume();
+
 		// Scope (XXX: this may be changed to look at the whole header)
 		virtual bool wantsUrl(const char *url) const;
 
 		// Work
 		virtual libecap::adapter::Xaction *makeXaction(libecap::host::Xaction *hostx);
+
+	public:
+		Snapshot<Config> config; // the current configuration
+		const libecap::shared_ptr<Shaper> shaper; // outlives configurations
+
+	private:
+		libecap::shared_ptr<Config> pending; // being configured
+};
+
+// Calls Service::setOne() for each host-provided configuration option.
+// See Service::configure().
+class Cfgtor: public libecap::NamedValueVisitor {
+	public:
+		Cfgtor(Service &aSvc): svc(aSvc) {}
+		virtual void visit(const libecap::Name &name, const libecap::Area &value) {
+			svc.setOne(name, value);
+		}
+		Service &svc;
 };
 
 
-class Xaction: public libecap::adapter::Xaction {
+class Xaction: public libecap::adapter::Xaction, public Shaper::Waiter {
 	public:
-		Xaction(libecap::host::Xaction *x);
+		Xaction(libecap::shared_ptr<Service> s, libecap::host::Xaction *x);
 		virtual ~Xaction();
 
 		// meta-information for the host transaction
@@ -47,6 +159,10 @@ class Xaction: public libecap::adapter::Xaction {
 		// lifecycle
 		virtual void start();
 		virtual void stop();
+		virtual void resume();
+
+		// Shaper::Waiter API
+		virtual void wake();
 
 		// adapted body transmission control
 		virtual void abDiscard();
@@ -66,18 +182,151 @@ class Xaction: public libecap::adapter::Xaction {
 		virtual bool callable() const;
 
 	protected:
+		void startCapture(); // decides whether to mirror the body to the spool
+		void stopCapture();
+		void startShaping(); // joins the client's token bucket, if shaping
+		void stopShaping();
+		void servePage(const std::string &aPage); // instead of the virgin message
 		libecap::host::Xaction *lastHostCall(); // clears hostx
 
 	private:
+		const Snapshot<Config>::Pointer config; // as of our creation
+		const libecap::shared_ptr<Shaper> shaper;
+		const XactionId id; // for tracing
 		libecap::host::Xaction *hostx; // Host transaction rep
+		uint64_t abBytes; // body bytes forwarded, for tracing
+
+		Spool::Id captureId; // spool capture, if any
+		size_type captureLeft; // how many more bytes we may capture
+		Shaper::Bucket *bucket; // our client's tokens; nil if not shaped
+		ClientAddress client; // unknown if the host did not tell
+		ClientAddress identity; // whom our bytes count for; unknown unless accounting
+		std::string host; // the Host header of the request, for accounting
+		std::string page; // what we send in place of the virgin message
+		bool paging; // whether we send page
 
 		typedef enum { opUndecided, opOn, opComplete, opNever } OperationState;
 		OperationState receivingVb;
 		OperationState sendingAb;
 };
 
+static const std::string CfgErrorPrefix =
+	"Passthru Adapter: configuration error: ";
+
 } // namespace Adapter
 
+// shaped transactions that ran out of tokens are woken this often, at least
+#define SHAPER_TICK_USEC 10000
+// most clients waiting for their class to be looked up
+#define CLASSIFY_QUEUE 4096
+
+static Adapter::Counter ClassDrops("passthru.class_drops");
+
+Adapter::Classifier::Classifier(const ClientDbs &aDbs, const libecap::shared_ptr<Shaper> &aShaper,
+	uint64_t aRate, uint64_t anEnabledRate, uint64_t aBurst): dbs(aDbs), shaper(aShaper),
+	rate(aRate), enabledRate(anEnabledRate), burst(aBurst), stopping(false) {
+	pthread_mutex_init(&mutex, 0);
+	pthread_cond_init(&wakeup, 0);
+	if (pthread_create(&thread, 0, &Classifier::Run, this)) {
+		pthread_cond_destroy(&wakeup);
+		pthread_mutex_destroy(&mutex);
+		throw libecap::TextException("cannot start the client class thread");
+	}
+}
+
+Adapter::Classifier::~Classifier() {
+	pthread_mutex_lock(&mutex);
+	stopping = true;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&mutex);
+	pthread_join(thread, 0);
+
+	pthread_cond_destroy(&wakeup);
+	pthread_mutex_destroy(&mutex);
+}
+
+// a dropped client keeps the default class until the shaper asks again
+void Adapter::Classifier::queue(const ClientAddress &client) {
+	pthread_mutex_lock(&mutex);
+	if (queued.size() < CLASSIFY_QUEUE) {
+		queued.insert(client);
+		pthread_cond_signal(&wakeup);
+	} else {
+		ClassDrops.add();
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void *Adapter::Classifier::Run(void *classifier) {
+	static_cast<Classifier*>(classifier)->run();
+	return 0;
+}
+
+void Adapter::Classifier::run() {
+	pthread_mutex_lock(&mutex);
+	while (!stopping) {
+		if (queued.empty()) {
+			pthread_cond_wait(&wakeup, &mutex);
+			continue;
+		}
+		const ClientAddress client = *queued.begin();
+		queued.erase(queued.begin());
+		pthread_mutex_unlock(&mutex);
+
+		// clients the database does not know, or cannot tell us about, are guests
+		ClientRecord record;
+		const bool enabled = dbs.local().lookup(dbs.identity(client), record) &&
+			record.enabled;
+		shaper->classify(client, enabled ? enabledRate : rate, burst);
+
+		pthread_mutex_lock(&mutex);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+Adapter::Config::Config(): captureMaxSize(libecap::nsize),
+	captureRing(4*1024*1024), spool(0),
+	shapeRate(0), shapeEnabledRate(~0ULL), shapeBurst(64*1024),
+	hasDb(false), dbs(0), classifier(0), hasCaptureUrl(false) {
+}
+
+Adapter::Config::~Config() {
+	// the writer may still hold ring data; deleting the spool lets it finish
+	delete spool;
+	delete classifier; // uses dbs
+	delete dbs;
+	if (hasCaptureUrl)
+		regfree(&captureUrl);
+}
+
+void Adapter::Config::setCaptureUrl(const std::string &pattern) {
+	if (hasCaptureUrl) {
+		regfree(&captureUrl);
+		hasCaptureUrl = false;
+	}
+	if (regcomp(&captureUrl, pattern.c_str(), REG_EXTENDED | REG_NOSUB) != 0)
+		throw libecap::TextException(Adapter::CfgErrorPrefix +
+			"invalid capture_url pattern: " + pattern);
+	hasCaptureUrl = true;
+}
+
+bool Adapter::Config::wantsCapture(const std::string &url,
+	const std::string &type, const libecap::BodySize &size) const {
+	if (!spool)
+		return false;
+	if (hasCaptureUrl && regexec(&captureUrl, url.c_str(), 0, 0, 0) != 0)
+		return false;
+	if (type.compare(0, captureType.size(), captureType) != 0)
+		return false;
+	// bodies known to exceed the limit would only be captured partially
+	if (size.known() && size.value() > captureMaxSize)
+		return false;
+	return true;
+}
+
+Adapter::Service::Service(): shaper(new Shaper) {
+}
+
 std::string Adapter::Service::uri() const {
 	return "ecap://e-cap.org/ecap/services/sample/passthru";
 }
@@ -88,45 +337,144 @@ std::string Adapter::Service::tag() const {
 
 void Adapter::Service::describe(std::ostream &os) const {
 	os << "A passthru adapter from " << PACKAGE_NAME << " v" << PACKAGE_VERSION;
+	const Snapshot<Config>::Pointer current = config.get();
+	if (current && (current->spool || current->shapes() || current->dbs)) {
+		os << "\n";
+		DumpStats(os);
+	}
 }
 
-void Adapter::Service::configure(const libecap::Options &) {
-	// this service is not configurable
+void Adapter::Service::configure(const libecap::Options &cfg) {
+	pending.reset(new Config);
+	Cfgtor cfgtor(*this);
+	cfg.visitEachOption(cfgtor);
+
+	if (!pending->captureDir.empty())
+		pending->spool = new Spool(pending->captureDir, pending->captureRing);
+
+	if (pending->shapeEnabledRate == ~0ULL)
+		pending->shapeEnabledRate = pending->shapeRate; // one class
+	if (pending->hasDb && (pending->shapes() || pending->dbConfig.dbaccount))
+		pending->dbs = new ClientDbs(pending->dbConfig, true);
+	if (pending->dbs && pending->shapes())
+		pending->classifier = new Classifier(*pending->dbs, shaper,
+			pending->shapeRate, pending->shapeEnabledRate, pending->shapeBurst);
+
+	config.set(pending);
+	pending.reset();
+}
+
+void Adapter::Service::reconfigure(const libecap::Options &cfg) {
+	// transactions keep using the old configuration until they end
+	configure(cfg);
+	const Snapshot<Config>::Pointer current = config.get();
+	if (current->spool)
+		current->spool->start();
 }
 
-void Adapter::Service::reconfigure(const libecap::Options &) {
-	// this service is not configurable
+void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &valArea) {
+	const std::string value = valArea.toString();
+
+	if (name == "capture_dir")
+		pending->captureDir = value;
+	else if (name == "capture_url")
+		pending->setCaptureUrl(value);
+	else if (name == "capture_type")
+		pending->captureType = value;
+	else if (name == "config") {
+		pending->dbConfig.load(value, Adapter::CfgErrorPrefix);
+		pending->hasDb = true;
+	} else if (name == "shape_rate" || name == "shape_enabled_rate" || name == "shape_burst") {
+		char *end = 0;
+		const unsigned long long number = strtoull(value.c_str(), &end, 10);
+		if (value.empty() || *end)
+			throw libecap::TextException(Adapter::CfgErrorPrefix +
+				"invalid " + name.image() + " value: " + value);
+		if (name == "shape_rate")
+			pending->shapeRate = number;
+		else
+		if (name == "shape_enabled_rate")
+			pending->shapeEnabledRate = number;
+		else
+			pending->shapeBurst = number;
+	} else if (name == "capture_max_size" || name == "capture_ring") {
+		char *end = 0;
+		const unsigned long size = strtoul(value.c_str(), &end, 10);
+		if (value.empty() || *end)
+			throw libecap::TextException(Adapter::CfgErrorPrefix +
+				"invalid " + name.image() + " value: " + value);
+		if (name == "capture_max_size")
+			pending->captureMaxSize = size;
+		else
+			pending->captureRing = size;
+	} else if (name.assignedHostId())
+		; // skip host-standard options we do not know or care about
+	else
+		throw libecap::TextException(Adapter::CfgErrorPrefix +
+			"unsupported configuration parameter: " + name.image());
 }
 
 void Adapter::Service::start() {
 	libecap::adapter::Service::start();
-	// custom code would go here, but this service does not have one
+	const Snapshot<Config>::Pointer current = config.get();
+	if (current && current->spool)
+		current->spool->start();
 }
 
 void Adapter::Service::stop() {
-	// custom code would go here, but this service does not have one
+	const Snapshot<Config>::Pointer current = config.get();
+	if (current && current->spool)
+		current->spool->stop();
 	libecap::adapter::Service::stop();
 }
 
 void Adapter::Service::retire() {
-	// custom code would go here, but this service does not have one
+	const Snapshot<Config>::Pointer current = config.get();
+	if (current && current->spool)
+		current->spool->stop();
 	libecap::adapter::Service::stop();
 }
 
+// always, as shaping may be turned on by reconfiguration
+bool Adapter::Service::makesAsyncXactions() const {
+	return true;
+}
+
+void Adapter::Service::suspend(timeval &timeout) {
+	// come back soon if a shaped transaction waits for tokens
+	if (shaper->stalled() && (timeout.tv_sec > 0 || timeout.tv_usec > SHAPER_TICK_USEC)) {
+		timeout.tv_sec = 0;
+		timeout.tv_usec = SHAPER_TICK_USEC;
+	}
+}
+
+void Adapter::Service::resume() {
+	shaper->wake();
+}
+
 bool Adapter::Service::wantsUrl(const char *url) const {
 	return true; // no-op is applied to all messages
 }
 
 libecap::adapter::Xaction *Adapter::Service::makeXaction(libecap::host::Xaction *hostx) {
-	return new Adapter::Xaction(hostx);
+	return new Adapter::Xaction(std::tr1::static_pointer_cast<Service>(self), hostx);
 }
 
 
-Adapter::Xaction::Xaction(libecap::host::Xaction *x): hostx(x),
+Adapter::Xaction::Xaction(libecap::shared_ptr<Service> aService,
+	libecap::host::Xaction *x): config(aService->config.get()),
+	shaper(aService->shaper), id(NextXactionId()), hostx(x), abBytes(0),
+	captureId(0), captureLeft(0), bucket(0), paging(false),
 	receivingVb(opUndecided), sendingAb(opUndecided) {
+	JAMES_PROBE1(xaction_create, id);
 }
 
 Adapter::Xaction::~Xaction() {
+	// virgin bytes are adapted bytes here
+	JAMES_PROBE3(xaction_end, id, abBytes, abBytes);
+	stopCapture();
+	stopShaping();
+
 	if (libecap::host::Xaction *x = hostx) {
 		hostx = 0;
 		x->adaptationAborted();
@@ -145,6 +493,25 @@ void Adapter::Xaction::start() {
 	// TODO: libecap should probably supply a global LastCall() of sorts
 	// to clear hostx member and then call the host transaction one last time
 	Must(hostx);
+	JAMES_PROBE1(xaction_start, id);
+	client.parse(hostx->option(libecap::metaClientIp));
+	if (config->dbs) {
+		static const libecap::Name headerHost("Host");
+		typedef const libecap::RequestLine *CLRLP;
+		const libecap::Message &request = dynamic_cast<CLRLP>(&hostx->virgin().firstLine()) ?
+			hostx->virgin() : hostx->cause();
+		if (request.header().hasAny(headerHost))
+			host = request.header().value(headerHost).toString();
+
+		// the same block page as the captive portal's
+		if (config->dbs->overQuota(client)) {
+			servePage(CaptivePage(false));
+			return;
+		}
+		if (client.known())
+			identity = config->dbs->identity(client);
+	}
+
 	if (hostx->virgin().body()) {
 		receivingVb = opOn;
 		hostx->vbMake(); // ask host to supply virgin body
@@ -158,15 +525,107 @@ void Adapter::Xaction::start() {
 		sendingAb = opNever; // there is nothing to send
 		lastHostCall()->useAdapted(adapted);
 	} else {
+		startCapture();
+		startShaping();
 		hostx->useAdapted(adapted);
 	}
 }
 
+// answers with a page of ours, dropping the virgin body
+void Adapter::Xaction::servePage(const std::string &aPage)
+{
+	if (hostx->virgin().body())
+		hostx->vbDiscard(); // we will not need the virgin body
+	receivingVb = opNever;
+
+	// a response of our own both satisfies a request and replaces a response
+	libecap::shared_ptr<libecap::Message> response = MakeResponse(200, "OK");
+	static const libecap::Name contentType("Content-Type");
+	response->header().add(contentType, libecap::Area::FromTempString("text/html"));
+	SetContentLength(response->header(), aPage.size());
+	page = aPage;
+	paging = true;
+	hostx->useAdapted(response);
+}
+
 void Adapter::Xaction::stop() {
+	stopCapture();
+	stopShaping();
 	hostx = 0;
 	// the caller will delete
 }
 
+// the host calls us back after wake()
+void Adapter::Xaction::resume() {
+	if (hostx && sendingAb == opOn)
+		hostx->noteAbContentAvailable();
+}
+
+// called by the shaper when our client has tokens again
+void Adapter::Xaction::wake() {
+	if (hostx)
+		hostx->resume();
+}
+
+void Adapter::Xaction::startCapture()
+{
+	if (!config->spool)
+		return;
+
+	libecap::Area uri;
+	typedef const libecap::RequestLine *CLRLP;
+	if (CLRLP requestLine = dynamic_cast<CLRLP>(&hostx->virgin().firstLine()))
+		uri = requestLine->uri();
+	else
+	if (CLRLP requestLine = dynamic_cast<CLRLP>(&hostx->cause().firstLine()))
+		uri = requestLine->uri();
+
+	static const libecap::Name contentType("Content-Type");
+	const libecap::Header &header = hostx->virgin().header();
+	const std::string type = header.hasAny(contentType) ?
+		header.value(contentType).toString() : std::string();
+
+	const std::string url = uri.toString();
+	if (!config->wantsCapture(url, type, hostx->virgin().body()->bodySize()))
+		return;
+
+	captureId = config->spool->open(url + " " + type);
+	captureLeft = config->captureMaxSize;
+}
+
+void Adapter::Xaction::stopCapture()
+{
+	if (captureId) {
+		config->spool->close(captureId);
+		captureId = 0;
+	}
+}
+
+void Adapter::Xaction::startShaping()
+{
+	if (!config->shapes() || !client.known())
+		return;
+
+	// the class of the client comes with its bucket; guests until known
+	bool stale = false;
+	bucket = shaper->join(client, config->shapeRate, config->shapeBurst, stale);
+	if (!stale)
+		return;
+	if (config->classifier)
+		config->classifier->queue(client);
+	else
+		shaper->classify(client, config->shapeRate, config->shapeBurst); // one class
+}
+
+void Adapter::Xaction::stopShaping()
+{
+	if (bucket) {
+		shaper->unstall(this);
+		shaper->leave(bucket);
+		bucket = 0;
+	}
+}
+
 void Adapter::Xaction::abDiscard()
 {
 	Must(sendingAb == opUndecided); // have not started yet
@@ -176,7 +635,13 @@ void Adapter::Xaction::abDiscard()
 void Adapter::Xaction::abMake()
 {
 	Must(sendingAb == opUndecided); // have not yet started or decided not to send
-	Must(hostx->virgin().body()); // that is our only source of ab content
+	if (paging) {
+		sendingAb = opOn;
+		hostx->noteAbContentAvailable();
+		hostx->noteAbContentDone(true); // all of page is available
+		return;
+	}
+	Must(hostx->virgin().body()); // our only other source of ab content
 
 	// we are or were receiving vb
 	Must(receivingVb == opOn || receivingVb == opComplete);
@@ -201,12 +666,53 @@ void Adapter::Xaction::abStopMaking()
 libecap::Area Adapter::Xaction::abContent(size_type offset, size_type size)
 {
 	Must(sendingAb == opOn);
-	return hostx->vbContent(offset, size);
+	if (paging) {
+		if (offset >= page.size())
+			return libecap::Area();
+		return libecap::Area::FromTempBuffer(page.data() + offset,
+			std::min(size, page.size() - offset));
+	}
+	if (bucket) {
+		// expose no more than our share of the client's tokens
+		const uint64_t allowed = shaper->allowance(bucket);
+		if (offset >= allowed) {
+			shaper->stall(bucket, this);
+			return libecap::Area();
+		}
+		if (size > allowed - offset) {
+			size = allowed - offset;
+			shaper->stall(bucket, this); // there may be more to send
+		}
+	}
+	const libecap::Area content = hostx->vbContent(offset, size);
+	JAMES_PROBE3(ab_content, id, offset, content.size);
+	return content;
 }
 
 void Adapter::Xaction::abContentShift(size_type size)
 {
 	Must(sendingAb == opOn);
+	if (paging) {
+		Must(size <= page.size());
+		page.erase(0, size);
+		return;
+	}
+	abBytes += size;
+	// counted as we go, so that a long download may put its client over quota
+	if (config->dbs)
+		config->dbs->accountIdentity(identity, host, size, size);
+	if (bucket)
+		shaper->spend(bucket, size);
+	if (captureId) {
+		// mirror exactly the bytes the host has consumed
+		const libecap::Area data = hostx->vbContent(0, std::min(size, captureLeft));
+		captureLeft -= data.size;
+		if (!config->spool->write(captureId, data.start, data.size))
+			captureId = 0; // the spool has closed the truncated capture
+		else
+		if (!captureLeft)
+			stopCapture();
+	}
 	hostx->vbContentShift(size);
 }
 
@@ -221,7 +727,11 @@ void Adapter::Xaction::noteVbContentDone(bool atEnd)
 void Adapter::Xaction::noteVbContentAvailable()
 {
 	Must(receivingVb == opOn);
-	if (sendingAb == opOn)
+	if (sendingAb != opOn)
+		return;
+	if (bucket && !shaper->allowance(bucket))
+		shaper->stall(bucket, this); // resume() will tell the host
+	else
 		hostx->noteAbContentAvailable();
 }
 
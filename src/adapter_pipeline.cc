@@ -0,0 +1,682 @@
+#include "james_ecap.h"
+#include "james_buffer.h"
+#include "james_cache.h"
+#include "james_captive.h"
+#include "james_headers.h"
+#include "james_http.h"
+#include "james_inject.h"
+#include "james_probes.h"
+#include "james_shared.h"
+#include "james_stats.h"
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+#include <libecap/common/registry.h>
+#include <libecap/common/errors.h>
+#include <libecap/common/message.h>
+#include <libecap/common/header.h>
+#include <libecap/common/names.h>
+#include <libecap/common/named_values.h>
+#include <libecap/common/config.h>
+#include <libecap/host/host.h>
+#include <libecap/adapter/service.h>
+#include <libecap/adapter/xaction.h>
+#include <libecap/host/xaction.h>
+
+
+namespace Adapter { // not required, but adds clarity
+
+    using libecap::size_type;
+
+    // what the stages learn about a transaction and tell each other
+
+    class Context {
+    public:
+        Context() : id(NextXactionId()), isRequest(false), request(0), modified(false), injectable(false) {
+        }
+
+        const XactionId id; // for tracing
+        ClientAddress client; // unknown if the host did not tell
+        bool isRequest; // reqmod rather than respmod
+        const libecap::Message *request; // the cause of a response; nil in reqmod
+        bool modified; // some stage changed the adapted header
+        bool injectable; // a response whose page the script may go into
+        std::string page; // body to send when a stage short-circuits the chain
+    };
+
+    // One step of the adaptation chain. Stages are created once per
+    // configuration and shared by all transactions of the service, on
+    // all host threads, so they keep no per-transaction state.
+
+    class Stage {
+    public:
+        typedef enum {
+            vContinue, // let the next stage see the message
+            vDone // Context::page replaces the body; skip the remaining stages
+        } Verdict;
+
+        virtual ~Stage() {
+        }
+
+        virtual const char *name() const = 0;
+
+        // adapts the (shared) adapted header
+        virtual Verdict header(Context &ctx, libecap::Message &adapted) = 0;
+
+        // whether chunk() must see the body of this transaction
+        virtual bool wantsBody(const Context &) const {
+            return false;
+        }
+
+        // adapts a piece of the body
+        virtual void chunk(Context &, std::string &) {
+        }
+    };
+
+    // the captivating adapter logic: blocked clients get the captive page
+
+    class CaptiveStage : public Stage {
+    public:
+        CaptiveStage(const ClientDbs &aDbs);
+
+        virtual const char *name() const {
+            return "captive";
+        }
+
+        virtual Verdict header(Context &ctx, libecap::Message &adapted);
+
+    private:
+        const ClientDbs &dbs;
+        HeaderRules pageRules; // header edits for the captive page
+    };
+
+    // the modifying adapter logic: injects the script into pages
+
+    class InjectStage : public Stage {
+    public:
+        InjectStage(const std::string &aMarkup);
+
+        virtual const char *name() const {
+            return "inject";
+        }
+
+        virtual Verdict header(Context &ctx, libecap::Message &adapted);
+
+        virtual bool wantsBody(const Context &ctx) const {
+            return ctx.injectable; // other bodies go through untouched
+        }
+
+        virtual void chunk(Context &ctx, std::string &chunk) {
+            const bool injected = InjectScript(chunk, markup);
+            JAMES_PROBE3(inject, ctx.id, injected, chunk.size());
+        }
+
+    private:
+        const std::string markup;
+        const uint64_t version; // of markup, for validators
+        HeaderRules rules;
+    };
+
+    // the minimal adapter logic: records client activity
+
+    class LogStage : public Stage {
+    public:
+        LogStage(const ClientDbs &aDbs) : dbs(aDbs) {
+        }
+
+        virtual const char *name() const {
+            return "log";
+        }
+
+        virtual Verdict header(Context &ctx, libecap::Message &) {
+            JAMES_PROBE1(db_begin, ctx.id);
+            const bool recorded = dbs.local().touch(dbs.identity(ctx.client));
+            JAMES_PROBE2(db_end, ctx.id, recorded);
+            return vContinue;
+        }
+
+    private:
+        const ClientDbs &dbs;
+    };
+
+    // Configuration storage; immutable once configured, so that
+    // transactions on any host thread may use it during reconfiguration.
+
+    class Config {
+    public:
+        Config();
+        ~Config();
+
+        std::vector<std::string> stageNames; // as configured, in order
+        std::string replacement; // markup for the inject stage
+        DbConfig dbConfig;
+        bool failOpen; // whether to pass clients while the database is down
+        SubnetPolicies subnets; // for the captive stage
+        size_type memoryCap; // per-transaction buffer limit; zero means unlimited
+        std::string spillDir; // where buffers above memoryCap spill; empty disables
+
+        std::vector<Stage*> stages; // the chain, built by Service::configure()
+        ClientDbs *dbs; // client state for the captive and log stages
+
+    private:
+        Config(const Config &); // not implemented
+        Config &operator=(const Config &); // not implemented
+    };
+
+    class Service : public libecap::adapter::Service {
+    public:
+
+        // About
+        virtual std::string uri() const; // unique across all vendors
+        virtual std::string tag() const; // changes with version and config
+        virtual void describe(std::ostream &os) const; // free-format info
+
+        // Configuration
+        virtual void configure(const libecap::Options &cfg);
+        virtual void reconfigure(const libecap::Options &cfg);
+        void setOne(const libecap::Name &name, const libecap::Area &valArea);
+
+        // Lifecycle
+        virtual void start(); // expect makeXaction() calls
+        virtual void stop(); // no more makeXaction() calls until start()
+        virtual void retire(); // no more makeXaction() calls
+
+        // Scope (XXX: this may be changed to look at the whole header)
+        virtual bool wantsUrl(const char *url) const;
+
+        // Work
+        virtual libecap::adapter::Xaction *makeXaction(libecap::host::Xaction *hostx);
+
+    public:
+        Snapshot<Config> config; // the current configuration
+
+    protected:
+        void setStages(const std::string &value);
+        size_type parseSize(const libecap::Name &name, const std::string &value) const;
+
+    private:
+        libecap::shared_ptr<Config> pending; // being configured
+    };
+
+    // Calls Service::setOne() for each host-provided configuration option.
+    // See Service::configure().
+
+    class Cfgtor : public libecap::NamedValueVisitor {
+    public:
+
+        Cfgtor(Service &aSvc) : svc(aSvc) {
+        }
+
+        virtual void visit(const libecap::Name &name, const libecap::Area &value) {
+            svc.setOne(name, value);
+        }
+        Service &svc;
+    };
+
+    class Xaction : public libecap::adapter::Xaction {
+    public:
+        Xaction(libecap::shared_ptr<Service> s, libecap::host::Xaction *x);
+        virtual ~Xaction();
+
+        // meta-information for the host transaction
+        virtual const libecap::Area option(const libecap::Name &name) const;
+        virtual void visitEachOption(libecap::NamedValueVisitor &visitor) const;
+
+        // lifecycle
+        virtual void start();
+        virtual void stop();
+
+        // adapted body transmission control
+        virtual void abDiscard();
+        virtual void abMake();
+        virtual void abMakeMore();
+        virtual void abStopMaking();
+
+        // adapted body content extraction and consumption
+        virtual libecap::Area abContent(size_type offset, size_type size);
+        virtual void abContentShift(size_type size);
+
+        // virgin body state notification
+        virtual void noteVbContentDone(bool atEnd);
+        virtual void noteVbContentAvailable();
+
+        // libecap::Callable API, via libecap::host::Xaction
+        virtual bool callable() const;
+
+    protected:
+        void sendPage(libecap::shared_ptr<libecap::Message> &adapted);
+        void finishAb(); // tells the host there will be no more ab
+        void stopVb(); // stops receiving vb (if we are receiving it)
+        libecap::host::Xaction *lastHostCall(); // clears hostx
+
+    private:
+        const Snapshot<Config>::Pointer config; // as of our creation
+        libecap::host::Xaction *hostx; // Host transaction rep
+
+        Context ctx;
+        std::vector<Stage*> bodyStages; // stages that adapt this body, in order
+        BodyBuffer buffer; // adapted body content
+        bool bypassing; // the rest of vb is forwarded as is, without copying
+        bool vbAtEnd; // how the virgin body ended, valid after receivingVb
+        uint64_t vbBytes; // virgin body bytes copied, for tracing
+        uint64_t abBytes; // adapted body bytes sent, for tracing
+
+        typedef enum {
+            opUndecided, opOn, opComplete, opNever
+        } OperationState;
+        OperationState receivingVb;
+        OperationState sendingAb;
+    };
+
+    static const std::string CfgErrorPrefix =
+            "Pipeline Adapter: configuration error: ";
+
+} // namespace Adapter
+
+static Adapter::Counter ShortCircuits("pipeline.short_circuits");
+static Adapter::Counter VirginXactions("pipeline.virgin_xactions");
+
+Adapter::CaptiveStage::CaptiveStage(const ClientDbs &aDbs) : dbs(aDbs) {
+    pageRules.parse(
+        "remove Content-Disposition\n"
+        "set Content-Type text/html\n"
+        "add X-Ecap JameseCapCaptivate\n",
+        Adapter::CfgErrorPrefix);
+}
+
+Adapter::Stage::Verdict Adapter::CaptiveStage::header(Context &ctx, libecap::Message &adapted) {
+    JAMES_PROBE1(db_begin, ctx.id);
+    const bool allowed = dbs.captiveVisit(ctx.client);
+    JAMES_PROBE2(db_end, ctx.id, allowed);
+    if (allowed)
+        return vContinue;
+
+    ctx.page = CaptivePage(false);
+    pageRules.apply(adapted.header());
+    ctx.modified = true;
+    return vDone;
+}
+
+Adapter::InjectStage::InjectStage(const std::string &aMarkup) : markup(aMarkup),
+version(BodyCache::Version(aMarkup)) {
+    rules.parse(
+        "add X-Ecap " + libecap::MyHost().uri() + "\n"
+        "remove Accept-Encoding\n" // we cannot inject into compressed bodies
+        "add Warning 214 Transformation applied\n", // RFC 2616 14.46
+        Adapter::CfgErrorPrefix);
+}
+
+Adapter::Stage::Verdict Adapter::InjectStage::header(Context &ctx, libecap::Message &adapted) {
+    rules.apply(adapted.header());
+    ctx.injectable = !ctx.isRequest && adapted.body() && Injectable(adapted);
+    // a 304 keeps the origin's ETag unless it revalidates a page we
+    // injected into
+    if (ctx.isRequest || ctx.injectable ||
+            (!adapted.body() && RevalidatesInjected(ctx.request->header(), version)))
+        RewriteValidators(adapted.header(), ctx.isRequest, version);
+    ctx.modified = true;
+    return vContinue;
+}
+
+Adapter::Config::Config() : failOpen(true), memoryCap(1024 * 1024), dbs(0) {
+}
+
+Adapter::Config::~Config() {
+    for (std::vector<Stage*>::iterator i = stages.begin(); i != stages.end(); ++i)
+        delete *i;
+    delete dbs;
+}
+
+std::string Adapter::Service::uri() const {
+    return "ecap://murka.cz/james/pipeline";
+}
+
+std::string Adapter::Service::tag() const {
+    return PACKAGE_VERSION;
+}
+
+void Adapter::Service::describe(std::ostream &os) const {
+    os << "A pipeline adapter from " << PACKAGE_NAME << " v" << PACKAGE_VERSION << ":";
+    if (const Snapshot<Config>::Pointer current = config.get()) {
+        const std::vector<Stage*> &stages = current->stages;
+        for (std::vector<Stage*>::const_iterator i = stages.begin(); i != stages.end(); ++i)
+            os << ' ' << (*i)->name();
+    }
+    os << "\n";
+    DumpStats(os);
+    const Snapshot<Config>::Pointer current = config.get();
+    if (current && current->dbs)
+        current->dbs->dumpHotClients(os);
+}
+
+void Adapter::Service::configure(const libecap::Options &cfg) {
+    pending.reset(new Config);
+    Cfgtor cfgtor(*this);
+    cfg.visitEachOption(cfgtor);
+
+    // check for post-configuration errors and inconsistencies
+    Config &c = *pending;
+    if (c.stageNames.empty())
+        throw libecap::TextException(Adapter::CfgErrorPrefix + "stages value is not set");
+
+    for (std::vector<std::string>::const_iterator i = c.stageNames.begin(); i != c.stageNames.end(); ++i) {
+        if (*i == "inject") {
+            if (c.replacement.empty())
+                throw libecap::TextException(Adapter::CfgErrorPrefix +
+                    "the inject stage needs a script value");
+            c.stages.push_back(new InjectStage(c.replacement));
+        } else {
+            if (!c.dbs)
+                c.dbs = new ClientDbs(c.dbConfig, c.failOpen, c.subnets);
+            if (*i == "captive")
+                c.stages.push_back(new CaptiveStage(*c.dbs));
+            else
+                c.stages.push_back(new LogStage(*c.dbs));
+        }
+    }
+
+    config.set(pending);
+    pending.reset();
+}
+
+void Adapter::Service::reconfigure(const libecap::Options &cfg) {
+    // transactions keep using the old configuration until they end
+    configure(cfg);
+}
+
+void Adapter::Service::setOne(const libecap::Name &name, const libecap::Area &valArea) {
+    const std::string value = valArea.toString();
+
+    if (name == "stages") {
+        setStages(value);
+    } else if (name == "script") {
+        pending->replacement.append(LoadScript(value, Adapter::CfgErrorPrefix));
+    } else if (name == "config") {
+        pending->dbConfig.load(value, Adapter::CfgErrorPrefix);
+    } else if (name == "db_failure") {
+        pending->failOpen = ParseFailOpen(value, Adapter::CfgErrorPrefix);
+    } else if (name == "subnets") {
+        pending->subnets.load(value, Adapter::CfgErrorPrefix);
+    } else if (name == "memory_cap") {
+        pending->memoryCap = parseSize(name, value);
+    } else if (name == "spill_dir") {
+        pending->spillDir = value;
+    } else {
+        if (name.assignedHostId())
+            ; // skip host-standard options we do not know or care about
+        else
+            throw libecap::TextException(Adapter::CfgErrorPrefix +
+                "unsupported configuration parameter: " + name.image());
+    }
+}
+
+// parses a comma-separated list of stage names
+void Adapter::Service::setStages(const std::string &value) {
+    std::string::size_type start = 0;
+    while (start <= value.size()) {
+        std::string::size_type end = value.find(',', start);
+        if (end == std::string::npos)
+            end = value.size();
+        const std::string stage = value.substr(start, end - start);
+        if (stage != "captive" && stage != "inject" && stage != "log")
+            throw libecap::TextException(Adapter::CfgErrorPrefix +
+                "unknown stage: " + stage);
+        pending->stageNames.push_back(stage);
+        start = end + 1;
+    }
+}
+
+libecap::size_type Adapter::Service::parseSize(const libecap::Name &name, const std::string &value) const {
+    char *end = 0;
+    const unsigned long size = strtoul(value.c_str(), &end, 10);
+    if (value.empty() || *end)
+        throw libecap::TextException(Adapter::CfgErrorPrefix +
+            "invalid " + name.image() + " value: " + value);
+    return size;
+}
+
+void Adapter::Service::start() {
+    libecap::adapter::Service::start();
+    // custom code would go here, but this service does not have one
+}
+
+void Adapter::Service::stop() {
+    // custom code would go here, but this service does not have one
+    libecap::adapter::Service::stop();
+}
+
+void Adapter::Service::retire() {
+    // custom code would go here, but this service does not have one
+    libecap::adapter::Service::stop();
+}
+
+bool Adapter::Service::wantsUrl(const char *url) const {
+    return true; // no-op is applied to all messages
+}
+
+libecap::adapter::Xaction *Adapter::Service::makeXaction(libecap::host::Xaction *hostx) {
+    return new Adapter::Xaction(std::tr1::static_pointer_cast<Service>(self), hostx);
+}
+
+/** constructor Xaction */
+Adapter::Xaction::Xaction(libecap::shared_ptr<Service> aService,
+        libecap::host::Xaction *x) :
+config(aService->config.get()), hostx(x), bypassing(false), vbAtEnd(false),
+vbBytes(0), abBytes(0), receivingVb(opUndecided), sendingAb(opUndecided) {
+    buffer.configure(config->memoryCap, config->spillDir);
+    JAMES_PROBE1(xaction_create, ctx.id);
+}
+
+Adapter::Xaction::~Xaction() {
+    JAMES_PROBE3(xaction_end, ctx.id, vbBytes, abBytes);
+    if (libecap::host::Xaction * x = hostx) {
+        hostx = 0;
+        x->adaptationAborted();
+    }
+}
+
+const libecap::Area Adapter::Xaction::option(const libecap::Name &) const {
+    return libecap::Area(); // this transaction has no meta-information
+}
+
+void Adapter::Xaction::visitEachOption(libecap::NamedValueVisitor &) const {
+    // this transaction has no meta-information to pass to the visitor
+}
+
+void Adapter::Xaction::start() {
+    Must(hostx);
+    JAMES_PROBE1(xaction_start, ctx.id);
+
+    ctx.client.parse(hostx->option(libecap::metaClientIp));
+    ctx.isRequest = dynamic_cast<const libecap::RequestLine*> (&hostx->virgin().firstLine()) != 0;
+    if (!ctx.isRequest)
+        ctx.request = &hostx->cause();
+
+    // all stages work on a single copy of the header
+    libecap::shared_ptr<libecap::Message> adapted = hostx->virgin().clone();
+    Must(adapted != 0);
+
+    const std::vector<Stage*> &stages = config->stages;
+    for (std::vector<Stage*>::const_iterator i = stages.begin(); i != stages.end(); ++i) {
+        const Stage::Verdict verdict = (*i)->header(ctx, *adapted);
+        if (verdict == Stage::vDone) {
+            ShortCircuits.add();
+            sendPage(adapted);
+            return;
+        }
+        if ((*i)->wantsBody(ctx))
+            bodyStages.push_back(*i);
+    }
+
+    if (!ctx.modified) {
+        // nobody changed anything; the host forwards the virgin message,
+        // body included, without our copying it
+        VirginXactions.add();
+        lastHostCall()->useVirgin();
+        return;
+    }
+
+    if (!adapted->body()) {
+        sendingAb = opNever; // there is nothing to send
+        receivingVb = opNever;
+        lastHostCall()->useAdapted(adapted);
+        return;
+    }
+
+    receivingVb = opOn;
+    hostx->vbMake(); // ask host to supply virgin body
+
+    if (bodyStages.empty()) {
+        // the body goes through untouched, without copying
+        bypassing = true;
+    } else {
+        // the stages may change the length
+        adapted->header().removeAny(libecap::headerContentLength);
+    }
+    hostx->useAdapted(adapted);
+}
+
+// replaces the message body with the page chosen by a short-circuiting stage
+void Adapter::Xaction::sendPage(libecap::shared_ptr<libecap::Message> &adapted) {
+    if (hostx->virgin().body())
+        hostx->vbDiscard(); // we will not need the virgin body
+    receivingVb = opNever;
+
+    if (ctx.isRequest) {
+        // satisfy the request instead of forwarding it
+        libecap::shared_ptr<libecap::Message> response = MakeResponse(200, "OK");
+        static const libecap::Name contentType("Content-Type");
+        response->header().add(contentType, libecap::Area::FromTempString("text/html"));
+        adapted = response;
+    } else if (!adapted->body()) {
+        adapted->addBody();
+    }
+
+    SetContentLength(adapted->header(), ctx.page.size());
+    buffer.append(ctx.page);
+    vbAtEnd = true;
+    hostx->useAdapted(adapted);
+}
+
+void Adapter::Xaction::stop() {
+    hostx = 0;
+    // the caller will delete
+}
+
+void Adapter::Xaction::abDiscard() {
+    Must(sendingAb == opUndecided); // have not started yet
+    sendingAb = opNever;
+    // we do not need more vb if the host is not interested in ab
+    stopVb();
+}
+
+void Adapter::Xaction::abMake() {
+    Must(sendingAb == opUndecided); // have not yet started or decided not to send
+
+    sendingAb = opOn;
+    if (!buffer.empty() || bypassing)
+        hostx->noteAbContentAvailable();
+    if (receivingVb != opOn)
+        finishAb(); // all ab content is already available
+}
+
+void Adapter::Xaction::abMakeMore() {
+    Must(receivingVb == opOn); // a precondition for receiving more vb
+    hostx->vbMakeMore();
+}
+
+void Adapter::Xaction::abStopMaking() {
+    sendingAb = opComplete;
+    // we do not need more vb if the host is not interested in more ab
+    stopVb();
+}
+
+libecap::Area Adapter::Xaction::abContent(size_type offset, size_type size) {
+    Must(sendingAb == opOn || sendingAb == opComplete);
+    // adapted content comes first, followed by unadapted vb when bypassing
+    const libecap::Area content = (offset < buffer.size() || !bypassing) ?
+        buffer.content(offset, size) :
+        hostx->vbContent(offset - buffer.size(), size);
+    JAMES_PROBE3(ab_content, ctx.id, offset, content.size);
+    return content;
+}
+
+void Adapter::Xaction::abContentShift(size_type size) {
+    Must(sendingAb == opOn || sendingAb == opComplete);
+    abBytes += size;
+    const size_type buffered = std::min(size, buffer.size());
+    buffer.shift(buffered);
+    if (size > buffered) {
+        Must(bypassing);
+        hostx->vbContentShift(size - buffered);
+    }
+}
+
+void Adapter::Xaction::noteVbContentDone(bool atEnd) {
+    Must(receivingVb == opOn);
+    receivingVb = opComplete;
+    vbAtEnd = atEnd;
+    finishAb();
+}
+
+void Adapter::Xaction::noteVbContentAvailable() {
+    Must(receivingVb == opOn);
+
+    if (!bypassing) {
+        // one copy of the body goes through the whole chain
+        const libecap::Area vb = hostx->vbContent(0, libecap::nsize);
+        vbBytes += vb.size;
+        JAMES_PROBE2(vb_content, ctx.id, vb.size);
+        std::string chunk = vb.toString();
+        for (std::vector<Stage*>::iterator i = bodyStages.begin(); i != bodyStages.end(); ++i)
+            (*i)->chunk(ctx, chunk);
+        if (buffer.append(chunk)) {
+            hostx->vbContentShift(vb.size);
+        } else {
+            // leave vb (unadapted) with the host and forward it as is
+            bypassing = true;
+        }
+    }
+
+    if (sendingAb == opOn)
+        hostx->noteAbContentAvailable();
+}
+
+void Adapter::Xaction::finishAb() {
+    if (sendingAb == opOn) {
+        hostx->noteAbContentDone(vbAtEnd);
+        sendingAb = opComplete;
+    }
+}
+
+bool Adapter::Xaction::callable() const {
+    return hostx != 0; // no point to call us if we are done
+}
+
+// tells the host that we are not interested in [more] vb
+// if the host does not know that already
+
+void Adapter::Xaction::stopVb() {
+    if (receivingVb == opOn) {
+        hostx->vbStopMaking();
+        receivingVb = opComplete;
+    } else {
+        // we already got the entire body or refused it earlier
+        Must(receivingVb != opUndecided);
+    }
+}
+
+// this method is used to make the last call to hostx transaction
+// last call may delete adapter transaction if the host no longer needs it
+// TODO: replace with hostx-independent "done" method
+
+libecap::host::Xaction * Adapter::Xaction::lastHostCall() {
+    libecap::host::Xaction *x = hostx;
+    Must(x);
+    hostx = 0;
+    return x;
+}
+
+// create the adapter and register with libecap to reach the host application
+static const bool Registered = (libecap::RegisterService(new Adapter::Service), true);
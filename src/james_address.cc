@@ -0,0 +1,205 @@
+#include "james_ecap.h"
+#include "james_address.h"
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <libecap/common/errors.h>
+
+namespace Adapter {
+
+    static const unsigned char V4Mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+
+} // namespace Adapter
+
+bool Adapter::ClientAddress::parse(const char *start, size_t size) {
+    memset(bytes, 0, sizeof(bytes));
+
+    char text[INET6_ADDRSTRLEN];
+    if (!start || size >= sizeof(text))
+        return false;
+    memcpy(text, start, size); // the host need not terminate it
+    text[size] = 0;
+
+    if (inet_pton(AF_INET, text, bytes + sizeof(V4Mapped)) == 1) {
+        memcpy(bytes, V4Mapped, sizeof(V4Mapped));
+        return true;
+    }
+    if (inet_pton(AF_INET6, text, bytes) == 1)
+        return true;
+    memset(bytes, 0, sizeof(bytes));
+    return false;
+}
+
+bool Adapter::ClientAddress::known() const {
+    for (unsigned int i = 0; i < sizeof(bytes); ++i) {
+        if (bytes[i])
+            return true;
+    }
+    return false;
+}
+
+bool Adapter::ClientAddress::v4() const {
+    return memcmp(bytes, V4Mapped, sizeof(V4Mapped)) == 0;
+}
+
+std::string Adapter::ClientAddress::text() const {
+    char text[INET6_ADDRSTRLEN];
+    const char *result = v4() ?
+        inet_ntop(AF_INET, bytes + sizeof(V4Mapped), text, sizeof(text)) :
+        inet_ntop(AF_INET6, bytes, text, sizeof(text));
+    return result ? result : "";
+}
+
+Adapter::ClientAddress Adapter::ClientAddress::FromKey(const std::string &key) {
+    ClientAddress address;
+    Must(key.size() == sizeof(address.bytes));
+    memcpy(address.bytes, key.data(), sizeof(address.bytes));
+    return address;
+}
+
+unsigned int Adapter::ClientAddress::commonBits(const ClientAddress &other, unsigned int limit) const {
+    unsigned int common = 0;
+    for (unsigned int i = 0; i < sizeof(bytes) && common < limit; ++i) {
+        const unsigned char diff = bytes[i] ^ other.bytes[i];
+        if (!diff) {
+            common += 8;
+            continue;
+        }
+        for (unsigned char m = 0x80; !(diff & m); m >>= 1)
+            ++common;
+        break;
+    }
+    return common < limit ? common : limit;
+}
+
+void Adapter::ClientAddress::mask(unsigned int length) {
+    for (unsigned int i = 0; i < sizeof(bytes); ++i) {
+        if (length >= 8 * (i + 1))
+            continue;
+        const unsigned int kept = length > 8 * i ? length - 8 * i : 0;
+        bytes[i] &= static_cast<unsigned char> (0xFF << (8 - kept));
+    }
+}
+
+Adapter::SubnetPolicies::SubnetPolicies() : nodes(1) {
+}
+
+void Adapter::SubnetPolicies::parse(const std::string &text, const std::string &errorPrefix) {
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        const std::string::size_type comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream words(line);
+        std::string action, subnet, extra;
+        if (!(words >> action))
+            continue; // empty line
+        if (!(words >> subnet))
+            throw libecap::TextException(errorPrefix + "subnet rule without a subnet: " + line);
+        if (words >> extra)
+            throw libecap::TextException(errorPrefix + "subnet rule with extra words: " + line);
+
+        Policy policy;
+        if (action == "allow")
+            policy = spAllow;
+        else if (action == "block")
+            policy = spBlock;
+        else if (action == "captive")
+            policy = spCaptive;
+        else
+            throw libecap::TextException(errorPrefix + "unknown subnet rule action: " + action);
+
+        const std::string::size_type slash = subnet.find('/');
+        const std::string host = subnet.substr(0, slash);
+        ClientAddress prefix;
+        if (!prefix.parse(host.data(), host.size()))
+            throw libecap::TextException(errorPrefix + "invalid subnet address: " + subnet);
+
+        unsigned int length = ClientAddress::Bits;
+        if (slash != std::string::npos) {
+            const std::string bits = subnet.substr(slash + 1);
+            char *end = 0;
+            const unsigned long value = strtoul(bits.c_str(), &end, 10);
+            if (bits.empty() || *end || value > (prefix.v4() ? 32U : 128U))
+                throw libecap::TextException(errorPrefix + "invalid subnet prefix length: " + subnet);
+            length = prefix.v4() ? 96 + value : value;
+        }
+
+        add(prefix, length, policy);
+    }
+}
+
+void Adapter::SubnetPolicies::load(const std::string &fileName, const std::string &errorPrefix) {
+    std::ifstream is(fileName.c_str());
+    std::ostringstream text;
+    text << is.rdbuf();
+    if (!is)
+        throw libecap::TextException(errorPrefix + "cannot read subnets file: " + fileName);
+    parse(text.str(), errorPrefix);
+}
+
+void Adapter::SubnetPolicies::add(const ClientAddress &address, unsigned int length, Policy policy) {
+    Must(length <= ClientAddress::Bits);
+    Must(policy != spNone);
+    ClientAddress prefix = address;
+    prefix.mask(length);
+
+    unsigned int n = 0;
+    while (nodes[n].length < length) {
+        const bool side = prefix.bit(nodes[n].length);
+        const unsigned int c = nodes[n].child[side];
+        if (!c) {
+            const unsigned int leaf = grow(prefix, length, policy);
+            nodes[n].child[side] = leaf;
+            return;
+        }
+
+        const unsigned int childLength = nodes[c].length;
+        const unsigned int common = prefix.commonBits(nodes[c].prefix,
+            childLength < length ? childLength : length);
+        if (common == childLength) {
+            n = c; // the child's prefix is ours, or a part of it
+            continue;
+        }
+
+        // split the edge to the child where our prefixes part
+        ClientAddress shared = prefix;
+        shared.mask(common);
+        const unsigned int split = grow(shared, common, common == length ? policy : spNone);
+        nodes[split].child[nodes[c].prefix.bit(common)] = c;
+        if (common < length)
+            nodes[split].child[prefix.bit(common)] = grow(prefix, length, policy);
+        nodes[n].child[side] = split;
+        return;
+    }
+    nodes[n].policy = policy; // the same prefix again; the last rule wins
+}
+
+Adapter::SubnetPolicies::Policy Adapter::SubnetPolicies::find(const ClientAddress &address) const {
+    Policy best = spCaptive;
+    unsigned int n = 0;
+    do {
+        const Node &node = nodes[n];
+        if (address.commonBits(node.prefix, node.length) < node.length)
+            break;
+        if (node.policy != spNone)
+            best = node.policy;
+        if (node.length == ClientAddress::Bits)
+            break;
+        n = node.child[address.bit(node.length)];
+    } while (n);
+    return best;
+}
+
+unsigned int Adapter::SubnetPolicies::grow(const ClientAddress &prefix, unsigned int length, Policy policy) {
+    Node node;
+    node.prefix = prefix;
+    node.length = length;
+    node.policy = policy;
+    nodes.push_back(node);
+    return nodes.size() - 1;
+}
@@ -0,0 +1,97 @@
+#ifndef JAMES_ADDRESS_H
+#define JAMES_ADDRESS_H
+
+#include <cstring>
+#include <string>
+#include <vector>
+#include <libecap/common/area.h>
+
+namespace Adapter {
+
+    // A client IPv4 or IPv6 address as a 128-bit key, parsed once per
+    // transaction. IPv4 addresses are kept IPv4-mapped (::ffff:a.b.c.d),
+    // so both families share one key space. The all-zeros address (::)
+    // means unknown.
+
+    class ClientAddress {
+    public:
+        enum { Bits = 128, Bytes = Bits / 8 };
+
+        ClientAddress() { memset(bytes, 0, sizeof(bytes)); }
+
+        // from the textual form; returns false, leaving us unknown, if invalid
+        bool parse(const char *start, size_t size);
+        bool parse(const libecap::Area &area) { return parse(area.start, area.size); }
+
+        bool known() const;
+        bool v4() const; // IPv4-mapped
+
+        std::string text() const; // dotted quad for IPv4; for the store and logs
+
+        // the raw 16 bytes, for keying containers of strings
+        std::string key() const { return std::string(reinterpret_cast<const char*> (bytes), sizeof(bytes)); }
+        static ClientAddress FromKey(const std::string &key);
+
+        bool bit(unsigned int i) const { return (bytes[i / 8] >> (7 - i % 8)) & 1; }
+
+        // the number of leading bits, up to limit, shared with other
+        unsigned int commonBits(const ClientAddress &other, unsigned int limit) const;
+
+        void mask(unsigned int length); // clears all but the first length bits
+
+        bool operator <(const ClientAddress &other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) < 0; }
+        bool operator ==(const ClientAddress &other) const { return memcmp(bytes, other.bytes, sizeof(bytes)) == 0; }
+
+        unsigned char bytes[Bytes]; // network order
+    };
+
+    // What to do with the clients of a subnet, compiled once from text like
+    //
+    //     allow 10.20.0.0/16         never captive (staff, infrastructure)
+    //     block 192.0.2.0/24         always served the captive page
+    //     captive 10.20.5.0/24       the usual captive portal machinery
+    //
+    // one rule per line; '#' starts a comment. The longest matching prefix
+    // wins; addresses no rule matches are captive. Rules are kept in a
+    // path-compressed binary radix trie, so a lookup visits at most one node
+    // per distinct prefix length on the way. Immutable once compiled; safe
+    // to share between threads.
+
+    class SubnetPolicies {
+    public:
+        typedef enum {
+            spNone, spCaptive, spAllow, spBlock
+        } Policy;
+
+        SubnetPolicies();
+
+        // compiles and adds rules; errors are thrown as
+        // libecap::TextException messages starting with errorPrefix
+        void parse(const std::string &text, const std::string &errorPrefix);
+        void load(const std::string &fileName, const std::string &errorPrefix);
+
+        void add(const ClientAddress &prefix, unsigned int length, Policy policy);
+
+        Policy find(const ClientAddress &address) const; // never spNone
+
+        bool empty() const { return nodes.size() == 1 && nodes[0].policy == spNone; }
+
+    private:
+        class Node {
+        public:
+            Node() : length(0), policy(spNone) { child[0] = child[1] = 0; }
+
+            ClientAddress prefix; // host bits cleared
+            unsigned int length; // prefix bits; more than the parent's
+            Policy policy; // spNone for branching nodes
+            unsigned int child[2]; // by the bit after the prefix; 0 if none
+        };
+
+        unsigned int grow(const ClientAddress &prefix, unsigned int length, Policy policy);
+
+        std::vector<Node> nodes; // the root, ::/0, first
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_ADDRESS_H */
@@ -0,0 +1,26 @@
+#include "james_ecap.h"
+#include "james_budget.h"
+
+uint64_t Adapter::MemoryBudget::Used_ = 0;
+uint64_t Adapter::MemoryBudget::Limit_ = 0;
+
+void Adapter::MemoryBudget::Limit(uint64_t bytes) {
+    __sync_lock_test_and_set(&Limit_, bytes);
+}
+
+bool Adapter::MemoryBudget::Exceeded() {
+    const uint64_t limit = __sync_fetch_and_add(&Limit_, 0);
+    return limit && Used() > limit;
+}
+
+uint64_t Adapter::MemoryBudget::Used() {
+    return __sync_fetch_and_add(&Used_, 0);
+}
+
+void Adapter::MemoryBudget::Share::set(size_type size) {
+    if (size > bytes)
+        __sync_fetch_and_add(&Used_, size - bytes);
+    else if (size < bytes)
+        __sync_fetch_and_sub(&Used_, bytes - size);
+    bytes = size;
+}
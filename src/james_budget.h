@@ -0,0 +1,49 @@
+#ifndef JAMES_BUDGET_H
+#define JAMES_BUDGET_H
+
+#include <stdint.h>
+#include <libecap/common/forward.h>
+
+namespace Adapter {
+
+    using libecap::size_type;
+
+    // Bytes buffered by all transactions of the adapter module, against
+    // the limit set by the memory_budget option. Accounting is atomic and
+    // never blocks. Going over the limit fails nothing by itself: new
+    // transactions check Exceeded() and pass messages through unadapted
+    // until the buffers of the admitted ones drain.
+
+    class MemoryBudget {
+    public:
+        static void Limit(uint64_t bytes); // zero means unlimited
+        static bool Exceeded();
+        static uint64_t Used();
+
+        // the part of the total held by one buffer
+        class Share {
+        public:
+            Share() : bytes(0) {
+            }
+
+            ~Share() {
+                set(0);
+            }
+
+            void set(size_type size); // the buffer holds size bytes now
+
+        private:
+            size_type bytes;
+
+            Share(const Share &); // not implemented
+            Share &operator =(const Share &); // not implemented
+        };
+
+    private:
+        static uint64_t Used_;
+        static uint64_t Limit_;
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_BUDGET_H */
@@ -0,0 +1,136 @@
+#include "james_ecap.h"
+#include "james_buffer.h"
+#include "james_stats.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <sys/mman.h>
+#include <unistd.h>
+
+static Adapter::Counter SpilledBytes("buffer.spilled_bytes");
+static Adapter::Counter SpillErrors("buffer.spill_errors");
+
+// largest spill file window mapped at once
+static const libecap::size_type MaxMapping = 1024 * 1024;
+
+// keeps a spill file window mapped while the host holds the Area
+class MappedArea : public libecap::AreaDetails {
+public:
+    MappedArea(void *aBase, size_t aSize) : base(aBase), size(aSize) {
+    }
+
+    virtual ~MappedArea() {
+        munmap(base, size);
+    }
+
+private:
+    void *base;
+    size_t size;
+};
+
+Adapter::BodyBuffer::BodyBuffer() : memoryCap(0), fd(-1), fileStart(0), fileEnd(0),
+windowBase(0), windowStart(0), windowEnd(0) {
+}
+
+Adapter::BodyBuffer::~BodyBuffer() {
+    if (fd >= 0)
+        close(fd);
+}
+
+void Adapter::BodyBuffer::configure(size_type aMemoryCap, const std::string &aSpillDir) {
+    memoryCap = aMemoryCap;
+    spillDir = aSpillDir;
+}
+
+bool Adapter::BodyBuffer::append(const char *data, size_type size) {
+    // once spilled, content must stay ordered: new bytes follow the file
+    if (!spilled() && (!memoryCap || memory.size() + size <= memoryCap)) {
+        memory.append(data, size);
+        memoryShare.set(memory.size());
+        return true;
+    }
+    return spill(data, size);
+}
+
+bool Adapter::BodyBuffer::spill(const char *data, size_type size) {
+    if (spillDir.empty())
+        return false;
+
+    if (fd < 0) {
+        std::string name = spillDir + "/james-spill-XXXXXX";
+        fd = mkstemp(&name[0]);
+        if (fd < 0) {
+            SpillErrors.add();
+            return false;
+        }
+        unlink(name.c_str()); // the space is reclaimed when we close fd
+    }
+
+    for (size_type written = 0; written < size;) {
+        const ssize_t n = pwrite(fd, data + written, size - written, fileEnd + written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            // nothing was appended as far as our offsets are concerned
+            SpillErrors.add();
+            return false;
+        }
+        written += n;
+    }
+    fileEnd += size;
+    SpilledBytes.add(size);
+    return true;
+}
+
+libecap::Area Adapter::BodyBuffer::content(size_type offset, size_type size) const {
+    if (offset < memory.size()) {
+        size = std::min(size, memory.size() - offset);
+        return libecap::Area::FromTempBuffer(memory.data() + offset, size);
+    }
+
+    const uint64_t start = fileStart + (offset - memory.size());
+    if (start >= fileEnd)
+        return libecap::Area();
+    if ((!window || start < windowStart || start >= windowEnd) && !map(start))
+        return libecap::Area();
+
+    // the window ends before fileEnd if we spilled more since mapping it
+    size = std::min<uint64_t>(size, windowEnd - start);
+    return libecap::Area(windowBase + (start - windowStart), size, window);
+}
+
+// the host keeps an old window mapped while it holds Areas of it
+bool Adapter::BodyBuffer::map(uint64_t start) const {
+    // mmap offsets must be page-aligned
+    static const uint64_t page = sysconf(_SC_PAGESIZE);
+    const uint64_t mapStart = start / page * page;
+    const size_t mapSize = std::min<uint64_t>(fileEnd - mapStart, MaxMapping);
+    void *base = mmap(0, mapSize, PROT_READ, MAP_SHARED, fd, mapStart);
+    if (base == MAP_FAILED) {
+        SpillErrors.add();
+        return false;
+    }
+
+    window.reset(new MappedArea(base, mapSize));
+    windowBase = static_cast<const char*> (base);
+    windowStart = mapStart;
+    windowEnd = mapStart + mapSize;
+    return true;
+}
+
+void Adapter::BodyBuffer::shift(size_type size) {
+    const size_type fromMemory = std::min(size, memory.size());
+    memory.erase(0, fromMemory);
+    memoryShare.set(memory.size());
+    fileStart += size - fromMemory;
+
+    // once everything spilled has been consumed, the next spill starts a
+    // fresh file; rewriting this one would change pages the host may still
+    // map, and its space is reclaimed when the last mapping goes away
+    if (fd >= 0 && fileStart >= fileEnd) {
+        window.reset();
+        close(fd);
+        fd = -1;
+        fileStart = fileEnd = 0;
+    }
+}
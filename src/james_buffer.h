@@ -0,0 +1,68 @@
+#ifndef JAMES_BUFFER_H
+#define JAMES_BUFFER_H
+
+#include "james_budget.h"
+#include <string>
+#include <stdint.h>
+#include <libecap/common/area.h>
+
+namespace Adapter {
+
+    using libecap::size_type;
+
+    // Accumulates adapted body content with a per-transaction memory cap.
+    // Content beyond the cap spills into an unlinked temporary file that
+    // is read back through a window mmap(2)ed for many content() calls.
+    // The file is only appended to; a fresh one is started once it has
+    // all been consumed, as the host may still hold mapped pages of the
+    // old one. Bytes in memory count against the MemoryBudget. Without a
+    // spill directory (or if the file cannot be created), append() refuses
+    // content that would exceed the cap and leaves the caller to decide
+    // what to do with it.
+
+    class BodyBuffer {
+    public:
+        BodyBuffer();
+        ~BodyBuffer();
+
+        // memoryCap of zero means unlimited; empty spillDir disables spilling
+        void configure(size_type memoryCap, const std::string &spillDir);
+
+        bool append(const char *data, size_type size); // false if refused
+        bool append(const std::string &data) {
+            return append(data.data(), data.size());
+        }
+
+        size_type size() const { return memory.size() + (fileEnd - fileStart); }
+        bool empty() const { return !size(); }
+        bool spilled() const { return fileEnd > fileStart; }
+
+        // may return less than requested when the content is split
+        // between memory and the spill file
+        libecap::Area content(size_type offset, size_type size) const;
+        void shift(size_type size);
+
+    private:
+        bool spill(const char *data, size_type size);
+        bool map(uint64_t start) const; // maps the window at start
+
+
+        std::string memory; // the oldest content
+        MemoryBudget::Share memoryShare; // memory bytes, against the budget
+        size_type memoryCap;
+        std::string spillDir;
+        int fd; // spill file, or -1
+        uint64_t fileStart; // unread spill file content offsets
+        uint64_t fileEnd;
+        mutable libecap::Area::Details window; // mapped spill file part
+        mutable const char *windowBase; // where the window is mapped
+        mutable uint64_t windowStart; // spill file offsets of the window
+        mutable uint64_t windowEnd;
+
+        BodyBuffer(const BodyBuffer &); // not implemented
+        BodyBuffer &operator =(const BodyBuffer &); // not implemented
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_BUFFER_H */
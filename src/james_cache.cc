@@ -0,0 +1,95 @@
+#include "james_ecap.h"
+#include "james_cache.h"
+#include "james_stats.h"
+
+static Adapter::Counter Hits("cache.hits");
+static Adapter::Counter Misses("cache.misses");
+static Adapter::Counter Evictions("cache.evictions");
+
+// keeps a cached body alive while the host holds an Area pointing into it
+class CachedArea : public libecap::AreaDetails {
+public:
+    CachedArea(const Adapter::BodyCache::Body &aBody) : body(aBody) {
+    }
+
+private:
+    const Adapter::BodyCache::Body body;
+};
+
+Adapter::BodyCache::BodyCache(size_type aBudget) : budget_(aBudget), used(0) {
+    pthread_mutex_init(&mutex, 0);
+}
+
+Adapter::BodyCache::~BodyCache() {
+    pthread_mutex_destroy(&mutex);
+}
+
+Adapter::BodyCache::Body Adapter::BodyCache::find(const std::string &key) {
+    Body body;
+    pthread_mutex_lock(&mutex);
+    const std::map<std::string, Entries::iterator>::iterator i = index.find(key);
+    if (i != index.end()) {
+        entries.splice(entries.begin(), entries, i->second); // most recent now
+        body = i->second->second;
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (body)
+        Hits.add();
+    else
+        Misses.add();
+    return body;
+}
+
+void Adapter::BodyCache::insert(const std::string &key, const Body &body) {
+    const size_type size = key.size() + body->size();
+    if (size > budget_)
+        return;
+
+    pthread_mutex_lock(&mutex);
+    const std::map<std::string, Entries::iterator>::iterator old = index.find(key);
+    if (old != index.end())
+        forget(old->second); // another transaction adapted the same page
+
+    while (used + size > budget_) {
+        forget(--entries.end());
+        Evictions.add();
+    }
+
+    entries.push_front(Entry(key, body));
+    index[key] = entries.begin();
+    used += size;
+    pthread_mutex_unlock(&mutex);
+}
+
+void Adapter::BodyCache::clear() {
+    pthread_mutex_lock(&mutex);
+    Entries gone;
+    gone.swap(entries);
+    index.clear();
+    used = 0;
+    pthread_mutex_unlock(&mutex);
+    // gone bodies, if they were the last references, are destroyed here, unlocked
+}
+
+void Adapter::BodyCache::forget(Entries::iterator i) {
+    used -= i->first.size() + i->second->size();
+    index.erase(i->first);
+    entries.erase(i);
+}
+
+libecap::Area Adapter::BodyCache::Content(const Body &body, size_type offset, size_type size) {
+    if (offset >= body->size())
+        return libecap::Area();
+    if (size > body->size() - offset)
+        size = body->size() - offset;
+    const libecap::Area::Details details(new CachedArea(body));
+    return libecap::Area(body->data() + offset, size, details);
+}
+
+uint64_t Adapter::BodyCache::Version(const std::string &payload) {
+    uint64_t hash = 14695981039346656037ULL; // FNV-1a
+    for (std::string::const_iterator i = payload.begin(); i != payload.end(); ++i)
+        hash = (hash ^ static_cast<unsigned char> (*i)) * 1099511628211ULL;
+    return hash;
+}
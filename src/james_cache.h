@@ -0,0 +1,59 @@
+#ifndef JAMES_CACHE_H
+#define JAMES_CACHE_H
+
+#include <list>
+#include <map>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+#include <libecap/common/area.h>
+#include <libecap/common/memory.h>
+
+namespace Adapter {
+
+    using libecap::size_type;
+
+    // Adapted bodies of popular pages, least recently used first out when
+    // the keys and bodies exceed the byte budget. Bodies are immutable and
+    // shared: a hit is served straight from the cached copy, which stays
+    // alive while any transaction or host Area still uses it, even after
+    // eviction. All methods may be called from any host thread.
+
+    class BodyCache {
+    public:
+        typedef libecap::shared_ptr<const std::string> Body;
+
+        explicit BodyCache(size_type aBudget);
+        ~BodyCache();
+
+        size_type budget() const { return budget_; }
+
+        Body find(const std::string &key); // nil on a miss
+        void insert(const std::string &key, const Body &body);
+        void clear(); // forgets all entries
+
+        // a piece of body, without copying it
+        static libecap::Area Content(const Body &body, size_type offset, size_type size);
+
+        // identifies the payload the cached bodies were adapted with
+        static uint64_t Version(const std::string &payload);
+
+    private:
+        typedef std::pair<std::string, Body> Entry;
+        typedef std::list<Entry> Entries; // most recently used first
+
+        void forget(Entries::iterator i);
+
+        const size_type budget_;
+        size_type used; // key and body bytes of all entries
+        Entries entries;
+        std::map<std::string, Entries::iterator> index;
+        pthread_mutex_t mutex;
+
+        BodyCache(const BodyCache &); // not implemented
+        BodyCache &operator =(const BodyCache &); // not implemented
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_CACHE_H */
@@ -0,0 +1,534 @@
+#include "james_ecap.h"
+#include "james_captive.h"
+#include "james_stats.h"
+#include <libecap/common/errors.h>
+#include <algorithm>
+#include <iostream>
+#include <errno.h>
+#include <sys/time.h>
+#include <time.h>
+
+// breaker decisions are made over this many queries
+#define BREAKER_WINDOW 20
+// the first reconnection delay, in milliseconds; doubled after each failure
+#define BACKOFF_START 100
+// seconds between reports of breaker trips on std::cerr
+#define TRIP_REPORT_INTERVAL 60
+
+// seconds after which visit counts are halved
+#define VISITS_HALF_LIFE 30
+// seconds a cached record of a client that is not hot may be used
+#define CACHE_TTL 5
+// seconds between writes of a pinned record
+#define WRITE_BEHIND 1
+// most sessions ended by one store query
+#define SESSION_BATCH 256
+
+namespace Adapter {
+
+    static Counter BreakerTrips("db.breaker_trips");
+    static Counter PolicyAnswers("db.policy_answers");
+    static Counter Reconnects("db.reconnects");
+    static Counter CacheHits("db.cache_hits");
+    static Counter DeferredWrites("db.deferred_writes");
+    static Counter HammeringClients("captive.hammering_clients");
+    static Counter EndedSessions("captive.sessions_ended");
+    static Counter SubnetAnswers("captive.subnet_answers");
+    static Counter QuotaAnswers("captive.quota_answers");
+    static Counter SessionEndFailures("captive.session_end_failures");
+
+    static double Now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+} // namespace Adapter
+
+Adapter::StateCache::StateCache(size_t aCapacity, const HeavyHitters &aVisitors) :
+capacity(aCapacity), visitors(aVisitors) {
+    pthread_mutex_init(&mutex, 0);
+}
+
+Adapter::StateCache::~StateCache() {
+    pthread_mutex_destroy(&mutex);
+}
+
+bool Adapter::StateCache::find(const ClientAddress &address, ClientRecord &record, time_t now) {
+    bool found = false;
+    pthread_mutex_lock(&mutex);
+    const std::map<ClientAddress, Entry>::iterator i = entries.find(address);
+    if (i != entries.end() && (i->second.pinned || now - i->second.fetched < CACHE_TTL)) {
+        ages.splice(ages.end(), ages, i->second.age); // most recent now
+        record = i->second.record;
+        found = true;
+    }
+    pthread_mutex_unlock(&mutex);
+    return found;
+}
+
+bool Adapter::StateCache::remember(const ClientAddress &address, const ClientRecord &record,
+        bool hot, time_t now, Records &evicted) {
+    pthread_mutex_lock(&mutex);
+    std::map<ClientAddress, Entry>::iterator i = entries.find(address);
+    if (i == entries.end()) {
+        i = entries.insert(std::make_pair(address, Entry())).first;
+        i->second.written = 0;
+        i->second.age = ages.insert(ages.end(), address);
+    } else {
+        ages.splice(ages.end(), ages, i->second.age);
+    }
+
+    Entry &entry = i->second;
+    entry.record = record;
+    entry.fetched = now;
+    entry.pinned = hot;
+    // hot clients may visit many times a second; the last visit wins
+    const bool writeNow = !hot || now - entry.written >= WRITE_BEHIND;
+    if (writeNow)
+        entry.written = now;
+    entry.dirty = !writeNow;
+
+    if (entries.size() > capacity)
+        evict(evicted);
+    pthread_mutex_unlock(&mutex);
+    return writeNow;
+}
+
+void Adapter::StateCache::evict(Records &evicted) {
+    Ages::iterator i = ages.begin();
+    while (entries.size() > capacity && i != ages.end()) {
+        const std::map<ClientAddress, Entry>::iterator victim = entries.find(*i);
+        Must(victim != entries.end());
+        const Entry &entry = victim->second;
+        if (entry.pinned && visitors.hot(visitors.estimate(i->key()))) {
+            ++i; // still hot; if all are, we hold more than capacity
+            continue;
+        }
+        if (entry.dirty)
+            evicted.push_back(std::make_pair(*i, entry.record));
+        entries.erase(victim);
+        i = ages.erase(i);
+    }
+}
+
+Adapter::Sessions::Sessions(const DbConfig &aConfig) : config(aConfig),
+wheel(time(NULL)), stopping(false) {
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&wakeup, 0);
+    if (pthread_create(&expirer, 0, &Sessions::Expire, this)) {
+        pthread_cond_destroy(&wakeup);
+        pthread_mutex_destroy(&mutex);
+        throw libecap::TextException("cannot start the captive session thread");
+    }
+}
+
+Adapter::Sessions::~Sessions() {
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(expirer, 0);
+
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&mutex);
+}
+
+bool Adapter::Sessions::visit(const ClientAddress &address, time_t now) {
+    const std::string key = address.key();
+    pthread_mutex_lock(&mutex);
+    const bool live = wheel.deadline(key) > now;
+    wheel.schedule(key, now + config.dbsession);
+    pthread_mutex_unlock(&mutex);
+    return live;
+}
+
+void *Adapter::Sessions::Expire(void *sessions) {
+    static_cast<Sessions*> (sessions)->expire();
+    return 0;
+}
+
+void Adapter::Sessions::expire() {
+    ClientStore::ThreadStart();
+    ClientStore *store = 0; // made when the first sessions end
+
+    pthread_mutex_lock(&mutex);
+    while (!stopping) {
+        const struct timespec tick = {time(NULL) + 1, 0};
+        if (pthread_cond_timedwait(&wakeup, &mutex, &tick) != ETIMEDOUT)
+            continue; // stopping or spurious wakeup
+
+        TimerWheel::Keys expired;
+        wheel.advance(time(NULL), expired);
+        pthread_mutex_unlock(&mutex);
+
+        ClientStore::ClientIps batch;
+        for (TimerWheel::Keys::const_iterator i = expired.begin(); i != expired.end(); ++i) {
+            batch.insert(ClientAddress::FromKey(*i).text());
+            if (batch.size() >= SESSION_BATCH) {
+                end(store, batch);
+                batch.clear();
+            }
+        }
+        if (!batch.empty())
+            end(store, batch);
+
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    delete store;
+}
+
+// a failed batch is dropped: only the cntime the store reports goes
+// stale, as visits learn from the wheel alone whether a session is live
+void Adapter::Sessions::end(ClientStore *&store, const ClientStore::ClientIps &clientIps) {
+    if (!store)
+        store = ClientStore::Make(config);
+    if (store->connect() && store->endSessions(clientIps, time(NULL) - config.dbsession))
+        EndedSessions.add(clientIps.size());
+    else
+        SessionEndFailures.add(clientIps.size());
+}
+
+Adapter::ClientDb::ClientDb(const DbConfig &aConfig, bool aFailOpen, HeavyHitters &aVisitors,
+        Sessions &aSessions, StateCache *aCache) :
+failOpen(aFailOpen), config(aConfig), visitors(aVisitors), sessions(aSessions), cache(aCache),
+store(0), breaker(bkOpen), calls(0),
+failures(0), reported(0), unreported(0), fresh(0), retired(0), wanted(true), stopping(false) {
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&wakeup, 0);
+    if (pthread_create(&supervisor, 0, &ClientDb::Supervise, this)) {
+        pthread_cond_destroy(&wakeup);
+        pthread_mutex_destroy(&mutex);
+        throw libecap::TextException("cannot start the database supervisor thread");
+    }
+}
+
+Adapter::ClientDb::~ClientDb() {
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(supervisor, 0);
+
+    delete store;
+    delete fresh;
+    delete retired;
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&mutex);
+}
+
+Adapter::ClientStore *Adapter::ClientDb::acquire() {
+    if (breaker == bkOpen) {
+        pthread_mutex_lock(&mutex);
+        if (fresh) {
+            store = fresh;
+            fresh = 0;
+            breaker = bkHalfOpen; // the next query decides
+        }
+        pthread_mutex_unlock(&mutex);
+    }
+
+    if (breaker == bkOpen)
+        return 0;
+
+    // never let the store reconnect inline
+    if (!store->connected()) {
+        trip();
+        return 0;
+    }
+    return store;
+}
+
+void Adapter::ClientDb::record(bool ok, double started) {
+    if (ok && Now() - started > config.dbslow / 1000.0)
+        ok = false; // a slow answer is as bad as none
+
+    if (breaker == bkHalfOpen) {
+        if (ok) {
+            breaker = bkClosed;
+            calls = failures = 0;
+        } else {
+            trip();
+        }
+        return;
+    }
+
+    ++calls;
+    if (!ok)
+        ++failures;
+    if (failures * 100 >= config.dbtriprate * BREAKER_WINDOW)
+        trip();
+    else if (calls >= BREAKER_WINDOW)
+        calls = failures = 0;
+}
+
+void Adapter::ClientDb::trip() {
+    BreakerTrips.add();
+    ++unreported;
+    const time_t now = time(NULL);
+    if (now - reported >= TRIP_REPORT_INTERVAL) {
+        std::cerr << "client database unavailable (" << unreported <<
+            " trips), failing " << (failOpen ? "open" : "closed") << std::endl;
+        reported = now;
+        unreported = 0;
+    }
+
+    // closing a broken connection may block; let the supervisor do it
+    pthread_mutex_lock(&mutex);
+    Must(!retired); // the supervisor takes it before making a fresh store
+    retired = store;
+    wanted = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&mutex);
+
+    store = 0;
+    breaker = bkOpen;
+    calls = failures = 0;
+}
+
+void *Adapter::ClientDb::Supervise(void *db) {
+    static_cast<ClientDb*> (db)->supervise();
+    return 0;
+}
+
+void Adapter::ClientDb::supervise() {
+    ClientStore::ThreadStart();
+    unsigned int backoff = 0; // milliseconds
+
+    pthread_mutex_lock(&mutex);
+    while (!stopping) {
+        if (!wanted) {
+            backoff = 0;
+            pthread_cond_wait(&wakeup, &mutex);
+            continue;
+        }
+
+        if (backoff) {
+            struct timeval now;
+            gettimeofday(&now, 0);
+            const unsigned long long deadline = (now.tv_sec * 1000000ULL + now.tv_usec) + backoff * 1000ULL;
+            const struct timespec until = {static_cast<time_t> (deadline / 1000000),
+                static_cast<long> (deadline % 1000000) * 1000};
+            if (pthread_cond_timedwait(&wakeup, &mutex, &until) != ETIMEDOUT)
+                continue; // stopping or spurious wakeup
+        }
+
+        ClientStore *old = retired;
+        retired = 0;
+        pthread_mutex_unlock(&mutex);
+
+        delete old;
+        ClientStore *candidate = ClientStore::Make(config);
+        const bool connected = candidate->connect();
+        if (!connected) {
+            delete candidate;
+            candidate = 0;
+        }
+
+        pthread_mutex_lock(&mutex);
+        if (candidate) {
+            Reconnects.add();
+            fresh = candidate;
+            wanted = false;
+        } else {
+            backoff = backoff ? std::min(backoff * 2, config.dbbackoff * 1000) : BACKOFF_START;
+        }
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+// Every visit within a session (dbsession seconds of the previous one)
+// flips the client between blocked and allowed; new clients start blocked.
+bool Adapter::ClientDb::captiveVisit(const ClientAddress &address) {
+    FUNCENTER();
+
+    const std::string key = address.key();
+    const uint32_t visits = visitors.add(key);
+    const bool hammering = config.dbhammer && visits > config.dbhammer;
+    if (hammering && visits == config.dbhammer + 1) {
+        std::cerr << "client " << address.text() << " is hammering the captive portal" << std::endl;
+        HammeringClients.add();
+    }
+    const bool hot = hammering || visitors.hot(visits);
+
+    const time_t now = time(NULL);
+    const bool live = sessions.visit(address, now);
+
+    ClientRecord client;
+    ClientStore::Lookup found = ClientStore::lkFailed;
+    if (cache && cache->find(address, client, now)) {
+        CacheHits.add();
+        found = ClientStore::lkFound;
+    } else if (ClientStore *s = acquire()) {
+        const double started = Now();
+        found = s->lookup(address.text(), client);
+        record(found != ClientStore::lkFailed, started);
+    }
+    if (found == ClientStore::lkFailed) {
+        PolicyAnswers.add();
+        return failOpen;
+    }
+
+    if (found == ClientStore::lkFound) {
+        if (live)
+            ++client.cn;
+    } else {
+        client.starttime = now;
+        client.time = now;
+        client.cn = 1;
+    }
+    client.cntime = now;
+
+    StateCache::Records writes;
+    if (!cache || cache->remember(address, client, hot, now, writes))
+        writes.push_back(std::make_pair(address, client));
+    else
+        DeferredWrites.add();
+
+    for (StateCache::Records::const_iterator i = writes.begin(); i != writes.end(); ++i) {
+        if (ClientStore *s = acquire()) {
+            const double started = Now();
+            record(s->upsert(i->first.text(), i->second), started);
+        }
+    }
+
+    return client.cn % 2 == 0;
+}
+
+bool Adapter::ClientDb::lookup(const ClientAddress &address, ClientRecord &client) {
+    if (!address.known())
+        return false;
+    if (cache && cache->find(address, client, time(NULL))) {
+        CacheHits.add();
+        return true;
+    }
+    ClientStore *s = acquire();
+    if (!s)
+        return false;
+    const double started = Now();
+    const ClientStore::Lookup found = s->lookup(address.text(), client);
+    record(found != ClientStore::lkFailed, started);
+    return found == ClientStore::lkFound;
+}
+
+bool Adapter::ClientDb::touch(const ClientAddress &address) {
+    if (!address.known())
+        return true; // nothing to record
+    ClientStore *s = acquire();
+    if (!s)
+        return false;
+    const double started = Now();
+    record(s->touch(address.text()), started);
+    return true;
+}
+
+Adapter::ClientDbs::ClientDbs(const DbConfig &aConfig, bool aFailOpen,
+        const SubnetPolicies &aSubnets) :
+config(aConfig), failOpen(aFailOpen), subnets(aSubnets), visitors(VISITS_HALF_LIFE),
+sessions(aConfig), cache(0), neighbors(0), meter(0) {
+    if (pthread_key_create(&key, 0))
+        throw libecap::TextException("cannot create the client database key");
+    pthread_mutex_init(&mutex, 0);
+    if (config.dbcache)
+        cache = new StateCache(config.dbcache, visitors);
+    if (config.dbidentity == "mac")
+        neighbors = new NeighborTable(NeighborSource::Make());
+    else if (config.dbidentity != "ip")
+        std::cerr << "unsupported dbidentity " << config.dbidentity << ", using ip" << std::endl;
+    if (config.dbaccount)
+        meter = new VolumeMeter(config);
+}
+
+Adapter::ClientDbs::~ClientDbs() {
+    pthread_key_delete(key);
+    for (std::vector<ClientDb*>::iterator i = dbs.begin(); i != dbs.end(); ++i)
+        delete *i;
+    delete cache;
+    delete neighbors;
+    delete meter;
+    pthread_mutex_destroy(&mutex);
+}
+
+bool Adapter::ClientDbs::captiveVisit(const ClientAddress &address) const {
+    if (!address.known()) {
+        PolicyAnswers.add();
+        return failOpen; // nothing to track the client by
+    }
+
+    switch (subnets.find(address)) {
+    case SubnetPolicies::spAllow:
+        SubnetAnswers.add();
+        return true;
+    case SubnetPolicies::spBlock:
+        SubnetAnswers.add();
+        return false;
+    default:
+        break;
+    }
+
+    const ClientAddress client = identity(address);
+    if (meter && meter->overQuota(client)) {
+        QuotaAnswers.add();
+        return false;
+    }
+    return local().captiveVisit(client);
+}
+
+void Adapter::ClientDbs::account(const ClientAddress &address, const std::string &host,
+        uint64_t virgin, uint64_t adapted) const {
+    if (meter && address.known())
+        meter->count(identity(address), host, virgin, adapted);
+}
+
+void Adapter::ClientDbs::accountIdentity(const ClientAddress &client, const std::string &host,
+        uint64_t virgin, uint64_t adapted) const {
+    if (meter && client.known())
+        meter->count(client, host, virgin, adapted);
+}
+
+bool Adapter::ClientDbs::overQuota(const ClientAddress &address) const {
+    return meter && address.known() && meter->overQuota(identity(address));
+}
+
+Adapter::ClientAddress Adapter::ClientDbs::identity(const ClientAddress &address) const {
+    return neighbors ? neighbors->identity(address) : address;
+}
+
+void Adapter::ClientDbs::dumpHotClients(std::ostream &os) const {
+    const std::vector<HeavyHitters::Hitter> hitters = visitors.top();
+    for (std::vector<HeavyHitters::Hitter>::const_iterator i = hitters.begin(); i != hitters.end(); ++i)
+        os << "captive.hot_client: " << ClientAddress::FromKey(i->first).text() << ' ' << i->second << "\n";
+}
+
+Adapter::ClientDb &Adapter::ClientDbs::local() const {
+    if (void *db = pthread_getspecific(key))
+        return *static_cast<ClientDb*> (db);
+
+    ClientStore::ThreadStart();
+    ClientDb *db = new ClientDb(config, failOpen, visitors, sessions, cache);
+    pthread_setspecific(key, db);
+    pthread_mutex_lock(&mutex);
+    dbs.push_back(db);
+    pthread_mutex_unlock(&mutex);
+    return *db;
+}
+
+bool Adapter::ParseFailOpen(const std::string &value, const std::string &errorPrefix) {
+    if (value == "open")
+        return true;
+    if (value == "closed")
+        return false;
+    throw libecap::TextException(errorPrefix + "db_failure must be open or closed: " + value);
+}
+
+std::string Adapter::CaptivePage(bool allowed) {
+    const char *state = allowed ? "Success" : "Blocked";
+    std::string errmsg = "<HTML><HEAD><TITLE>";
+    errmsg += state;
+    errmsg += "</TITLE></HEAD><BODY>";
+    errmsg += state;
+    errmsg += "</BODY></HTML>";
+    return errmsg;
+}
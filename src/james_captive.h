@@ -0,0 +1,236 @@
+#ifndef JAMES_CAPTIVE_H
+#define JAMES_CAPTIVE_H
+
+#include "james_address.h"
+#include "james_neighbors.h"
+#include "james_sketch.h"
+#include "james_store.h"
+#include "james_volume.h"
+#include "james_wheel.h"
+#include <list>
+#include <map>
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <pthread.h>
+
+namespace Adapter {
+
+    // Recently used client records, shared by the ClientDbs of all host
+    // threads, so that captive visits need not read the store every time.
+    // Records of ordinary clients expire quickly, in case another proxy
+    // process changed them. Records of hot clients are pinned: they are
+    // never evicted while the clients stay hot, and they are written back
+    // to the store at most once a second, however often the clients come.
+
+    class StateCache {
+    public:
+        typedef std::vector<std::pair<ClientAddress, ClientRecord> > Records;
+
+        StateCache(size_t aCapacity, const HeavyHitters &aVisitors);
+        ~StateCache();
+
+        bool find(const ClientAddress &address, ClientRecord &record, time_t now);
+
+        // remembers a client record; returns whether the caller should
+        // write it to the store now; adds unwritten records of evicted
+        // clients to evicted, for the caller to write
+        bool remember(const ClientAddress &address, const ClientRecord &record,
+            bool hot, time_t now, Records &evicted);
+
+    private:
+        StateCache(const StateCache &); // not implemented
+        StateCache &operator=(const StateCache &); // not implemented
+
+        typedef std::list<ClientAddress> Ages; // least recently used first
+
+        class Entry {
+        public:
+            ClientRecord record;
+            time_t fetched; // when the record was last read or written
+            time_t written; // when the record was last written
+            bool pinned; // the client was hot at its last visit
+            bool dirty; // not written yet
+            Ages::iterator age;
+        };
+
+        void evict(Records &evicted); // makes room; needs mutex
+
+        const size_t capacity;
+        const HeavyHitters &visitors; // tells hot clients apart
+        std::map<ClientAddress, Entry> entries;
+        Ages ages;
+        pthread_mutex_t mutex; // protects entries and ages
+    };
+
+    // Captive portal sessions of the clients of all host threads. A visit
+    // starts or extends its client's session by dbsession seconds. A
+    // background thread advances a TimerWheel once a second and tells the
+    // store which sessions ended, in batches, so the request path neither
+    // compares times nor reads the store to learn that a session is over.
+    // Sessions live in memory only: after a restart, a client's next visit
+    // starts a new one.
+
+    class Sessions {
+    public:
+        explicit Sessions(const DbConfig &aConfig);
+        ~Sessions();
+
+        // records a visit; returns whether the client's session was live
+        bool visit(const ClientAddress &address, time_t now);
+
+    private:
+        Sessions(const Sessions &); // not implemented
+        Sessions &operator=(const Sessions &); // not implemented
+
+        static void *Expire(void *sessions);
+        void expire(); // the background thread loop
+        void end(ClientStore *&store, const ClientStore::ClientIps &clientIps);
+
+        const DbConfig config;
+        TimerWheel wheel; // keyed by ClientAddress::key()
+        pthread_mutex_t mutex; // protects wheel and stopping
+        pthread_cond_t wakeup;
+        pthread_t expirer;
+        bool stopping;
+    };
+
+    // Captive portal bookkeeping on top of a ClientStore.
+    //
+    // A supervisor thread owns (re)connecting, with exponential backoff,
+    // so the host thread never waits for a connection. A circuit breaker
+    // stops using the store after too many failed or slow queries; until
+    // the supervisor has a fresh connection, answers follow the failure
+    // policy: fail-open lets clients through, fail-closed blocks them.
+    // The breaker starts open, so the policy also answers until the first
+    // connection is made.
+    //
+    // Every visit is counted by client address, so that hot clients can
+    // be served from the StateCache and clients hammering the portal are
+    // reported.
+    //
+    // Apart from the supervisor, not thread-safe: use one instance per
+    // host thread (see ClientDbs).
+
+    class ClientDb {
+    public:
+        // for config.dbdriver; the first connection is made in background
+        ClientDb(const DbConfig &aConfig, bool aFailOpen, HeavyHitters &aVisitors,
+            Sessions &aSessions, StateCache *aCache);
+        ~ClientDb();
+
+        // records a captive portal visit; returns whether the client may pass
+        bool captiveVisit(const ClientAddress &address);
+
+        // records client activity; returns false if the store is unavailable
+        bool touch(const ClientAddress &address);
+
+        // gets the client's record; returns false if the client is unknown
+        // or the store is unavailable
+        bool lookup(const ClientAddress &address, ClientRecord &client);
+
+        const bool failOpen; // the answer when the store is unavailable
+
+    private:
+        ClientDb(const ClientDb &); // not implemented
+        ClientDb &operator=(const ClientDb &); // not implemented
+
+        typedef enum {
+            bkClosed, bkOpen, bkHalfOpen
+        } BreakerState;
+
+        ClientStore *acquire(); // the store if it may be used now, or nil
+        void record(bool ok, double started); // feeds the breaker
+        void trip(); // gives up on the current store
+
+        static void *Supervise(void *db);
+        void supervise(); // the supervisor thread loop
+
+        const DbConfig config;
+        HeavyHitters &visitors; // shared by all threads; by ClientAddress::key()
+        Sessions &sessions; // shared by all threads
+        StateCache *cache; // shared by all threads; nil if disabled
+
+        // host thread state
+        ClientStore *store; // in use, or nil
+        BreakerState breaker;
+        unsigned int calls; // in the current breaker window
+        unsigned int failures; // in the current breaker window
+        time_t reported; // when trips were last reported
+        unsigned int unreported; // trips since then
+
+        // shared with the supervisor, protected by mutex
+        pthread_mutex_t mutex;
+        pthread_cond_t wakeup;
+        pthread_t supervisor;
+        ClientStore *fresh; // connected by the supervisor, not yet in use
+        ClientStore *retired; // for the supervisor to delete
+        bool wanted; // the host thread is waiting for a fresh store
+        bool stopping;
+    };
+
+    // A ClientDb for each host thread that asks, created on first use, so
+    // that threads of a multi-threaded host never share a connection.
+
+    class ClientDbs {
+    public:
+        ClientDbs(const DbConfig &aConfig, bool aFailOpen,
+            const SubnetPolicies &aSubnets = SubnetPolicies());
+        ~ClientDbs();
+
+        ClientDb &local() const; // the calling thread's
+
+        // what the client is known by: its address, or its device if
+        // config.dbidentity is "mac" and the device is a neighbor
+        ClientAddress identity(const ClientAddress &address) const;
+
+        // decides by the client's subnet policy if it has one, and by
+        // ClientDb::captiveVisit() of the calling thread otherwise; captive
+        // clients over their volume quota are blocked
+        bool captiveVisit(const ClientAddress &address) const;
+
+        // adds the bytes of a transaction to the client's volumes, if
+        // config.dbaccount is set
+        void account(const ClientAddress &address, const std::string &host,
+            uint64_t virgin, uint64_t adapted) const;
+
+        // the same for a client already known by its identity(), for
+        // callers that count a transaction piece by piece
+        void accountIdentity(const ClientAddress &client, const std::string &host,
+            uint64_t virgin, uint64_t adapted) const;
+
+        // whether the client received more than config.dbquota megabytes
+        bool overQuota(const ClientAddress &address) const;
+
+        // writes the clients that visit the captive portal most often
+        void dumpHotClients(std::ostream &os) const;
+
+        const DbConfig config;
+        const bool failOpen; // the answer when the store is unavailable
+        const SubnetPolicies subnets; // consulted before any client state
+
+    private:
+        ClientDbs(const ClientDbs &); // not implemented
+        ClientDbs &operator=(const ClientDbs &); // not implemented
+
+        mutable HeavyHitters visitors; // captive portal visits by client address
+        mutable Sessions sessions; // captive portal sessions
+        StateCache *cache; // nil if disabled
+        NeighborTable *neighbors; // nil unless identifying devices
+        VolumeMeter *meter; // nil unless accounting
+        pthread_key_t key; // the thread's ClientDb
+        mutable pthread_mutex_t mutex; // protects dbs
+        mutable std::vector<ClientDb*> dbs; // all of them, for cleanup
+    };
+
+    // parses a db_failure option value: "open" or "closed"
+    bool ParseFailOpen(const std::string &value, const std::string &errorPrefix);
+
+    // the page served in place of captive responses; its length does not
+    // depend on whether the client is allowed
+    std::string CaptivePage(bool allowed);
+
+} // namespace Adapter
+
+#endif /* JAMES_CAPTIVE_H */
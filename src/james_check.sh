@@ -0,0 +1,33 @@
+#!/bin/sh
+# james_check.sh: runs short james_load cases against the adapters built in
+# the current directory and fails if any transaction of a case fails.
+# Run by "make check".
+
+status=0
+
+# runs james_load with the given arguments; the failures column must be 0
+run() {
+    echo "james_load $*"
+    if ! ./james_load -n 2000 -c 50 "$@" > james_check.out; then
+        cat james_check.out
+        status=1
+        return
+    fi
+    cat james_check.out
+    awk 'NR > 1 && $NF != 0 { bad = 1 } END { exit bad }' james_check.out || status=1
+}
+
+# a log-only chain modifies nothing, so the host forwards the virgin
+# request body itself
+run -r -d 0 .libs/ecap_adapter_pipeline.so stages=log
+
+echo 'document.title += "";' > james_check.js
+
+# one client, capped after its first page: the pages it gets later and the
+# 304s that revalidate them must keep the origin's ETag, whether the
+# header was held (4 KB) or streamed (128 KB)
+run -v -k 1 -b 4096,131072 .libs/ecap_adapter_modifying.so \
+    script=james_check.js inject_pages=1
+
+rm -f james_check.out james_check.js
+exit $status
@@ -0,0 +1,70 @@
+#include "james_ecap.h"
+#include "james_frequency.h"
+#include "james_stats.h"
+#include <cctype>
+#include <libecap/common/errors.h>
+
+static Adapter::Counter Admitted("frequency.admitted");
+static Adapter::Counter Capped("frequency.capped");
+static Adapter::Counter Forgotten("frequency.forgotten");
+
+Adapter::FrequencyCap::FrequencyCap(size_t aCapacity, unsigned int aPages, time_t aWindow) :
+capacity(aCapacity), pages(aPages), window(aWindow) {
+    Must(capacity > 0 && pages > 0);
+    pthread_mutex_init(&mutex, 0);
+}
+
+Adapter::FrequencyCap::~FrequencyCap() {
+    pthread_mutex_destroy(&mutex);
+}
+
+bool Adapter::FrequencyCap::admit(const ClientAddress &client, const std::string &host, time_t now) {
+    const uint64_t key = Key(client, host);
+    const uint32_t seconds = static_cast<uint32_t> (now);
+    bool admitted = true;
+
+    pthread_mutex_lock(&mutex);
+    const Index::iterator i = index.find(key);
+    if (i != index.end()) {
+        entries.splice(entries.begin(), entries, i->second); // most recent now
+        Entry &entry = *i->second;
+        if (window && seconds - entry.started >= static_cast<uint32_t> (window)) {
+            entry.started = seconds; // a new window
+            entry.pages = 1;
+        } else if (entry.pages < pages) {
+            ++entry.pages;
+        } else {
+            admitted = false;
+        }
+    } else {
+        if (entries.size() >= capacity) {
+            index.erase(entries.back().key);
+            entries.pop_back();
+            Forgotten.add();
+        }
+        const Entry entry = {key, seconds, 1};
+        entries.push_front(entry);
+        index[key] = entries.begin();
+    }
+    pthread_mutex_unlock(&mutex);
+
+    if (admitted)
+        Admitted.add();
+    else
+        Capped.add();
+    return admitted;
+}
+
+bool Adapter::FrequencyCap::same(size_t aCapacity, unsigned int aPages, time_t aWindow) const {
+    return capacity == aCapacity && pages == aPages && window == aWindow;
+}
+
+// FNV-1a of the client address bytes and the case-insensitive host
+uint64_t Adapter::FrequencyCap::Key(const ClientAddress &client, const std::string &host) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned int i = 0; i < sizeof(client.bytes); ++i)
+        hash = (hash ^ client.bytes[i]) * 1099511628211ULL;
+    for (std::string::const_iterator i = host.begin(); i != host.end(); ++i)
+        hash = (hash ^ static_cast<unsigned char> (tolower(*i))) * 1099511628211ULL;
+    return hash;
+}
@@ -0,0 +1,60 @@
+#ifndef JAMES_FREQUENCY_H
+#define JAMES_FREQUENCY_H
+
+#include "james_address.h"
+#include <list>
+#include <string>
+#include <tr1/unordered_map>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+namespace Adapter {
+
+    // How many pages each client has been given the script on, per host,
+    // so that it is injected only on the first pages of a window. Clients
+    // and hosts are known by a 64-bit hash of both, and the least recently
+    // seen ones are forgotten first when capacity entries are in use;
+    // a forgotten client gets the script again. All methods may be called
+    // from any host thread.
+
+    class FrequencyCap {
+    public:
+        // up to pages pages per window seconds; a zero window never ends
+        FrequencyCap(size_t aCapacity, unsigned int aPages, time_t aWindow);
+        ~FrequencyCap();
+
+        // counts a page of client on host; returns whether it is within
+        // the cap and should get the script
+        bool admit(const ClientAddress &client, const std::string &host, time_t now);
+
+        // whether a cap with these settings would behave like this one
+        bool same(size_t aCapacity, unsigned int aPages, time_t aWindow) const;
+
+    private:
+        FrequencyCap(const FrequencyCap &); // not implemented
+        FrequencyCap &operator=(const FrequencyCap &); // not implemented
+
+        class Entry {
+        public:
+            uint64_t key; // of client and host
+            uint32_t started; // when the window began, in seconds
+            uint32_t pages; // admitted in the window
+        };
+
+        typedef std::list<Entry> Entries; // most recently seen first
+        typedef std::tr1::unordered_map<uint64_t, Entries::iterator> Index;
+
+        static uint64_t Key(const ClientAddress &client, const std::string &host);
+
+        const size_t capacity;
+        const unsigned int pages;
+        const time_t window;
+        Entries entries;
+        Index index;
+        pthread_mutex_t mutex; // protects entries and index
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_FREQUENCY_H */
@@ -0,0 +1,142 @@
+#include "james_ecap.h"
+#include "james_garden.h"
+#include "james_captive.h"
+#include "james_http.h"
+#include <algorithm>
+#include <cctype>
+#include <libecap/common/header.h>
+#include <libecap/common/message.h>
+#include <libecap/common/name.h>
+
+namespace Adapter {
+
+    // splits the request target into a lowercase host without the port
+    // and a path without the query
+    static void Target(const libecap::Message &request, std::string &host, std::string &path) {
+        typedef const libecap::RequestLine *CLRLP;
+        const CLRLP requestLine = dynamic_cast<CLRLP> (&request.firstLine());
+        if (!requestLine)
+            return;
+
+        const std::string uri = requestLine->uri().toString();
+        static const std::string scheme = "http://";
+        if (uri.compare(0, scheme.size(), scheme) == 0) {
+            const std::string::size_type slash = uri.find('/', scheme.size());
+            host = uri.substr(scheme.size(), slash - scheme.size());
+            path = slash == std::string::npos ? "/" : uri.substr(slash);
+        } else {
+            static const libecap::Name headerHost("Host");
+            if (request.header().hasAny(headerHost))
+                host = request.header().value(headerHost).toString();
+            path = uri;
+        }
+
+        const std::string::size_type query = path.find('?');
+        if (query != std::string::npos)
+            path.erase(query);
+
+        const std::string::size_type colon = host.rfind(':');
+        if (colon != std::string::npos && host.find(']', colon) == std::string::npos)
+            host.erase(colon);
+        std::transform(host.begin(), host.end(), host.begin(), ::tolower);
+    }
+
+} // namespace Adapter
+
+libecap::shared_ptr<libecap::Message> Adapter::WalledGarden::Answer::response() const {
+    libecap::shared_ptr<libecap::Message> message = MakeResponse(status, reason.c_str(), body.size > 0);
+    libecap::Header &header = message->header();
+
+    static const libecap::Name cacheControl("Cache-Control");
+    static const libecap::Area noStore = libecap::Area::FromTempString("no-store");
+    header.add(cacheControl, noStore); // every check must reach us
+
+    static const libecap::Name headerContentType("Content-Type");
+    if (contentType.size)
+        header.add(headerContentType, contentType);
+    static const libecap::Name headerLocation("Location");
+    if (location.size)
+        header.add(headerLocation, location);
+    if (body.size)
+        SetContentLength(header, body.size);
+    return message;
+}
+
+Adapter::WalledGarden::WalledGarden() {
+    // Android and ChromeOS
+    check("connectivitycheck.gstatic.com", "/generate_204", 204, 0, "");
+    check("connectivitycheck.android.com", "/generate_204", 204, 0, "");
+    check("clients3.google.com", "/generate_204", 204, 0, "");
+    check("www.google.com", "/gen_204", 204, 0, "");
+    // Apple
+    check("captive.apple.com", "/hotspot-detect.html", 200, "text/html", CaptivePage(true));
+    check("www.apple.com", "/library/test/success.html", 200, "text/html", CaptivePage(true));
+    // Windows
+    check("www.msftconnecttest.com", "/connecttest.txt", 200, "text/plain", "Microsoft Connect Test");
+    check("www.msftncsi.com", "/ncsi.txt", 200, "text/plain", "Microsoft NCSI");
+    // Firefox
+    check("detectportal.firefox.com", "/success.txt", 200, "text/plain", "success\n");
+    // NetworkManager
+    check("nmcheck.gnome.org", "/check_network_status.txt", 200, "text/plain", "NetworkManager is online\n");
+    check("connectivity-check.ubuntu.com", "/", 204, 0, "");
+
+    // any answer but the expected one makes the device show the portal
+    blockedAnswer.status = 200;
+    blockedAnswer.reason = "OK";
+    blockedAnswer.contentType = libecap::Area::FromTempString("text/html");
+    blockedAnswer.body = libecap::Area::FromTempString(CaptivePage(false));
+}
+
+void Adapter::WalledGarden::open(const std::string &host) {
+    std::string name = host;
+    std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+    if (!name.empty())
+        openHosts.insert(name);
+}
+
+void Adapter::WalledGarden::portal(const std::string &url) {
+    blockedAnswer.status = 302;
+    blockedAnswer.reason = "Found";
+    blockedAnswer.location = libecap::Area::FromTempString(url);
+
+    const std::string::size_type start = url.find("://");
+    const std::string::size_type hostStart = start == std::string::npos ? 0 : start + 3;
+    std::string host = url.substr(hostStart, url.find_first_of(":/?", hostStart) - hostStart);
+    open(host);
+}
+
+const Adapter::WalledGarden::Answer *Adapter::WalledGarden::classify(const libecap::Message &request, bool &opened) const {
+    std::string host, path;
+    Target(request, host, path);
+    opened = isOpen(host);
+    if (opened)
+        return 0;
+
+    const std::map<std::string, Answer>::const_iterator i = checks.find(host + path);
+    return i == checks.end() ? 0 : &i->second;
+}
+
+void Adapter::WalledGarden::check(const char *host, const char *path, int status,
+        const char *contentType, const std::string &body) {
+    Answer &answer = checks[std::string(host) + path];
+    answer.status = status;
+    answer.reason = status == 204 ? "No Content" : "OK";
+    if (contentType)
+        answer.contentType = libecap::Area::FromTempString(contentType);
+    answer.body = libecap::Area::FromTempString(body);
+}
+
+// whether host or one of its parent domains is open
+bool Adapter::WalledGarden::isOpen(const std::string &host) const {
+    if (openHosts.empty() || host.empty())
+        return false;
+    std::string::size_type start = 0;
+    for (;;) {
+        if (openHosts.count(host.substr(start)))
+            return true;
+        const std::string::size_type dot = host.find('.', start);
+        if (dot == std::string::npos)
+            return false;
+        start = dot + 1;
+    }
+}
@@ -0,0 +1,66 @@
+#ifndef JAMES_GARDEN_H
+#define JAMES_GARDEN_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <libecap/common/area.h>
+#include <libecap/common/forward.h>
+#include <libecap/common/memory.h>
+
+namespace Adapter {
+
+    // Hosts and URLs a captive portal must handle without the usual
+    // machinery: the connectivity checks of Android, Apple, Windows,
+    // Firefox and NetworkManager, and the portal's own hosts. Devices
+    // send the checks on every network change and then periodically, so
+    // they are answered with synthetic responses built from parts
+    // prepared once, at configuration time. Immutable once configured;
+    // safe to share between threads.
+
+    class WalledGarden {
+    public:
+        // a synthetic response
+        class Answer {
+        public:
+            Answer() : status(0) {}
+
+            // a host response with our status, headers and, unless the
+            // body is empty, Content-Length; send body as its content
+            libecap::shared_ptr<libecap::Message> response() const;
+
+            int status;
+            std::string reason;
+            libecap::Area contentType; // none if empty
+            libecap::Area location; // none if empty
+            libecap::Area body; // shared by all transactions
+        };
+
+        WalledGarden(); // knows the built-in checks
+
+        // lets clients reach host and its subdomains without a visit
+        void open(const std::string &host);
+
+        // redirects blocked clients' checks to url and opens its host
+        void portal(const std::string &url);
+
+        // the check the request is, with its answer for allowed clients,
+        // or nil; sets opened if the request is for an open host
+        const Answer *classify(const libecap::Message &request, bool &opened) const;
+
+        // the answer to any check of a blocked client
+        const Answer &blocked() const { return blockedAnswer; }
+
+    private:
+        void check(const char *host, const char *path, int status,
+            const char *contentType, const std::string &body);
+        bool isOpen(const std::string &host) const;
+
+        std::map<std::string, Answer> checks; // by host and path
+        std::set<std::string> openHosts;
+        Answer blockedAnswer;
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_GARDEN_H */
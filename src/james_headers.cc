@@ -0,0 +1,96 @@
+#include "james_ecap.h"
+#include "james_headers.h"
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <libecap/common/errors.h>
+#include <libecap/common/header.h>
+
+void Adapter::HeaderRules::parse(const std::string &text, const std::string &errorPrefix) {
+    std::istringstream lines(text);
+    std::string line;
+    while (std::getline(lines, line)) {
+        const std::string::size_type comment = line.find('#');
+        if (comment != std::string::npos)
+            line.erase(comment);
+
+        std::istringstream words(line);
+        std::string action, name;
+        if (!(words >> action))
+            continue; // empty line
+        if (!(words >> name))
+            throw libecap::TextException(errorPrefix + "header rule without a name: " + line);
+
+        Rule rule;
+        rule.name = libecap::Name(name);
+        rule.conditional = false;
+
+        if (action == "remove" || action == "replace") {
+            std::string prefix;
+            if (words >> prefix) {
+                rule.conditional = true;
+                if (prefix != "*") // any value
+                    rule.prefix = prefix;
+            } else if (action == "replace") {
+                throw libecap::TextException(errorPrefix + "replace rule without a prefix: " + line);
+            }
+        }
+
+        std::string value;
+        std::getline(words >> std::ws, value);
+        while (!value.empty() && (value[value.size() - 1] == ' ' || value[value.size() - 1] == '\t' || value[value.size() - 1] == '\r'))
+            value.erase(value.size() - 1);
+
+        if (action == "remove") {
+            if (!value.empty())
+                throw libecap::TextException(errorPrefix + "remove rule with a value: " + line);
+            rule.action = raRemove;
+        } else if (action == "add" || action == "set" || action == "replace") {
+            if (value.empty())
+                throw libecap::TextException(errorPrefix + action + " rule without a value: " + line);
+            rule.action = action == "add" ? raAdd : raSet;
+            rule.value = libecap::Area::FromTempString(value); // copied once
+        } else {
+            throw libecap::TextException(errorPrefix + "unknown header rule action: " + action);
+        }
+
+        rules.push_back(rule);
+    }
+}
+
+void Adapter::HeaderRules::load(const std::string &fileName, const std::string &errorPrefix) {
+    std::ifstream is(fileName.c_str());
+    std::ostringstream text;
+    text << is.rdbuf();
+    if (!is)
+        throw libecap::TextException(errorPrefix + "cannot read header rules file: " + fileName);
+    parse(text.str(), errorPrefix);
+}
+
+void Adapter::HeaderRules::apply(libecap::Header &header) const {
+    for (std::vector<Rule>::const_iterator r = rules.begin(); r != rules.end(); ++r) {
+        if (r->conditional) {
+            if (!header.hasAny(r->name))
+                continue;
+            if (!r->prefix.empty()) {
+                const libecap::Header::Value current = header.value(r->name);
+                if (current.size < r->prefix.size() ||
+                        memcmp(current.start, r->prefix.data(), r->prefix.size()) != 0)
+                    continue;
+            }
+        }
+
+        switch (r->action) {
+        case raRemove:
+            header.removeAny(r->name);
+            break;
+        case raSet:
+            header.removeAny(r->name);
+            header.add(r->name, r->value);
+            break;
+        case raAdd:
+            header.add(r->name, r->value);
+            break;
+        }
+    }
+}
@@ -0,0 +1,57 @@
+#ifndef JAMES_HEADERS_H
+#define JAMES_HEADERS_H
+
+#include <string>
+#include <vector>
+#include <libecap/common/area.h>
+#include <libecap/common/name.h>
+
+namespace libecap {
+    class Header;
+}
+
+namespace Adapter {
+
+    // Header edits, compiled once from text like
+    //
+    //     remove NAME [PREFIX]       removes NAME if its value starts with PREFIX
+    //     add NAME VALUE             adds a NAME field
+    //     set NAME VALUE             replaces all NAME fields with one
+    //     replace NAME PREFIX VALUE  set, if the NAME value starts with PREFIX
+    //
+    // one rule per line; '#' starts a comment. Names and values are built
+    // when the rules are compiled, so applying them allocates nothing of
+    // ours. Immutable once compiled; safe to share between threads.
+
+    class HeaderRules {
+    public:
+        // compiles and appends rules; errors are thrown as
+        // libecap::TextException messages starting with errorPrefix
+        void parse(const std::string &text, const std::string &errorPrefix);
+        void load(const std::string &fileName, const std::string &errorPrefix);
+
+        void apply(libecap::Header &header) const; // all rules, in order
+
+        void clear() { rules.clear(); }
+        bool empty() const { return rules.empty(); }
+
+    private:
+        typedef enum {
+            raRemove, raAdd, raSet
+        } Action;
+
+        class Rule {
+        public:
+            Action action;
+            libecap::Name name;
+            std::string prefix; // the condition; empty matches any present value
+            bool conditional; // whether NAME must be present
+            libecap::Area value; // shared by all transactions
+        };
+
+        std::vector<Rule> rules;
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_HEADERS_H */
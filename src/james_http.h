@@ -0,0 +1,47 @@
+#ifndef JAMES_HTTP_H
+#define JAMES_HTTP_H
+
+#include <cstdio>
+#include <cstring>
+#include <libecap/common/header.h>
+#include <libecap/common/names.h>
+#include <libecap/common/body.h>
+#include <libecap/common/message.h>
+#include <libecap/host/host.h>
+
+namespace Adapter {
+
+    // replaces any Content-Length header with the given value
+    inline void SetContentLength(libecap::Header &header, libecap::size_type length) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%lu", static_cast<unsigned long> (length));
+        header.removeAny(libecap::headerContentLength);
+        header.add(libecap::headerContentLength, libecap::Area::FromTempBuffer(buf, strlen(buf)));
+    }
+
+    // whether the message body length is known in advance
+    inline bool KnownBodySize(const libecap::Message &message, libecap::size_type &size) {
+        const libecap::Body *body = message.body();
+        if (!body || !body->bodySize().known())
+            return false;
+        size = body->bodySize().value();
+        return true;
+    }
+
+    // creates a host response with the given status and an empty body,
+    // if any
+    inline libecap::shared_ptr<libecap::Message> MakeResponse(int status, const char *reason, bool withBody = true) {
+        libecap::shared_ptr<libecap::Message> response = libecap::MyHost().newResponse();
+        libecap::StatusLine &statusLine = dynamic_cast<libecap::StatusLine&> (response->firstLine());
+        statusLine.protocol(libecap::protocolHttp);
+        statusLine.version(libecap::Version(1, 1));
+        statusLine.statusCode(status);
+        statusLine.reasonPhrase(libecap::Area::FromTempBuffer(reason, strlen(reason)));
+        if (withBody)
+            response->addBody();
+        return response;
+    }
+
+} // namespace Adapter
+
+#endif /* JAMES_HTTP_H */
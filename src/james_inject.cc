@@ -0,0 +1,166 @@
+#include "james_ecap.h"
+#include "james_inject.h"
+#include "james_stats.h"
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <fstream>
+#include <vector>
+#include <libecap/common/errors.h>
+#include <libecap/common/name.h>
+#include <libecap/common/message.h>
+
+namespace Adapter {
+
+    static Counter RestoredValidators("inject.restored_validators");
+
+    static const char *const TagSuffix = "-j";
+
+    // the opaque part of an entity tag: what is between its quotes
+    static std::string Opaque(const std::string &tag) {
+        std::string::size_type start = tag.find('"');
+        const std::string::size_type end = tag.rfind('"');
+        if (start == std::string::npos || end <= start)
+            return tag; // not quoted; take it as it is
+        return tag.substr(start + 1, end - start - 1);
+    }
+
+    // what InjectedETag() appends to the opaque part of the origin's tag
+    static std::string Suffix(uint64_t version) {
+        char suffix[24];
+        snprintf(suffix, sizeof(suffix), "%s%016llx", TagSuffix, static_cast<unsigned long long> (version));
+        return suffix;
+    }
+
+    // Adds the origin's tag after each of ours in an If-None-Match list
+    // and drops the tags of other payload versions, which cannot match any
+    // more. Our tag stays so that the response can tell that the client
+    // holds an injected page; the origin never matches it. Returns false
+    // if no tag is left.
+    static bool RestoreETags(std::string &tags, uint64_t version) {
+        const std::string suffix = Suffix(version);
+
+        std::string restored;
+        std::string::size_type pos = 0;
+        while (pos < tags.size()) {
+            pos = tags.find_first_not_of(" \t,", pos);
+            if (pos == std::string::npos)
+                break;
+            if (tags[pos] == '*')
+                return true; // matches any version; the origin decides
+
+            // W/"opaque" or "opaque"; commas may appear inside the quotes
+            const std::string::size_type open = tags.find('"', pos);
+            const std::string::size_type close = open == std::string::npos ?
+                std::string::npos : tags.find('"', open + 1);
+            if (close == std::string::npos)
+                return true; // malformed; let the origin judge it
+            std::string tag = tags.substr(pos, close + 1 - pos);
+            pos = close + 1;
+
+            const std::string opaque = Opaque(tag);
+            const std::string::size_type mark = opaque.rfind(TagSuffix);
+            if (mark != std::string::npos && opaque.size() - mark == suffix.size()) {
+                if (opaque.compare(mark, suffix.size(), suffix) != 0)
+                    continue; // an older payload
+                tag.append(", \"").append(opaque, 0, mark).append("\"");
+                RestoredValidators.add();
+            }
+            restored.append(restored.empty() ? "" : ", ").append(tag);
+        }
+        tags.swap(restored);
+        return !tags.empty();
+    }
+
+} // namespace Adapter
+
+std::string Adapter::LoadScript(const std::string &value, const std::string &errorPrefix) {
+    if (value.empty()) {
+        throw libecap::TextException(errorPrefix +
+                "empty script value is not allowed");
+    }
+
+    std::string markup;
+    if (value.find("http", value.size()) != std::string::npos) {
+        markup.append("<script src=\"");
+        markup.append(value);
+        markup.append("\"></script>");
+    } else {
+        std::ifstream is(value.c_str(), std::ifstream::binary);
+
+        is.seekg(0, is.end);
+        const std::streamoff length = is.tellg();
+        is.seekg(0, is.beg);
+        std::vector<char> buffer(length > 0 ? length : 0);
+        if (length > 0)
+            is.read(&buffer[0], length);
+        if (is && length >= 0) {
+            markup.append("<script>");
+            markup.append(buffer.begin(), buffer.end());
+            markup.append("</script>");
+        } else {
+            throw libecap::TextException(errorPrefix +
+                    "Can't read js fragment file: " + value);
+        }
+    }
+    return markup;
+}
+
+bool Adapter::Injectable(const libecap::Message &response) {
+    static const libecap::Name contentType("Content-Type");
+    static const libecap::Name contentEncoding("Content-Encoding");
+    const libecap::Header &header = response.header();
+    if (header.hasAny(contentEncoding))
+        return false; // we cannot find the closing body tag in gzip
+    if (!header.hasAny(contentType))
+        return false;
+    std::string type = header.value(contentType).toString();
+    std::transform(type.begin(), type.end(), type.begin(), ::tolower);
+    return type.compare(0, 9, "text/html") == 0;
+}
+
+bool Adapter::InjectScript(std::string &chunk, const std::string &markup) {
+    // this is oversimplified; production code should worry about arbitrary
+    // chunk boundaries, content encodings, service reconfigurations, etc.
+
+    static const char *victims[] = {"</body>", "</BODY>", "</Body>"};
+
+    for (unsigned int i = 0; i < sizeof(victims) / sizeof(victims[0]); ++i) {
+        const std::string::size_type pos = chunk.find(victims[i]);
+        if (pos != std::string::npos) {
+            chunk.insert(pos, markup);
+            return true;
+        }
+    }
+    return false;
+}
+
+std::string Adapter::InjectedETag(const std::string &originTag, uint64_t version) {
+    return "W/\"" + Opaque(originTag) + Suffix(version) + "\"";
+}
+
+bool Adapter::RevalidatesInjected(const libecap::Header &request, uint64_t version) {
+    static const libecap::Name ifNoneMatch("If-None-Match");
+    if (!request.hasAny(ifNoneMatch))
+        return false;
+    // RestoreETags() kept our tag in front of the origin's
+    const std::string tags = request.value(ifNoneMatch).toString();
+    return tags.find(Suffix(version) + "\"") != std::string::npos;
+}
+
+void Adapter::RewriteValidators(libecap::Header &header, bool isRequest, uint64_t version) {
+    static const libecap::Name etag("ETag");
+    static const libecap::Name ifNoneMatch("If-None-Match");
+    const libecap::Name &name = isRequest ? ifNoneMatch : etag;
+    if (!header.hasAny(name))
+        return;
+
+    std::string value = header.value(name).toString();
+    header.removeAny(name);
+    if (isRequest) {
+        if (RestoreETags(value, version))
+            header.add(name, libecap::Area::FromTempString(value));
+    } else {
+        header.add(name, libecap::Area::FromTempString(InjectedETag(value, version)));
+    }
+}
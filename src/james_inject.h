@@ -0,0 +1,47 @@
+#ifndef JAMES_INJECT_H
+#define JAMES_INJECT_H
+
+#include <string>
+#include <stdint.h>
+#include <libecap/common/header.h>
+#include <libecap/common/forward.h>
+
+namespace Adapter {
+
+    // Builds the markup injected into pages from the "script" option value,
+    // which names a JavaScript file to inline. Configuration errors are
+    // thrown as libecap::TextException messages starting with errorPrefix.
+    std::string LoadScript(const std::string &value, const std::string &errorPrefix);
+
+    // Whether the script may go into the page a response carries: HTML
+    // without a content coding.
+    bool Injectable(const libecap::Message &response);
+
+    // Inserts markup before the first closing body tag in chunk.
+    // Returns whether the tag was found.
+    bool InjectScript(std::string &chunk, const std::string &markup);
+
+    // Validators of pages we inject into. Their bytes differ from the
+    // origin's, so the adapted response carries a weak ETag made of the
+    // origin's tag and the payload version, e.g. W/"abc-j0123456789abcdef"
+    // for "abc". Conditional requests get the origin's tag back, so that
+    // the origin answers 304 just as it would without us, and pages
+    // injected with an older payload no longer match. Pages we pass
+    // through unadapted keep the origin's tag, and so do the 304s that
+    // revalidate them.
+
+    // the ETag of a page with originTag injected with payload version
+    std::string InjectedETag(const std::string &originTag, uint64_t version);
+
+    // edits the validators of a virgin message: the ETag of a response
+    // whose body we inject into, or our tags in the If-None-Match of a
+    // request
+    void RewriteValidators(libecap::Header &header, bool isRequest, uint64_t version);
+
+    // whether a bodiless response (304) to this request revalidates a page
+    // we injected into, i.e. whether the client sent our tag
+    bool RevalidatesInjected(const libecap::Header &request, uint64_t version);
+
+} // namespace Adapter
+
+#endif /* JAMES_INJECT_H */
@@ -0,0 +1,849 @@
+// james_load: drives many interleaved transactions through an adapter module
+// using a mock host, and reports throughput, latency percentiles and memory
+// use as functions of concurrency, body size and database latency.
+//
+// Usage: james_load [options] module.so [name=value ...]
+//   -c LIST   concurrent transactions, e.g. 1,10,100,1000 (default 100)
+//   -b LIST   response body sizes in bytes (default 16384)
+//   -d LIST   memory store latencies in microseconds (default 0)
+//   -f N      percentage of failing database queries (default 0)
+//   -n N      transactions per measurement (default 10000)
+//   -k N      distinct client addresses (default 1000)
+//   -r        send requests (reqmod) instead of responses (respmod)
+//   -t N      host threads sharing the concurrent transactions (default 1);
+//             build with -fsanitize=thread to check adapters for data races
+//   -v        revalidate: responses carry an ETag and every other one is a
+//             304 to a request with that ETag in If-None-Match, as from a
+//             client whose copy was not adapted; a transaction fails if the
+//             client gets a different ETag without a different body, or
+//             the other way round
+//
+// Trailing name=value pairs are passed to the adapter as its configuration.
+// With -d, the adapter also gets config=FILE pointing to a generated
+// james.conf that selects the in-memory client store.
+//
+// Every measurement runs in a forked child so that the reported maximum
+// resident set size belongs to that measurement alone.
+
+#include "james_ecap.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <dlfcn.h>
+#include <pthread.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <libecap/common/area.h>
+#include <libecap/common/body.h>
+#include <libecap/common/errors.h>
+#include <libecap/common/header.h>
+#include <libecap/common/message.h>
+#include <libecap/common/names.h>
+#include <libecap/common/named_values.h>
+#include <libecap/common/options.h>
+#include <libecap/common/registry.h>
+#include <libecap/adapter/service.h>
+#include <libecap/adapter/xaction.h>
+#include <libecap/host/host.h>
+#include <libecap/host/xaction.h>
+
+namespace Load {
+
+    using libecap::size_type;
+
+    typedef std::vector<std::pair<libecap::Name, std::string> > Fields;
+
+    class Header : public libecap::Header {
+    public:
+        virtual bool hasAny(const libecap::Name &name) const {
+            return find(name) != fields.end();
+        }
+
+        virtual Value value(const libecap::Name &name) const {
+            Fields::const_iterator i = find(name);
+            return i == fields.end() ? Value() : libecap::Area::FromTempString(i->second);
+        }
+
+        virtual void add(const libecap::Name &name, const Value &value) {
+            fields.push_back(std::make_pair(name, value.toString()));
+        }
+
+        virtual void removeAny(const libecap::Name &name) {
+            Fields::iterator i;
+            while ((i = find(name)) != fields.end())
+                fields.erase(i);
+        }
+
+        virtual void visitEach(libecap::NamedValueVisitor &visitor) const {
+            for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i)
+                visitor.visit(i->first, libecap::Area::FromTempString(i->second));
+        }
+
+        virtual libecap::Area image() const {
+            std::string image;
+            for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i)
+                image += i->first.image() + ": " + i->second + "\r\n";
+            return libecap::Area::FromTempString(image);
+        }
+
+        virtual void parse(const libecap::Area &) {
+            Must(!"header parsing is not supported by the mock host");
+        }
+
+    private:
+        Fields::const_iterator find(const libecap::Name &name) const {
+            for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i)
+                if (i->first == name)
+                    return i;
+            return fields.end();
+        }
+
+        Fields::iterator find(const libecap::Name &name) {
+            for (Fields::iterator i = fields.begin(); i != fields.end(); ++i)
+                if (i->first == name)
+                    return i;
+            return fields.end();
+        }
+
+        Fields fields;
+    };
+
+    // request and status line in one class; a message uses one role only
+
+    class FirstLine : public libecap::RequestLine, public libecap::StatusLine {
+    public:
+        FirstLine() : theStatusCode(200), theMethod("GET") {
+        }
+
+        virtual libecap::Version version() const { return theVersion; }
+        virtual void version(const libecap::Version &aVersion) { theVersion = aVersion; }
+        virtual libecap::Name protocol() const { return theProtocol; }
+        virtual void protocol(const libecap::Name &aProtocol) { theProtocol = aProtocol; }
+
+        virtual void uri(const libecap::Area &aUri) { theUri = aUri.toString(); }
+        virtual libecap::Area uri() const { return libecap::Area::FromTempString(theUri); }
+        virtual void method(const libecap::Name &aMethod) { theMethod = aMethod; }
+        virtual libecap::Name method() const { return theMethod; }
+
+        virtual void statusCode(int code) { theStatusCode = code; }
+        virtual int statusCode() const { return theStatusCode; }
+        virtual void reasonPhrase(const libecap::Area &phrase) { theReason = phrase.toString(); }
+        virtual libecap::Area reasonPhrase() const { return libecap::Area::FromTempString(theReason); }
+
+    private:
+        libecap::Version theVersion;
+        libecap::Name theProtocol;
+        int theStatusCode;
+        std::string theReason;
+        std::string theUri;
+        libecap::Name theMethod;
+    };
+
+    class Body : public libecap::Body {
+    public:
+        Body() : known(false), size(0) {
+        }
+
+        virtual libecap::BodySize bodySize() const {
+            return known ? libecap::BodySize(size) : libecap::BodySize();
+        }
+
+        bool known;
+        size_type size;
+    };
+
+    class Message : public libecap::Message {
+    public:
+        explicit Message(bool request) : isRequest(request), hasBody(false) {
+        }
+
+        virtual libecap::shared_ptr<libecap::Message> clone() const {
+            return libecap::shared_ptr<libecap::Message>(new Message(*this));
+        }
+
+        virtual libecap::FirstLine &firstLine() {
+            if (isRequest)
+                return static_cast<libecap::RequestLine&> (line);
+            return static_cast<libecap::StatusLine&> (line);
+        }
+
+        virtual const libecap::FirstLine &firstLine() const {
+            if (isRequest)
+                return static_cast<const libecap::RequestLine&> (line);
+            return static_cast<const libecap::StatusLine&> (line);
+        }
+
+        virtual libecap::Header &header() { return theHeader; }
+        virtual const libecap::Header &header() const { return theHeader; }
+
+        virtual void addBody() { hasBody = true; }
+        virtual libecap::Body *body() { return hasBody ? &theBody : 0; }
+        virtual const libecap::Body *body() const { return hasBody ? &theBody : 0; }
+
+        virtual void addTrailer() {}
+        virtual libecap::Header *trailer() { return 0; }
+        virtual const libecap::Header *trailer() const { return 0; }
+
+        bool isRequest;
+        FirstLine line;
+        Header theHeader;
+        bool hasBody;
+        Body theBody;
+    };
+
+    class Host : public libecap::host::Host {
+    public:
+        virtual std::string uri() const { return "ecap://murka.cz/james/load"; }
+        virtual void describe(std::ostream &os) const { os << "james_load mock host"; }
+
+        virtual void noteService(const libecap::weak_ptr<libecap::adapter::Service> &s) {
+            services.push_back(s.lock());
+        }
+
+        virtual std::ostream *openDebug(libecap::LogVerbosity) { return 0; }
+        virtual void closeDebug(std::ostream *) {}
+
+        virtual libecap::shared_ptr<libecap::Message> newRequest() const {
+            return libecap::shared_ptr<libecap::Message>(new Message(true));
+        }
+
+        virtual libecap::shared_ptr<libecap::Message> newResponse() const {
+            return libecap::shared_ptr<libecap::Message>(new Message(false));
+        }
+
+        std::vector<libecap::shared_ptr<libecap::adapter::Service> > services;
+    };
+
+    class Options : public libecap::Options {
+    public:
+        virtual const libecap::Area option(const libecap::Name &name) const {
+            for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i)
+                if (i->first == name)
+                    return libecap::Area::FromTempString(i->second);
+            return libecap::Area();
+        }
+
+        virtual void visitEachOption(libecap::NamedValueVisitor &visitor) const {
+            for (Fields::const_iterator i = fields.begin(); i != fields.end(); ++i)
+                visitor.visit(i->first, libecap::Area::FromTempString(i->second));
+        }
+
+        Fields fields;
+    };
+
+    // what one measurement is made of
+    class Workload {
+    public:
+        Workload() : concurrency(100), bodySize(16384), dbLatency(0),
+        dbFailRate(0), xactions(10000), clients(1000), threads(1), requests(false),
+        revalidations(false) {
+        }
+
+        size_type concurrency;
+        size_type bodySize;
+        unsigned int dbLatency;
+        unsigned int dbFailRate;
+        size_type xactions;
+        size_type clients;
+        size_type threads;
+        bool requests;
+        bool revalidations;
+    };
+
+    static double Now() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+    }
+
+    // A host transaction. Like a real host, it never calls the adapter
+    // back from inside an adapter call; requests are noted and acted upon
+    // during the next step().
+
+    class Xaction : public libecap::host::Xaction {
+    public:
+        Xaction(libecap::adapter::Service &service, const Workload &w,
+                const std::string &aClientIp, const std::string &body, bool conditional);
+        virtual ~Xaction();
+
+        // libecap::Options
+        virtual const libecap::Area option(const libecap::Name &name) const;
+        virtual void visitEachOption(libecap::NamedValueVisitor &visitor) const;
+
+        // libecap::host::Xaction
+        virtual libecap::Message &virgin() { return *theVirgin; }
+        virtual const libecap::Message &cause() { return *theCause; }
+        virtual libecap::Message &adapted() { Must(theAdapted != 0); return *theAdapted; }
+        virtual void useVirgin();
+        virtual void useAdapted(const libecap::shared_ptr<libecap::Message> &msg);
+        virtual void blockVirgin() { outcome = oBlocked; }
+        virtual void adaptationDelayed(const libecap::Delay &) {}
+        virtual void adaptationAborted() { if (!finished) failed = true; }
+        virtual void resume() { resumed = true; }
+        virtual void vbDiscard() { vbDiscarded = vbStopped = true; }
+        virtual void vbMake() { vbMade = true; }
+        virtual void vbStopMaking() { vbStopped = true; }
+        virtual void vbMakeMore() {}
+        virtual void vbPause() {}
+        virtual void vbResume() {}
+        virtual libecap::Area vbContent(size_type offset, size_type size);
+        virtual void vbContentShift(size_type size);
+        virtual void noteAbContentDone(bool) { abDone = true; }
+        virtual void noteAbContentAvailable() {}
+
+        bool step(); // moves the transaction forward; returns false when done
+
+        const double started;
+        bool failed;
+        size_type delivered; // body bytes that reached the "client"
+
+    private:
+        bool advance(); // step() until the transaction is done
+        void checkValidators();
+        void call(void (libecap::adapter::Xaction::*method)());
+        void deliverVb();
+        void consumeAb();
+
+        typedef enum {
+            oPending, oVirgin, oAdapted, oBlocked
+        } Outcome;
+
+        libecap::adapter::Xaction *adapter;
+        libecap::shared_ptr<libecap::Message> theVirgin;
+        libecap::shared_ptr<libecap::Message> theCause;
+        libecap::shared_ptr<libecap::Message> theAdapted;
+        const std::string &body; // the whole virgin body
+        const std::string clientIp;
+        const bool checksValidators; // -v
+
+        Outcome outcome;
+        bool launched;
+        bool abMade;
+        bool abDone;
+        bool vbMade;
+        bool vbStopped;
+        bool vbDiscarded; // the virgin body is gone; it cannot be forwarded
+        bool vbDoneSent;
+        bool finished;
+        bool resumed; // the adapter asked to be resumed
+        size_type vbSent; // body bytes given to the adapter so far
+        size_type vbOffset; // body bytes shifted by the adapter
+    };
+
+    static const char *const OriginTag = "\"v1\""; // -v
+
+    static const size_type ChunkSize = 16 * 1024; // a typical network read
+    static const size_type HostBuffer = 64 * 1024; // what the host buffers for vb
+
+} // namespace Load
+
+Load::Xaction::Xaction(libecap::adapter::Service &service, const Workload &w,
+        const std::string &aClientIp, const std::string &aBody, bool conditional) :
+started(Now()), failed(false), delivered(0), adapter(0), body(aBody),
+clientIp(aClientIp), checksValidators(w.revalidations && !w.requests),
+outcome(oPending), launched(false), abMade(false),
+abDone(false), vbMade(false), vbStopped(false), vbDiscarded(false), vbDoneSent(false),
+finished(false), resumed(false), vbSent(0), vbOffset(0) {
+    Message *request = new Message(true);
+    request->line.uri(libecap::Area::FromTempString("http://www.example.com/index.html"));
+    request->line.protocol(libecap::protocolHttp);
+    request->theHeader.add(libecap::Name("Host"), libecap::Area::FromTempString("www.example.com"));
+    request->theHeader.add(libecap::Name("Accept-Encoding"), libecap::Area::FromTempString("gzip"));
+    if (conditional)
+        request->theHeader.add(libecap::Name("If-None-Match"), libecap::Area::FromTempString(OriginTag));
+    theCause.reset(request);
+
+    if (w.requests) {
+        Message *post = new Message(*request);
+        post->line.method(libecap::methodPost);
+        post->addBody();
+        theVirgin.reset(post);
+    } else if (conditional) {
+        Message *response = new Message(false);
+        response->line.protocol(libecap::protocolHttp);
+        response->line.statusCode(304);
+        response->theHeader.add(libecap::Name("ETag"), libecap::Area::FromTempString(OriginTag));
+        theVirgin.reset(response);
+    } else {
+        Message *response = new Message(false);
+        response->line.protocol(libecap::protocolHttp);
+        response->line.statusCode(200);
+        response->theHeader.add(libecap::Name("Content-Type"), libecap::Area::FromTempString("text/html"));
+        if (w.revalidations)
+            response->theHeader.add(libecap::Name("ETag"), libecap::Area::FromTempString(OriginTag));
+        response->addBody();
+        theVirgin.reset(response);
+    }
+
+    if (theVirgin->body()) {
+        Body &virginBody = static_cast<Message&> (*theVirgin).theBody;
+        virginBody.known = true;
+        virginBody.size = body.size();
+        std::ostringstream length;
+        length << body.size();
+        theVirgin->header().add(libecap::headerContentLength, libecap::Area::FromTempString(length.str()));
+    }
+
+    try {
+        adapter = service.makeXaction(this);
+    } catch (const std::exception &e) {
+        failed = true;
+    }
+}
+
+Load::Xaction::~Xaction() {
+    finished = true;
+    if (adapter) {
+        try {
+            if (adapter->callable())
+                adapter->stop();
+        } catch (const std::exception &) {
+        }
+        delete adapter;
+    }
+}
+
+const libecap::Area Load::Xaction::option(const libecap::Name &name) const {
+    if (name == libecap::metaClientIp) {
+        // hosts give NUL-terminated addresses; some adapters rely on that
+        return libecap::Area(clientIp.c_str(), clientIp.size(), libecap::Area::Details());
+    }
+    return libecap::Area();
+}
+
+void Load::Xaction::visitEachOption(libecap::NamedValueVisitor &visitor) const {
+    visitor.visit(libecap::metaClientIp, option(libecap::metaClientIp));
+}
+
+// like Squid, we cannot forward a body we were told to drop
+void Load::Xaction::useVirgin() {
+    Must(!vbDiscarded || !theVirgin->body());
+    outcome = oVirgin;
+}
+
+void Load::Xaction::useAdapted(const libecap::shared_ptr<libecap::Message> &msg) {
+    theAdapted = msg;
+    outcome = oAdapted;
+}
+
+libecap::Area Load::Xaction::vbContent(size_type offset, size_type size) {
+    const size_type available = vbSent - vbOffset;
+    if (offset >= available)
+        return libecap::Area();
+    size = std::min(size, available - offset);
+    return libecap::Area::FromTempBuffer(body.data() + vbOffset + offset, size);
+}
+
+void Load::Xaction::vbContentShift(size_type size) {
+    Must(vbOffset + size <= vbSent);
+    vbOffset += size;
+}
+
+// calls an adapter transaction method, turning exceptions into failures
+void Load::Xaction::call(void (libecap::adapter::Xaction::*method)()) {
+    try {
+        (adapter->*method)();
+    } catch (const std::exception &e) {
+        failed = true;
+    }
+}
+
+bool Load::Xaction::step() {
+    if (advance())
+        return true;
+    checkValidators();
+    return false;
+}
+
+// with -v, the client must get the origin's ETag exactly when it gets the
+// origin's body; an adapted body is never as long as the virgin one
+void Load::Xaction::checkValidators() {
+    if (!checksValidators || failed)
+        return;
+    const libecap::Message *forwarded = 0;
+    if (outcome == oVirgin)
+        forwarded = theVirgin.get();
+    else if (outcome == oAdapted)
+        forwarded = theAdapted.get();
+    if (!forwarded)
+        return; // blocked
+
+    static const libecap::Name etag("ETag");
+    const libecap::Header &header = forwarded->header();
+    const bool retagged = !header.hasAny(etag) || header.value(etag).toString() != OriginTag;
+    const bool changed = forwarded->body() && delivered != body.size();
+    if (retagged != changed)
+        failed = true;
+}
+
+bool Load::Xaction::advance() {
+    if (failed || !adapter)
+        return false;
+
+    if (!launched) {
+        launched = true;
+        call(&libecap::adapter::Xaction::start);
+        return !failed;
+    }
+
+    if (resumed) {
+        resumed = false;
+        call(&libecap::adapter::Xaction::resume);
+        if (failed)
+            return false;
+    }
+
+    switch (outcome) {
+    case oPending:
+        deliverVb(); // the adapter may need the body to decide
+        return !failed;
+
+    case oVirgin:
+        // the host forwards the virgin body itself
+        delivered = theVirgin->body() ? body.size() : 0;
+        return false;
+
+    case oBlocked:
+        return false;
+
+    case oAdapted:
+        if (!theAdapted->body())
+            return false;
+        if (!abMade) {
+            abMade = true;
+            call(&libecap::adapter::Xaction::abMake);
+        }
+        deliverVb();
+        consumeAb();
+        return !failed && !(abDone && finished);
+    }
+    return false;
+}
+
+// gives the adapter the next piece of the virgin body, as far as the
+// host buffer allows
+void Load::Xaction::deliverVb() {
+    if (!vbMade || vbStopped || failed)
+        return;
+
+    if (vbSent < body.size()) {
+        if (vbSent - vbOffset >= HostBuffer)
+            return; // the adapter is not taking vb; the origin must wait
+        vbSent += std::min(ChunkSize, body.size() - vbSent);
+        call(&libecap::adapter::Xaction::noteVbContentAvailable);
+    } else if (!vbDoneSent) {
+        vbDoneSent = true;
+        try {
+            adapter->noteVbContentDone(true);
+        } catch (const std::exception &e) {
+            failed = true;
+        }
+    }
+}
+
+// reads one chunk of adapted body, as a client connection would
+void Load::Xaction::consumeAb() {
+    if (failed)
+        return;
+    try {
+        const libecap::Area ab = adapter->abContent(0, ChunkSize);
+        if (ab.size) {
+            adapter->abContentShift(ab.size);
+            delivered += ab.size;
+        } else if (abDone) {
+            finished = true;
+        }
+    } catch (const std::exception &e) {
+        failed = true;
+    }
+}
+
+namespace Load {
+
+    // runs a share of the workload's transactions on its own thread,
+    // the way a multi-threaded host would
+    class Worker {
+    public:
+        Worker(libecap::adapter::Service &aService, const Workload &aWorkload,
+                const std::vector<std::string> &someClientIps, const std::string &aBody) :
+        service(aService), workload(aWorkload), clientIps(someClientIps),
+        body(aBody), concurrency(0), xactions(0), failures(0), bytes(0) {
+        }
+
+        static void *Run(void *worker);
+        void run();
+
+        libecap::adapter::Service &service;
+        const Workload &workload;
+        const std::vector<std::string> &clientIps;
+        const std::string &body;
+        size_type concurrency; // this worker's share
+        size_type xactions; // this worker's share
+        pthread_t thread;
+
+        // results
+        std::vector<double> latencies;
+        size_type failures;
+        double bytes;
+    };
+
+} // namespace Load
+
+void *Load::Worker::Run(void *worker) {
+    static_cast<Worker*> (worker)->run();
+    return 0;
+}
+
+void Load::Worker::run() {
+    std::deque<Load::Xaction*> active;
+    const bool async = service.makesAsyncXactions();
+    latencies.reserve(xactions);
+    size_type created = 0;
+
+    while (created < xactions || !active.empty()) {
+        while (active.size() < concurrency && created < xactions) {
+            // with -v, every other response revalidates the page
+            const bool conditional = workload.revalidations && created % 2;
+            active.push_back(new Load::Xaction(service, workload,
+                    clientIps[created % clientIps.size()], body, conditional));
+            ++created;
+        }
+
+        // one step for each transaction, round-robin
+        const size_type count = active.size();
+        for (size_type i = 0; i < count; ++i) {
+            Load::Xaction *x = active.front();
+            active.pop_front();
+            if (x->step()) {
+                active.push_back(x);
+                continue;
+            }
+            if (x->failed)
+                ++failures;
+            else
+                latencies.push_back(Now() - x->started);
+            bytes += x->delivered;
+            delete x;
+        }
+
+        // between rounds, as a host event loop would, so that asynchronous
+        // adapters can tell their transactions to resume
+        if (async)
+            service.resume();
+    }
+}
+
+// runs one measurement and prints its results
+static void Measure(libecap::adapter::Service &service, const Load::Workload &w) {
+    using namespace Load;
+
+    std::string body(w.bodySize, 'x');
+    static const std::string tail = "</body></html>";
+    if (body.size() >= tail.size())
+        body.replace(body.size() - tail.size(), tail.size(), tail);
+
+    std::vector<std::string> clientIps;
+    for (size_type i = 0; i < w.clients; ++i) {
+        std::ostringstream ip;
+        ip << "10." << (i >> 16 & 255) << '.' << (i >> 8 & 255) << '.' << (i & 255);
+        clientIps.push_back(ip.str());
+    }
+
+    std::vector<Worker*> workers;
+    for (size_type i = 0; i < w.threads; ++i) {
+        Worker *worker = new Worker(service, w, clientIps, body);
+        worker->concurrency = w.concurrency / w.threads + (i < w.concurrency % w.threads);
+        worker->xactions = w.xactions / w.threads + (i < w.xactions % w.threads);
+        workers.push_back(worker);
+    }
+
+    const double start = Now();
+    if (w.threads == 1) {
+        workers.front()->run(); // keep single-threaded runs free of thread overheads
+    } else {
+        for (size_type i = 0; i < workers.size(); ++i) {
+            if (pthread_create(&workers[i]->thread, 0, &Worker::Run, workers[i])) {
+                perror("pthread_create");
+                exit(1);
+            }
+        }
+        for (size_type i = 0; i < workers.size(); ++i)
+            pthread_join(workers[i]->thread, 0);
+    }
+    const double elapsed = Now() - start;
+
+    std::vector<double> latencies;
+    latencies.reserve(w.xactions);
+    size_type failures = 0;
+    double bytes = 0;
+    for (size_type i = 0; i < workers.size(); ++i) {
+        latencies.insert(latencies.end(), workers[i]->latencies.begin(), workers[i]->latencies.end());
+        failures += workers[i]->failures;
+        bytes += workers[i]->bytes;
+        delete workers[i];
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    const size_type n = latencies.size();
+#define PERCENTILE(p) (n ? latencies[std::min(n - 1, static_cast<size_type> (n * (p)))] * 1000 : 0)
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+
+    printf("%7lu %11lu %10lu %10u %8lu %9.1f %9.2f %8.3f %8.3f %8.3f %10ld %8lu\n",
+            static_cast<unsigned long> (w.threads),
+            static_cast<unsigned long> (w.concurrency),
+            static_cast<unsigned long> (w.bodySize), w.dbLatency,
+            static_cast<unsigned long> (w.xactions),
+            w.xactions / elapsed, bytes / elapsed / (1024 * 1024),
+            PERCENTILE(0.5), PERCENTILE(0.99), PERCENTILE(0.999),
+            usage.ru_maxrss, static_cast<unsigned long> (failures));
+#undef PERCENTILE
+    fflush(stdout);
+}
+
+static std::vector<unsigned long> ParseList(const char *value) {
+    std::vector<unsigned long> list;
+    std::istringstream is(value);
+    std::string item;
+    while (std::getline(is, item, ','))
+        list.push_back(strtoul(item.c_str(), 0, 10));
+    return list;
+}
+
+static void Usage(const char *program) {
+    std::cerr << "usage: " << program << " [-c LIST] [-b LIST] [-d LIST] [-f N] "
+            "[-n N] [-k N] [-r] [-t N] [-v] module.so [name=value ...]" << std::endl;
+    exit(2);
+}
+
+// loads the module and runs one measurement; called in a child process
+static int RunChild(const char *module, Load::Options &options, const Load::Workload &w) {
+    libecap::shared_ptr<Load::Host> host(new Load::Host);
+    libecap::RegisterHost(host);
+
+    if (!dlopen(module, RTLD_NOW | RTLD_GLOBAL)) {
+        std::cerr << "cannot load " << module << ": " << dlerror() << std::endl;
+        return 1;
+    }
+    if (host->services.empty()) {
+        std::cerr << module << " registered no eCAP services" << std::endl;
+        return 1;
+    }
+
+    try {
+        libecap::adapter::Service &service = *host->services.front();
+        service.configure(options);
+        service.start();
+        Measure(service, w);
+        service.retire();
+    } catch (const std::exception &e) {
+        std::cerr << "adapter error: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    Load::Workload base;
+    std::vector<unsigned long> concurrencies(1, base.concurrency);
+    std::vector<unsigned long> bodySizes(1, base.bodySize);
+    std::vector<unsigned long> dbLatencies;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "c:b:d:f:n:k:rt:v")) != -1) {
+        switch (opt) {
+        case 'c': concurrencies = ParseList(optarg); break;
+        case 'b': bodySizes = ParseList(optarg); break;
+        case 'd': dbLatencies = ParseList(optarg); break;
+        case 'f': base.dbFailRate = atoi(optarg); break;
+        case 'n': base.xactions = strtoul(optarg, 0, 10); break;
+        case 'k': base.clients = std::max(1UL, strtoul(optarg, 0, 10)); break;
+        case 'r': base.requests = true; break;
+        case 't': base.threads = std::max(1UL, strtoul(optarg, 0, 10)); break;
+        case 'v': base.revalidations = true; break;
+        default: Usage(argv[0]);
+        }
+    }
+    if (optind >= argc)
+        Usage(argv[0]);
+    const char *module = argv[optind++];
+
+    Load::Options options;
+    for (; optind < argc; ++optind) {
+        const char *eq = strchr(argv[optind], '=');
+        if (!eq)
+            Usage(argv[0]);
+        options.fields.push_back(std::make_pair(libecap::Name(std::string(argv[optind], eq - argv[optind])),
+                std::string(eq + 1)));
+    }
+
+    const bool fakeDb = !dbLatencies.empty();
+    if (!fakeDb)
+        dbLatencies.push_back(0);
+
+    printf("%7s %11s %10s %10s %8s %9s %9s %8s %8s %8s %10s %8s\n",
+            "threads", "concurrency", "body_bytes", "db_lat_us", "xactions", "xact/s",
+            "MB/s", "p50_ms", "p99_ms", "p99.9_ms", "maxrss_kb", "failures");
+    fflush(stdout);
+
+    for (size_t d = 0; d < dbLatencies.size(); ++d) {
+        for (size_t b = 0; b < bodySizes.size(); ++b) {
+            for (size_t c = 0; c < concurrencies.size(); ++c) {
+                Load::Workload w = base;
+                // every thread runs at least one transaction at a time
+                w.concurrency = std::max(static_cast<unsigned long> (w.threads), concurrencies[c]);
+                w.bodySize = bodySizes[b];
+                w.dbLatency = dbLatencies[d];
+
+                Load::Options runOptions = options;
+                char conf[] = "/tmp/james_load-XXXXXX";
+                if (fakeDb) {
+                    const int fd = mkstemp(conf);
+                    if (fd < 0) {
+                        perror("mkstemp");
+                        return 1;
+                    }
+                    close(fd);
+                    std::ofstream os(conf);
+                    os << "dbdriver = \"memory\";\n"
+                        << "dblatency = \"" << w.dbLatency << "\";\n"
+                        << "dbfailrate = \"" << w.dbFailRate << "\";\n";
+                    os.close();
+                    runOptions.fields.push_back(std::make_pair(libecap::Name("config"), std::string(conf)));
+                }
+
+                const pid_t pid = fork();
+                if (pid < 0) {
+                    perror("fork");
+                    return 1;
+                }
+                if (!pid)
+                    _exit(RunChild(module, runOptions, w));
+
+                int status = 0;
+                while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                    ;
+                if (fakeDb)
+                    unlink(conf);
+                if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+                    std::cerr << "measurement failed" << std::endl;
+                    return 1;
+                }
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,293 @@
+#include "james_ecap.h"
+#include "james_neighbors.h"
+#include "james_stats.h"
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <errno.h>
+#include <stdint.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/neighbour.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <libecap/common/errors.h>
+
+// milliseconds between checks of the stopping flag, and between
+// reads of /proc/net/arp
+#define WATCH_INTERVAL 1000
+// the ATF_COM flag of /proc/net/arp entries: the MAC is known
+#define ARP_COMPLETE 0x2
+
+namespace Adapter {
+
+    static Counter NeighborHits("neighbor.hits");
+    static Counter NeighborMisses("neighbor.misses");
+    static Counter NeighborDumps("neighbor.dumps");
+
+    // listens to rtnetlink neighbor events, after dumping the table once
+    class NetlinkNeighbors : public NeighborSource {
+    public:
+        NetlinkNeighbors() : fd(-1), sequence(0) {}
+        virtual ~NetlinkNeighbors() { if (fd >= 0) close(fd); }
+
+        bool open();
+
+        virtual bool dump(Neighbors &all);
+        virtual bool watch(Neighbors &changes, int timeout);
+
+    private:
+        // reads one datagram; returns false on errors; sets done at the dump end
+        bool receive(Neighbors &neighbors, bool &done);
+        void parse(const struct nlmsghdr *header, Neighbors &neighbors) const;
+
+        int fd;
+        unsigned int sequence;
+    };
+
+    // rereads /proc/net/arp; IPv4 only, and no change tracking
+    class ProcArpNeighbors : public NeighborSource {
+    public:
+        virtual bool dump(Neighbors &all);
+        virtual bool watch(Neighbors &changes, int timeout);
+    };
+
+} // namespace Adapter
+
+Adapter::ClientAddress Adapter::Neighbor::identity() const {
+    ClientAddress eui64;
+    eui64.bytes[0] = 0xFE;
+    eui64.bytes[1] = 0x80;
+    eui64.bytes[8] = mac[0] ^ 0x02; // the universal/local bit
+    eui64.bytes[9] = mac[1];
+    eui64.bytes[10] = mac[2];
+    eui64.bytes[11] = 0xFF;
+    eui64.bytes[12] = 0xFE;
+    eui64.bytes[13] = mac[3];
+    eui64.bytes[14] = mac[4];
+    eui64.bytes[15] = mac[5];
+    return eui64;
+}
+
+Adapter::NeighborSource *Adapter::NeighborSource::Make() {
+    NetlinkNeighbors *netlink = new NetlinkNeighbors;
+    if (netlink->open())
+        return netlink;
+    delete netlink;
+    std::cerr << "cannot listen to rtnetlink neighbor events, reading /proc/net/arp" << std::endl;
+    return new ProcArpNeighbors;
+}
+
+bool Adapter::NetlinkNeighbors::open() {
+    fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd < 0)
+        return false;
+
+    struct sockaddr_nl local;
+    memset(&local, 0, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = RTMGRP_NEIGH;
+    return bind(fd, reinterpret_cast<struct sockaddr*> (&local), sizeof(local)) == 0;
+}
+
+bool Adapter::NetlinkNeighbors::dump(Neighbors &all) {
+    struct {
+        struct nlmsghdr header;
+        struct ndmsg message;
+    } request;
+    memset(&request, 0, sizeof(request));
+    request.header.nlmsg_len = sizeof(request);
+    request.header.nlmsg_type = RTM_GETNEIGH;
+    request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    request.header.nlmsg_seq = ++sequence;
+    request.message.ndm_family = AF_UNSPEC;
+    if (send(fd, &request, sizeof(request), 0) < 0)
+        return false;
+
+    // events that arrive meanwhile are applied in order too
+    bool done = false;
+    while (!done) {
+        if (!receive(all, done))
+            return false;
+    }
+    return true;
+}
+
+bool Adapter::NetlinkNeighbors::watch(Neighbors &changes, int timeout) {
+    struct pollfd ready = {fd, POLLIN, 0};
+    const int events = poll(&ready, 1, timeout);
+    if (events < 0)
+        return errno == EINTR;
+    if (!events)
+        return true;
+    bool done = false;
+    return receive(changes, done);
+}
+
+bool Adapter::NetlinkNeighbors::receive(Neighbors &neighbors, bool &done) {
+    char buffer[16384];
+    const ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+    if (size < 0)
+        return errno == EINTR; // ENOBUFS means we missed events
+    int left = static_cast<int> (size);
+    for (const struct nlmsghdr *header = reinterpret_cast<const struct nlmsghdr*> (buffer);
+            NLMSG_OK(header, left); header = NLMSG_NEXT(header, left)) {
+        if (header->nlmsg_type == NLMSG_DONE) {
+            done = true;
+        } else if (header->nlmsg_type == NLMSG_ERROR) {
+            return false;
+        } else if (header->nlmsg_type == RTM_NEWNEIGH || header->nlmsg_type == RTM_DELNEIGH) {
+            parse(header, neighbors);
+        }
+    }
+    return true;
+}
+
+void Adapter::NetlinkNeighbors::parse(const struct nlmsghdr *header, Neighbors &neighbors) const {
+    const struct ndmsg *message = static_cast<const struct ndmsg*> (NLMSG_DATA(header));
+    Neighbor neighbor;
+    bool hasAddress = false;
+    bool hasMac = false;
+
+    int left = RTM_PAYLOAD(header);
+    for (const struct rtattr *attribute = RTM_RTA(message); RTA_OK(attribute, left);
+            attribute = RTA_NEXT(attribute, left)) {
+        const unsigned char *data = static_cast<const unsigned char*> (RTA_DATA(attribute));
+        const size_t length = RTA_PAYLOAD(attribute);
+        if (attribute->rta_type == NDA_DST && message->ndm_family == AF_INET && length == 4) {
+            static const unsigned char v4Mapped[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFF, 0xFF};
+            memcpy(neighbor.address.bytes, v4Mapped, sizeof(v4Mapped));
+            memcpy(neighbor.address.bytes + sizeof(v4Mapped), data, length);
+            hasAddress = true;
+        } else if (attribute->rta_type == NDA_DST && message->ndm_family == AF_INET6 && length == 16) {
+            memcpy(neighbor.address.bytes, data, length);
+            hasAddress = true;
+        } else if (attribute->rta_type == NDA_LLADDR && length == sizeof(neighbor.mac)) {
+            memcpy(neighbor.mac, data, length);
+            hasMac = true;
+        }
+    }
+    if (!hasAddress)
+        return;
+
+    static const int known = NUD_REACHABLE | NUD_STALE | NUD_DELAY | NUD_PROBE | NUD_PERMANENT;
+    neighbor.reachable = header->nlmsg_type == RTM_NEWNEIGH && hasMac && (message->ndm_state & known);
+    neighbors.push_back(neighbor);
+}
+
+bool Adapter::ProcArpNeighbors::dump(Neighbors &all) {
+    std::ifstream arp("/proc/net/arp");
+    std::string line;
+    if (!std::getline(arp, line))
+        return false; // not even the column titles
+
+    while (std::getline(arp, line)) {
+        std::istringstream fields(line);
+        std::string ip, type, flags, mac;
+        if (!(fields >> ip >> type >> flags >> mac))
+            continue;
+
+        Neighbor neighbor;
+        unsigned int octets[6];
+        if (!neighbor.address.parse(ip.data(), ip.size()) ||
+                !(strtoul(flags.c_str(), 0, 16) & ARP_COMPLETE) ||
+                sscanf(mac.c_str(), "%2x:%2x:%2x:%2x:%2x:%2x", &octets[0], &octets[1],
+                    &octets[2], &octets[3], &octets[4], &octets[5]) != 6)
+            continue;
+        for (unsigned int i = 0; i < 6; ++i)
+            neighbor.mac[i] = static_cast<unsigned char> (octets[i]);
+        neighbor.reachable = true;
+        all.push_back(neighbor);
+    }
+    return true;
+}
+
+bool Adapter::ProcArpNeighbors::watch(Neighbors &, int timeout) {
+    poll(0, 0, timeout);
+    return false; // read it all again
+}
+
+Adapter::NeighborTable::NeighborTable(NeighborSource *aSource) : source(aSource), stopping(0) {
+    Must(source);
+    pthread_rwlock_init(&lock, 0);
+    if (pthread_create(&watcher, 0, &NeighborTable::Watch, this)) {
+        pthread_rwlock_destroy(&lock);
+        delete source;
+        throw libecap::TextException("cannot start the neighbor table thread");
+    }
+}
+
+Adapter::NeighborTable::~NeighborTable() {
+    __sync_lock_test_and_set(&stopping, 1);
+    pthread_join(watcher, 0);
+    pthread_rwlock_destroy(&lock);
+    delete source;
+}
+
+Adapter::ClientAddress Adapter::NeighborTable::identity(const ClientAddress &address) const {
+    pthread_rwlock_rdlock(&lock);
+    const Identities::const_iterator i = identities.find(address);
+    const bool found = i != identities.end();
+    const ClientAddress result = found ? i->second : address;
+    pthread_rwlock_unlock(&lock);
+
+    if (found)
+        NeighborHits.add();
+    else
+        NeighborMisses.add();
+    return result;
+}
+
+size_t Adapter::NeighborTable::Hash::operator()(const ClientAddress &address) const {
+    uint64_t high, low;
+    memcpy(&high, address.bytes, sizeof(high));
+    memcpy(&low, address.bytes + sizeof(high), sizeof(low));
+    const uint64_t mixed = (high ^ low) * 0x9E3779B97F4A7C15ULL;
+    return static_cast<size_t> (mixed ^ (mixed >> 32));
+}
+
+void *Adapter::NeighborTable::Watch(void *table) {
+    static_cast<NeighborTable*> (table)->watch();
+    return 0;
+}
+
+void Adapter::NeighborTable::watch() {
+    bool current = false; // whether identities reflect a complete dump
+    while (!__sync_fetch_and_add(&stopping, 0)) {
+        Neighbors neighbors;
+        if (!current) {
+            if (!source->dump(neighbors)) {
+                poll(0, 0, WATCH_INTERVAL); // try again later
+                continue;
+            }
+            NeighborDumps.add();
+            Identities fresh;
+            apply(neighbors, fresh);
+            pthread_rwlock_wrlock(&lock);
+            identities.swap(fresh);
+            pthread_rwlock_unlock(&lock);
+            current = true;
+            continue;
+        }
+
+        current = source->watch(neighbors, WATCH_INTERVAL);
+        if (neighbors.empty())
+            continue;
+        pthread_rwlock_wrlock(&lock);
+        apply(neighbors, identities);
+        pthread_rwlock_unlock(&lock);
+    }
+}
+
+// later changes of the same neighbor override earlier ones
+void Adapter::NeighborTable::apply(const Neighbors &changes, Identities &table) {
+    for (Neighbors::const_iterator i = changes.begin(); i != changes.end(); ++i) {
+        if (i->reachable)
+            table[i->address] = i->identity();
+        else
+            table.erase(i->address);
+    }
+}
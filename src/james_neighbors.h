@@ -0,0 +1,84 @@
+#ifndef JAMES_NEIGHBORS_H
+#define JAMES_NEIGHBORS_H
+
+#include "james_address.h"
+#include <string>
+#include <vector>
+#include <tr1/unordered_map>
+#include <pthread.h>
+
+namespace Adapter {
+
+    // a kernel neighbor (ARP or NDP) table entry
+    class Neighbor {
+    public:
+        Neighbor() : reachable(false) { memset(mac, 0, sizeof(mac)); }
+
+        // the modified EUI-64 link-local address (fe80::/64) of our MAC,
+        // which identifies the device whatever addresses it leases
+        ClientAddress identity() const;
+
+        ClientAddress address;
+        unsigned char mac[6];
+        bool reachable; // false if the kernel forgot or failed the neighbor
+    };
+
+    typedef std::vector<Neighbor> Neighbors;
+
+    // Where a NeighborTable learns about neighbors. Implementations may
+    // block; they are only called from the table's own thread.
+
+    class NeighborSource {
+    public:
+        // rtnetlink if the kernel lets us listen, /proc/net/arp otherwise
+        static NeighborSource *Make();
+
+        virtual ~NeighborSource() {}
+
+        // gets all current neighbors; returns false on errors
+        virtual bool dump(Neighbors &all) = 0;
+
+        // waits up to timeout milliseconds and gets the neighbors that
+        // changed since the last call; returns false if the caller should
+        // dump() again (errors, missed changes, or no change tracking)
+        virtual bool watch(Neighbors &changes, int timeout) = 0;
+    };
+
+    // Client MAC addresses by IP address, for identifying captive portal
+    // clients by device. A background thread keeps the table up to date,
+    // so the host threads only do a hash lookup under a read lock.
+
+    class NeighborTable {
+    public:
+        explicit NeighborTable(NeighborSource *aSource); // takes ownership
+        ~NeighborTable();
+
+        // the identity of the device using address, or address itself if
+        // the device is not a neighbor (it is routed or not yet seen)
+        ClientAddress identity(const ClientAddress &address) const;
+
+    private:
+        NeighborTable(const NeighborTable &); // not implemented
+        NeighborTable &operator=(const NeighborTable &); // not implemented
+
+        class Hash {
+        public:
+            size_t operator()(const ClientAddress &address) const;
+        };
+        typedef std::tr1::unordered_map<ClientAddress, ClientAddress, Hash> Identities;
+
+        static void *Watch(void *table);
+        void watch(); // the background thread loop
+        void apply(const Neighbors &changes, Identities &table);
+
+        NeighborSource *source;
+        Identities identities; // by client address
+        mutable pthread_rwlock_t lock; // protects identities
+
+        pthread_t watcher;
+        int stopping; // atomic; set once, to end the watcher
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_NEIGHBORS_H */
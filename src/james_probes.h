@@ -0,0 +1,47 @@
+#ifndef JAMES_PROBES_H
+#define JAMES_PROBES_H
+
+#include <stdint.h>
+
+// Static tracepoints of the "james" provider, for bpftrace, perf and
+// SystemTap to attach to without a rebuild. A disabled probe is a single
+// nop; its arguments are values the adapter has computed anyway. Every
+// probe carries the transaction ID first:
+//
+//     xaction_create(id)                 Service::makeXaction()
+//     xaction_start(id)                  Xaction::start()
+//     vb_content(id, size)               a virgin body chunk was copied
+//     inject(id, hit, size)              script injection into a chunk
+//     db_begin(id)                       client database call...
+//     db_end(id, allowed)                ...and its answer
+//     ab_content(id, offset, size)       the host took adapted body content
+//     xaction_end(id, vbBytes, abBytes)  Xaction destruction
+//
+// The passthru adapter never copies virgin body chunks. Without
+// <sys/sdt.h> the probes compile to nothing.
+
+#ifdef HAVE_SYS_SDT_H
+  #include <sys/sdt.h>
+  #define JAMES_PROBE1(name, a1) DTRACE_PROBE1(james, name, a1)
+  #define JAMES_PROBE2(name, a1, a2) DTRACE_PROBE2(james, name, a1, a2)
+  #define JAMES_PROBE3(name, a1, a2, a3) DTRACE_PROBE3(james, name, a1, a2, a3)
+#else
+  // sizeof() does not evaluate its operand but keeps it "used"
+  #define JAMES_PROBE1(name, a1) ((void)sizeof(a1))
+  #define JAMES_PROBE2(name, a1, a2) ((void)sizeof(a1), (void)sizeof(a2))
+  #define JAMES_PROBE3(name, a1, a2, a3) ((void)sizeof(a1), (void)sizeof(a2), (void)sizeof(a3))
+#endif
+
+namespace Adapter {
+
+    typedef uint64_t XactionId;
+
+    // a new transaction ID, unique within the adapter module
+    inline XactionId NextXactionId() {
+        static XactionId last = 0;
+        return __sync_add_and_fetch(&last, 1);
+    }
+
+} // namespace Adapter
+
+#endif /* JAMES_PROBES_H */
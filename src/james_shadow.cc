@@ -0,0 +1,79 @@
+#include "james_ecap.h"
+#include "james_shadow.h"
+#include "james_stats.h"
+#include <algorithm>
+#include <libecap/common/errors.h>
+
+static Adapter::Counter MemorySkips("shadow.memory_skips");
+static Adapter::Counter CpuSkips("shadow.cpu_skips");
+
+Adapter::ShadowBudget::ShadowBudget(double aRate, uint64_t aMemory, double aCpu) :
+rate(aRate), memory(aMemory), cpu(aCpu), seen(0), held(0), tokens(aCpu * 1e6) {
+    Must(rate > 0 && rate <= 1 && cpu > 0);
+    pthread_mutex_init(&mutex, 0);
+    clock_gettime(CLOCK_MONOTONIC, &refilled);
+}
+
+Adapter::ShadowBudget::~ShadowBudget() {
+    pthread_mutex_destroy(&mutex);
+}
+
+bool Adapter::ShadowBudget::sample() {
+    // the n-th transaction is sampled when n * rate reaches a new integer
+    const uint64_t n = __sync_fetch_and_add(&seen, 1);
+    if (static_cast<uint64_t> ((n + 1) * rate) == static_cast<uint64_t> (n * rate))
+        return false;
+
+    if (memory && __sync_fetch_and_add(&held, 0) >= memory) {
+        MemorySkips.add();
+        return false;
+    }
+
+    pthread_mutex_lock(&mutex);
+    refill();
+    const bool allowed = tokens > 0;
+    pthread_mutex_unlock(&mutex);
+    if (!allowed)
+        CpuSkips.add();
+    return allowed;
+}
+
+bool Adapter::ShadowBudget::reserve(size_type bytes) {
+    uint64_t was;
+    do {
+        was = __sync_fetch_and_add(&held, 0);
+        if (memory && was + bytes > memory) {
+            MemorySkips.add();
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&held, was, was + bytes));
+    return true;
+}
+
+void Adapter::ShadowBudget::release(size_type bytes) {
+    __sync_fetch_and_sub(&held, static_cast<uint64_t> (bytes));
+}
+
+void Adapter::ShadowBudget::charge(uint64_t usec) {
+    pthread_mutex_lock(&mutex);
+    refill();
+    tokens -= usec; // may go below zero; sampling waits until it is paid off
+    pthread_mutex_unlock(&mutex);
+}
+
+uint64_t Adapter::ShadowBudget::CpuNow() {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
+// tokens grow by cpu microseconds per wall-clock microsecond, up to one
+// second's worth, so that a quiet spell cannot be saved up for a burst
+void Adapter::ShadowBudget::refill() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    const double elapsed = (now.tv_sec - refilled.tv_sec) * 1e6 +
+        (now.tv_nsec - refilled.tv_nsec) / 1e3;
+    tokens = std::min(tokens + elapsed * cpu, cpu * 1e6);
+    refilled = now;
+}
@@ -0,0 +1,55 @@
+#ifndef JAMES_SHADOW_H
+#define JAMES_SHADOW_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <libecap/common/forward.h>
+
+namespace Adapter {
+
+    using libecap::size_type;
+
+    // Which transactions also run an alternative adaptation in the
+    // background, for comparison, and what shadowing may cost. A fixed
+    // fraction of transactions is sampled, evenly spread. Sampling pauses
+    // while the virgin copies held for shadowing reach the memory budget,
+    // or while shadow runs have used more CPU time than their share of
+    // wall-clock time allows. All methods may be called from any thread.
+
+    class ShadowBudget {
+    public:
+        // rate: the fraction of transactions to sample; memory: bytes of
+        // virgin copies; cpu: the fraction of one core shadow runs may use
+        ShadowBudget(double aRate, uint64_t aMemory, double aCpu);
+        ~ShadowBudget();
+
+        bool sample(); // whether to shadow the next transaction
+
+        bool reserve(size_type bytes); // false if over the memory budget
+        void release(size_type bytes);
+
+        void charge(uint64_t usec); // CPU time one shadow run took
+
+        static uint64_t CpuNow(); // CPU time of the calling thread, in usec
+
+    private:
+        ShadowBudget(const ShadowBudget &); // not implemented
+        ShadowBudget &operator=(const ShadowBudget &); // not implemented
+
+        void refill(); // needs mutex
+
+        const double rate;
+        const uint64_t memory;
+        const double cpu;
+        uint64_t seen; // atomic; transactions asked about
+        uint64_t held; // atomic; bytes reserved
+
+        pthread_mutex_t mutex; // protects the members below
+        double tokens; // CPU microseconds shadow runs may still use
+        struct timespec refilled; // when tokens were last added
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_SHADOW_H */
@@ -0,0 +1,195 @@
+#include "james_ecap.h"
+#include "james_shaper.h"
+#include "james_stats.h"
+#include <vector>
+#include <time.h>
+#include <libecap/common/errors.h>
+
+// the smallest part of its client's tokens a flow may take, in bytes
+#define FAIR_QUANTUM 4096
+// joins between sweeps of idle buckets
+#define SWEEP_INTERVAL 1024
+// seconds after which join() asks for the class of a bucket again
+#define CLASS_TTL 30
+
+namespace Adapter {
+
+    static Counter Stalls("shaper.stalls");
+    static Counter Wakeups("shaper.wakeups");
+    static Counter Reclassified("shaper.reclassified");
+
+    class Shaper::Bucket {
+    public:
+        Bucket(const ClientAddress &aClient, uint64_t aRate, uint64_t aBurst, uint64_t now) :
+            client(aClient), rate(aRate), burst(aBurst), tokens(aBurst), refilled(now),
+            classified(now), flows(0) {}
+
+        const ClientAddress client;
+        uint64_t rate; // bytes per second
+        uint64_t burst; // most tokens
+        double tokens; // bytes that may be sent now
+        uint64_t refilled; // when tokens were last added, by Now()
+        uint64_t classified; // when join() last asked for the class, by Now()
+        unsigned int flows; // transactions sharing the tokens
+    };
+
+} // namespace Adapter
+
+Adapter::Shaper::Shaper() : joins(0) {
+    pthread_mutex_init(&mutex, 0);
+}
+
+Adapter::Shaper::~Shaper() {
+    for (Buckets::iterator i = buckets.begin(); i != buckets.end(); ++i)
+        delete i->second;
+    pthread_mutex_destroy(&mutex);
+}
+
+Adapter::Shaper::Bucket *Adapter::Shaper::join(const ClientAddress &client, uint64_t rate,
+        uint64_t burst, bool &stale) {
+    const uint64_t now = Now();
+    pthread_mutex_lock(&mutex);
+    if (++joins >= SWEEP_INTERVAL)
+        sweep(now);
+    Bucket *&bucket = buckets[client];
+    if (!bucket) {
+        bucket = new Bucket(client, rate, burst, now);
+        stale = true;
+    } else {
+        stale = now - bucket->classified >= CLASS_TTL * 1000;
+        if (stale)
+            bucket->classified = now;
+    }
+    ++bucket->flows;
+    pthread_mutex_unlock(&mutex);
+    return bucket;
+}
+
+void Adapter::Shaper::leave(Bucket *bucket) {
+    pthread_mutex_lock(&mutex);
+    Must(bucket->flows > 0);
+    --bucket->flows; // swept later, so that a new flow cannot get a full burst
+    pthread_mutex_unlock(&mutex);
+}
+
+// the tokens so far accrued at the old rate
+void Adapter::Shaper::classify(const ClientAddress &client, uint64_t rate, uint64_t burst) {
+    const uint64_t now = Now();
+    pthread_mutex_lock(&mutex);
+    const Buckets::iterator i = buckets.find(client);
+    if (i != buckets.end() && (i->second->rate != rate || i->second->burst != burst)) {
+        Bucket &bucket = *i->second;
+        refill(bucket, now);
+        bucket.rate = rate;
+        bucket.burst = burst;
+        if (bucket.tokens > burst)
+            bucket.tokens = burst;
+        Reclassified.add();
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+uint64_t Adapter::Shaper::allowance(Bucket *bucket) {
+    const uint64_t now = Now();
+    pthread_mutex_lock(&mutex);
+    if (!bucket->rate) {
+        pthread_mutex_unlock(&mutex);
+        return ~0ULL; // an unshaped class
+    }
+    refill(*bucket, now);
+    const uint64_t tokens = static_cast<uint64_t> (bucket->tokens);
+    uint64_t share = tokens / (bucket->flows ? bucket->flows : 1);
+    if (share < FAIR_QUANTUM)
+        share = tokens < FAIR_QUANTUM ? tokens : FAIR_QUANTUM;
+    pthread_mutex_unlock(&mutex);
+    return share;
+}
+
+void Adapter::Shaper::spend(Bucket *bucket, uint64_t bytes) {
+    pthread_mutex_lock(&mutex);
+    bucket->tokens -= bytes;
+    if (bucket->tokens < 0)
+        bucket->tokens = 0;
+    pthread_mutex_unlock(&mutex);
+}
+
+void Adapter::Shaper::stall(Bucket *bucket, Waiter *waiter) {
+    Stalls.add();
+    pthread_mutex_lock(&mutex);
+    waiters[waiter] = bucket;
+    pthread_mutex_unlock(&mutex);
+}
+
+void Adapter::Shaper::unstall(Waiter *waiter) {
+    pthread_mutex_lock(&mutex);
+    waiters.erase(waiter);
+    pthread_mutex_unlock(&mutex);
+}
+
+bool Adapter::Shaper::stalled() const {
+    pthread_mutex_lock(&mutex);
+    const bool any = !waiters.empty();
+    pthread_mutex_unlock(&mutex);
+    return any;
+}
+
+// waiters are woken without the mutex, as waking may call us back
+void Adapter::Shaper::wake() {
+    const uint64_t now = Now();
+    std::vector<Waiter*> ready;
+    pthread_mutex_lock(&mutex);
+    std::map<Waiter*, Bucket*>::iterator i = waiters.begin();
+    while (i != waiters.end()) {
+        refill(*i->second, now);
+        if (i->second->rate && i->second->tokens < 1) {
+            ++i;
+            continue;
+        }
+        ready.push_back(i->first);
+        waiters.erase(i++);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    Wakeups.add(ready.size());
+    for (std::vector<Waiter*>::const_iterator w = ready.begin(); w != ready.end(); ++w)
+        (*w)->wake();
+}
+
+uint64_t Adapter::Shaper::Now() {
+    struct timespec ts;
+#ifdef CLOCK_MONOTONIC_COARSE
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+void Adapter::Shaper::refill(Bucket &bucket, uint64_t now) {
+    if (!bucket.rate) {
+        bucket.tokens = bucket.burst; // unshaped; idle ones may be swept
+        bucket.refilled = now;
+        return;
+    }
+    if (now <= bucket.refilled)
+        return;
+    bucket.tokens += static_cast<double> (now - bucket.refilled) * bucket.rate / 1000;
+    if (bucket.tokens > bucket.burst)
+        bucket.tokens = bucket.burst;
+    bucket.refilled = now;
+}
+
+void Adapter::Shaper::sweep(uint64_t now) {
+    joins = 0;
+    Buckets::iterator i = buckets.begin();
+    while (i != buckets.end()) {
+        Bucket *bucket = i->second;
+        refill(*bucket, now);
+        if (!bucket->flows && bucket->tokens >= bucket->burst) {
+            delete bucket;
+            buckets.erase(i++);
+        } else {
+            ++i;
+        }
+    }
+}
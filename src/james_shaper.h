@@ -0,0 +1,80 @@
+#ifndef JAMES_SHAPER_H
+#define JAMES_SHAPER_H
+
+#include "james_address.h"
+#include <map>
+#include <stdint.h>
+#include <pthread.h>
+
+namespace Adapter {
+
+    // Per-client token buckets, so that one client cannot take all of the
+    // uplink. Buckets refill from a shared coarse clock when they are used,
+    // not from timers. The concurrent transactions (flows) of a client share
+    // its bucket fairly: each may take an equal part of the tokens.
+    //
+    // A bucket also carries its client's class: the rate and burst it gets.
+    // A new bucket gets a default class; join() tells the caller when to
+    // learn the real one, which it may do in the background and report
+    // with classify(). A zero rate leaves the client unshaped.
+    //
+    // A flow that ran out of tokens stalls; the adapter wakes it from the
+    // host's suspend/resume polling (see Service::suspend()), when its
+    // bucket has tokens again. Thread-safe, but waiters must not be
+    // destroyed by another thread while wake() runs.
+
+    class Shaper {
+    public:
+        // a stalled flow to wake
+        class Waiter {
+        public:
+            virtual ~Waiter() {}
+            virtual void wake() = 0;
+        };
+
+        class Bucket; // opaque; belongs to the shaper
+
+        Shaper();
+        ~Shaper();
+
+        // starts a flow of client, creating its bucket with the given
+        // default rate (bytes per second) and burst (bytes) if it has none;
+        // sets stale if the class of the bucket is new or older than
+        // CLASS_TTL seconds, once per such period
+        Bucket *join(const ClientAddress &client, uint64_t rate, uint64_t burst, bool &stale);
+        void leave(Bucket *bucket); // ends a flow; unstall() it first
+
+        // gives the bucket of client, if it has one, a class
+        void classify(const ClientAddress &client, uint64_t rate, uint64_t burst);
+
+        uint64_t allowance(Bucket *bucket); // bytes one flow may send now
+        void spend(Bucket *bucket, uint64_t bytes);
+
+        // remembers to wake waiter once bucket has tokens again
+        void stall(Bucket *bucket, Waiter *waiter);
+        void unstall(Waiter *waiter);
+
+        bool stalled() const; // whether any flow waits for tokens
+        void wake(); // wakes the flows whose buckets have tokens
+
+        // the coarse clock, in milliseconds
+        static uint64_t Now();
+
+    private:
+        Shaper(const Shaper &); // not implemented
+        Shaper &operator=(const Shaper &); // not implemented
+
+        typedef std::map<ClientAddress, Bucket*> Buckets;
+
+        void refill(Bucket &bucket, uint64_t now); // needs mutex
+        void sweep(uint64_t now); // forgets full, idle buckets; needs mutex
+
+        Buckets buckets;
+        std::map<Waiter*, Bucket*> waiters; // stalled flows
+        unsigned int joins; // since the last sweep
+        mutable pthread_mutex_t mutex; // protects all of the above
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_SHAPER_H */
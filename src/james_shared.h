@@ -0,0 +1,47 @@
+#ifndef JAMES_SHARED_H
+#define JAMES_SHARED_H
+
+#include <libecap/common/memory.h>
+#include <pthread.h>
+
+namespace Adapter {
+
+    // An immutable value that any thread may read while another replaces
+    // it. Readers keep the snapshot they got alive for as long as they
+    // hold it, so a transaction sees one configuration from start to end
+    // even if the service is reconfigured meanwhile.
+
+    template <class T>
+    class Snapshot {
+    public:
+        typedef libecap::shared_ptr<const T> Pointer;
+
+        Snapshot() { pthread_mutex_init(&mutex, 0); }
+        ~Snapshot() { pthread_mutex_destroy(&mutex); }
+
+        Pointer get() const {
+            pthread_mutex_lock(&mutex);
+            const Pointer result = current;
+            pthread_mutex_unlock(&mutex);
+            return result;
+        }
+
+        void set(const Pointer &fresh) {
+            pthread_mutex_lock(&mutex);
+            Pointer old = current;
+            current = fresh;
+            pthread_mutex_unlock(&mutex);
+            // old, if it was the last reference, is destroyed here, unlocked
+        }
+
+    private:
+        Snapshot(const Snapshot &); // not implemented
+        Snapshot &operator=(const Snapshot &); // not implemented
+
+        mutable pthread_mutex_t mutex;
+        Pointer current;
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_SHARED_H */
@@ -0,0 +1,119 @@
+#include "james_ecap.h"
+#include "james_sketch.h"
+#include <algorithm>
+#include <cstring>
+
+namespace Adapter {
+
+    static bool MoreFrequent(const HeavyHitters::Hitter &a, const HeavyHitters::Hitter &b) {
+        return a.second > b.second;
+    }
+
+} // namespace Adapter
+
+Adapter::HeavyHitters::HeavyHitters(unsigned int aHalfLife) :
+halfLife(aHalfLife), nextDecay(time(0) + aHalfLife), floor(0) {
+    memset(counts, 0, sizeof(counts));
+    pthread_mutex_init(&mutex, 0);
+}
+
+Adapter::HeavyHitters::~HeavyHitters() {
+    pthread_mutex_destroy(&mutex);
+}
+
+// one counter per row, from two halves of a single FNV-1a hash
+void Adapter::HeavyHitters::position(const std::string &key, unsigned int slots[Depth]) const {
+    uint64_t hash = 14695981039346656037ULL;
+    for (std::string::const_iterator i = key.begin(); i != key.end(); ++i)
+        hash = (hash ^ static_cast<unsigned char> (*i)) * 1099511628211ULL;
+    const uint32_t h1 = static_cast<uint32_t> (hash);
+    const uint32_t h2 = static_cast<uint32_t> (hash >> 32) | 1;
+    for (unsigned int d = 0; d < Depth; ++d)
+        slots[d] = (h1 + d * h2) % Width;
+}
+
+uint32_t Adapter::HeavyHitters::add(const std::string &key) {
+    const time_t now = time(0);
+    if (now >= static_cast<time_t> (__sync_fetch_and_add(&nextDecay, 0)))
+        decay(now);
+
+    unsigned int slots[Depth];
+    position(key, slots);
+    uint32_t result = 0xFFFFFFFFU;
+    for (unsigned int d = 0; d < Depth; ++d)
+        result = std::min(result, __sync_add_and_fetch(&counts[d][slots[d]], 1));
+
+    if (result >= HotMinimum && result > __sync_fetch_and_add(&floor, 0))
+        promote(key, result);
+    return result;
+}
+
+uint32_t Adapter::HeavyHitters::estimate(const std::string &key) const {
+    unsigned int slots[Depth];
+    position(key, slots);
+    uint32_t result = 0xFFFFFFFFU;
+    for (unsigned int d = 0; d < Depth; ++d)
+        result = std::min(result, __sync_fetch_and_add(&counts[d][slots[d]], 0));
+    return result;
+}
+
+bool Adapter::HeavyHitters::hot(uint32_t estimate) const {
+    return estimate >= HotMinimum && estimate >= __sync_fetch_and_add(&floor, 0);
+}
+
+void Adapter::HeavyHitters::promote(const std::string &key, uint32_t estimate) {
+    pthread_mutex_lock(&mutex);
+    std::vector<Hitter>::iterator least = hitters.end();
+    std::vector<Hitter>::iterator i = hitters.begin();
+    for (; i != hitters.end() && i->first != key; ++i) {
+        if (least == hitters.end() || i->second < least->second)
+            least = i;
+    }
+
+    if (i != hitters.end())
+        i->second = estimate;
+    else if (hitters.size() < TopSize)
+        hitters.push_back(Hitter(key, estimate));
+    else if (estimate > least->second)
+        *least = Hitter(key, estimate);
+
+    uint32_t smallest = 0;
+    if (hitters.size() >= TopSize) {
+        smallest = hitters.front().second;
+        for (i = hitters.begin(); i != hitters.end(); ++i)
+            smallest = std::min(smallest, i->second);
+    }
+    __sync_lock_test_and_set(&floor, smallest);
+    pthread_mutex_unlock(&mutex);
+}
+
+void Adapter::HeavyHitters::decay(time_t now) {
+    const time_t due = __sync_fetch_and_add(&nextDecay, 0);
+    if (now < due || !__sync_bool_compare_and_swap(&nextDecay, due, now + halfLife))
+        return; // another thread is decaying
+
+    for (unsigned int d = 0; d < Depth; ++d) {
+        for (unsigned int w = 0; w < Width; ++w)
+            __sync_fetch_and_sub(&counts[d][w], __sync_fetch_and_add(&counts[d][w], 0) / 2);
+    }
+
+    pthread_mutex_lock(&mutex);
+    for (std::vector<Hitter>::iterator i = hitters.begin(); i != hitters.end(); ++i)
+        i->second /= 2;
+    __sync_lock_test_and_set(&floor, __sync_fetch_and_add(&floor, 0) / 2);
+    pthread_mutex_unlock(&mutex);
+}
+
+std::vector<Adapter::HeavyHitters::Hitter> Adapter::HeavyHitters::top() const {
+    pthread_mutex_lock(&mutex);
+    std::vector<Hitter> result(hitters);
+    pthread_mutex_unlock(&mutex);
+    std::sort(result.begin(), result.end(), &MoreFrequent);
+    return result;
+}
+
+void Adapter::HeavyHitters::dump(std::ostream &os, const char *label) const {
+    const std::vector<Hitter> result = top();
+    for (std::vector<Hitter>::const_iterator i = result.begin(); i != result.end(); ++i)
+        os << label << ": " << i->first << ' ' << i->second << "\n";
+}
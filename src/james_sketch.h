@@ -0,0 +1,63 @@
+#ifndef JAMES_SKETCH_H
+#define JAMES_SKETCH_H
+
+#include <ostream>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+namespace Adapter {
+
+    // Finds the most frequent keys (client addresses, hosts) in fixed
+    // memory. A count-min sketch estimates how often each key was seen,
+    // never underestimating; the estimates are halved every halfLife
+    // seconds, so a key counts its last couple of half-lives, roughly.
+    // The few keys with the highest estimates are kept by name.
+    //
+    // add() is lock-free unless its key makes it into the top ones, so it
+    // may be called on every transaction from any host thread.
+
+    class HeavyHitters {
+    public:
+        typedef std::pair<std::string, uint32_t> Hitter; // key and estimate
+
+        explicit HeavyHitters(unsigned int aHalfLife);
+        ~HeavyHitters();
+
+        uint32_t add(const std::string &key); // counts key; returns its estimate
+        uint32_t estimate(const std::string &key) const;
+
+        // whether a key with this estimate is among the top ones
+        bool hot(uint32_t estimate) const;
+
+        std::vector<Hitter> top() const; // most frequent first
+
+        // writes a "label: key estimate" line for each top key
+        void dump(std::ostream &os, const char *label) const;
+
+    private:
+        enum { Depth = 4, Width = 2048, TopSize = 16 };
+        enum { HotMinimum = 8 }; // fewer visits never make a key hot
+
+        void position(const std::string &key, unsigned int slots[Depth]) const;
+        void promote(const std::string &key, uint32_t estimate);
+        void decay(time_t now);
+
+        mutable uint32_t counts[Depth][Width]; // atomic
+        const unsigned int halfLife;
+        time_t nextDecay;
+
+        mutable pthread_mutex_t mutex; // protects hitters
+        std::vector<Hitter> hitters; // the top ones, unordered
+        mutable uint32_t floor; // atomic; the smallest top estimate once there are TopSize
+
+        HeavyHitters(const HeavyHitters &); // not implemented
+        HeavyHitters &operator =(const HeavyHitters &); // not implemented
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_SKETCH_H */
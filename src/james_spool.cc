@@ -0,0 +1,280 @@
+#include "james_ecap.h"
+#include "james_spool.h"
+#include "james_stats.h"
+#include <iostream>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <sstream>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+static Adapter::Counter SpoolBodies("spool.bodies");
+static Adapter::Counter SpoolBytes("spool.bytes");
+static Adapter::Counter SpoolDroppedBodies("spool.dropped_bodies");
+static Adapter::Counter SpoolDroppedBytes("spool.dropped_bytes");
+static Adapter::Counter SpoolWriteErrors("spool.write_errors");
+
+// capture ids are unique within the process, across reconfigurations
+static Adapter::Spool::Id LastId = 0;
+// tells this process's capture files from those of an earlier one with our pid
+static const time_t ProcessStarted = time(NULL);
+
+enum { rkPad, rkOpen, rkData, rkClose };
+
+// every ring entry starts with this header, aligned to its size, so
+// that the unused tail of the ring can always hold a padding record
+struct Adapter::Spool::Record {
+    Id id;
+    uint32_t kind;
+    uint32_t size; // payload bytes following the header
+};
+
+static const size_t RecordAlign = sizeof(uint64_t) * 2;
+
+static size_t AlignedSize(size_t size) {
+    return (size + RecordAlign - 1) / RecordAlign * RecordAlign;
+}
+
+// writes all iovecs, restarting after partial writes
+static bool WriteAll(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        const ssize_t written = writev(fd, iov, count);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        size_t left = written;
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char*> (iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+Adapter::Spool::Spool(const std::string &aDir, size_t ringSize) :
+dir(aDir), ring(0), capacity(AlignedSize(ringSize)), head(0), tail(0),
+stopping(false), running(false), index(-1) {
+    ring = new char[capacity];
+    pthread_mutex_init(&producer, 0);
+}
+
+Adapter::Spool::~Spool() {
+    stop();
+    pthread_mutex_destroy(&producer);
+    delete [] ring;
+}
+
+void Adapter::Spool::start() {
+    if (running)
+        return;
+    stopping = false;
+    if (pthread_create(&writer, 0, &WriterLoop, this) != 0) {
+        std::cerr << "spool: cannot start writer thread: " << strerror(errno) << std::endl;
+        return;
+    }
+    running = true;
+}
+
+void Adapter::Spool::stop() {
+    if (!running)
+        return;
+    __atomic_store_n(&stopping, true, __ATOMIC_RELEASE);
+    pthread_join(writer, 0);
+    running = false;
+
+    for (std::map<Id, int>::iterator i = files.begin(); i != files.end(); ++i)
+        ::close(i->second);
+    files.clear();
+    if (index >= 0) {
+        ::close(index);
+        index = -1;
+    }
+}
+
+Adapter::Spool::Id Adapter::Spool::open(const std::string &description) {
+    if (!running)
+        return 0;
+    const Id id = __sync_add_and_fetch(&LastId, 1);
+    if (!enqueue(id, rkOpen, description.data(), description.size())) {
+        SpoolDroppedBodies.add();
+        return 0;
+    }
+    SpoolBodies.add();
+    return id;
+}
+
+bool Adapter::Spool::write(Id id, const char *data, size_t size) {
+    if (enqueue(id, rkData, data, size)) {
+        SpoolBytes.add(size);
+        return true;
+    }
+    SpoolDroppedBodies.add();
+    SpoolDroppedBytes.add(size);
+    close(id);
+    return false;
+}
+
+void Adapter::Spool::close(Id id) {
+    pthread_mutex_lock(&producer);
+    // data records leave room for one close record; when several captures
+    // overflow at once, the writer takes the rest from the side
+    if (!push(id, rkClose, 0, 0))
+        lateCloses.push_back(id);
+    pthread_mutex_unlock(&producer);
+}
+
+// serializes producers; with one host thread, the lock is never contended
+bool Adapter::Spool::enqueue(Id id, int kind, const char *data, size_t size) {
+    pthread_mutex_lock(&producer);
+    const bool queued = push(id, kind, data, size);
+    pthread_mutex_unlock(&producer);
+    return queued;
+}
+
+// copies a record into the ring and publishes it to the writer
+bool Adapter::Spool::push(Id id, int kind, const char *data, size_t size) {
+    const size_t need = sizeof(Record) + AlignedSize(size);
+    const uint64_t h = head; // only producers change it, under our lock
+    const size_t used = h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    const size_t offset = h % capacity;
+    const size_t padding = (offset + need > capacity) ? capacity - offset : 0;
+
+    // keep room for a close record unless we are writing one
+    const size_t reserve = (kind == rkClose) ? 0 : sizeof(Record);
+    if (used + padding + need + reserve > capacity)
+        return false;
+
+    if (padding) {
+        Record *pad = reinterpret_cast<Record*> (ring + offset);
+        pad->id = 0;
+        pad->kind = rkPad;
+        pad->size = padding - sizeof(Record);
+    }
+
+    Record *rec = reinterpret_cast<Record*> (ring + (h + padding) % capacity);
+    rec->id = id;
+    rec->kind = kind;
+    rec->size = size;
+    if (size)
+        memcpy(rec + 1, data, size);
+
+    // the record must be complete before it is visible
+    __atomic_store_n(&head, h + padding + need, __ATOMIC_RELEASE);
+    return true;
+}
+
+void *Adapter::Spool::WriterLoop(void *spool) {
+    Spool *self = static_cast<Spool*> (spool);
+    while (true) {
+        const bool idle = __atomic_load_n(&self->head, __ATOMIC_ACQUIRE) == self->tail;
+        if (idle && __atomic_load_n(&self->stopping, __ATOMIC_ACQUIRE))
+            break;
+        if (idle) {
+            self->drain(); // closes that did not fit the ring, if any
+            // idle; let the producer accumulate a batch
+            const struct timespec pause = {0, 10 * 1000 * 1000};
+            nanosleep(&pause, 0);
+            continue;
+        }
+        self->drain();
+    }
+    return 0;
+}
+
+// writes all published records; consecutive data records of one capture
+// are gathered into a single writev() call
+void Adapter::Spool::drain() {
+    // the data of a late close is in the ring before head was read with it
+    pthread_mutex_lock(&producer);
+    const uint64_t h = __atomic_load_n(&head, __ATOMIC_ACQUIRE);
+    std::vector<Id> closes;
+    closes.swap(lateCloses);
+    pthread_mutex_unlock(&producer);
+
+    std::vector<struct iovec> batch;
+    int batchFd = -1;
+    std::string log; // index lines for captures opened in this pass
+
+    for (uint64_t pos = tail; pos < h;) {
+        const Record *rec = reinterpret_cast<const Record*> (ring + pos % capacity);
+        pos += sizeof(Record) + AlignedSize(rec->size);
+
+        if (rec->kind == rkPad)
+            continue;
+
+        std::map<Id, int>::iterator file = files.find(rec->id);
+        const int fd = (file == files.end()) ? -1 : file->second;
+
+        if (!batch.empty() && (fd != batchFd || rec->kind != rkData ||
+                batch.size() == IOV_MAX)) {
+            if (!WriteAll(batchFd, &batch[0], batch.size()))
+                SpoolWriteErrors.add();
+            batch.clear();
+        }
+
+        if (rec->kind == rkOpen) {
+            std::ostringstream name;
+            name << dir << '/' << ProcessStarted << '-' << getpid() << '-' << rec->id << ".body";
+            // never overwrite an earlier capture
+            const int newFd = ::open(name.str().c_str(), O_WRONLY | O_CREAT | O_EXCL, 0640);
+            if (newFd < 0) {
+                SpoolWriteErrors.add();
+                continue;
+            }
+            files[rec->id] = newFd;
+            log.append(name.str()).append(" ");
+            log.append(reinterpret_cast<const char*> (rec + 1), rec->size);
+            log.append("\n");
+        } else if (rec->kind == rkData && fd >= 0) {
+            struct iovec iov;
+            iov.iov_base = const_cast<Record*> (rec + 1);
+            iov.iov_len = rec->size;
+            batch.push_back(iov);
+            batchFd = fd;
+        } else if (rec->kind == rkClose && fd >= 0) {
+            ::close(fd);
+            files.erase(file);
+        }
+    }
+
+    if (!batch.empty() && !WriteAll(batchFd, &batch[0], batch.size()))
+        SpoolWriteErrors.add();
+
+    for (std::vector<Id>::const_iterator i = closes.begin(); i != closes.end(); ++i) {
+        const std::map<Id, int>::iterator file = files.find(*i);
+        if (file != files.end()) {
+            ::close(file->second);
+            files.erase(file);
+        }
+    }
+
+    if (!log.empty()) {
+        if (index < 0) {
+            const std::string name = dir + "/index.log";
+            index = ::open(name.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0640);
+        }
+        struct iovec iov;
+        iov.iov_base = const_cast<char*> (log.data());
+        iov.iov_len = log.size();
+        if (index < 0 || !WriteAll(index, &iov, 1))
+            SpoolWriteErrors.add();
+    }
+
+    // the iovecs pointed into the ring; release the space only now
+    __atomic_store_n(&tail, h, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,62 @@
+#ifndef JAMES_SPOOL_H
+#define JAMES_SPOOL_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+namespace Adapter {
+
+    // Mirrors message bodies into local files without blocking the caller.
+    // Host threads copy bytes into a bounded ring; a background thread
+    // drains the ring with batched writev(2) calls. When the ring is full,
+    // the body being captured is truncated and the loss is counted instead
+    // of slowing the forwarding path down.
+
+    class Spool {
+    public:
+        typedef uint64_t Id; // zero means "not capturing"
+
+        Spool(const std::string &aDir, size_t ringSize);
+        ~Spool();
+
+        void start(); // launches the writer thread
+        void stop(); // writes whatever is queued and joins the writer
+
+        // producer methods may be called from any host thread
+        Id open(const std::string &description); // starts a new capture
+        bool write(Id id, const char *data, size_t size); // false if dropped
+        void close(Id id); // ends the capture; the id becomes invalid
+
+    private:
+        struct Record; // ring entry header
+
+        bool enqueue(Id id, int kind, const char *data, size_t size);
+        bool push(Id id, int kind, const char *data, size_t size);
+        void drain();
+        static void *WriterLoop(void *spool);
+
+        const std::string dir; // where captured bodies are stored
+        char *ring;
+        const size_t capacity; // ring size, a multiple of the record alignment
+        volatile uint64_t head; // total bytes published by the producer
+        volatile uint64_t tail; // total bytes released by the writer
+        volatile bool stopping;
+        bool running;
+        pthread_mutex_t producer; // protects the ring head and lateCloses
+        std::vector<Id> lateCloses; // close records that did not fit the ring
+        pthread_t writer;
+
+        // writer thread state
+        std::map<Id, int> files; // open capture descriptors
+        int index; // index.log descriptor
+
+        Spool(const Spool &); // not implemented
+        Spool &operator =(const Spool &); // not implemented
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_SPOOL_H */
@@ -0,0 +1,15 @@
+#include "james_ecap.h"
+#include "james_stats.h"
+
+// counters are constructed during static initialization, before any
+// adapter thread exists, so the list itself needs no locking
+static Adapter::Counter *Counters = 0;
+
+Adapter::Counter::Counter(const char *aName) : name(aName), value_(0), next(Counters) {
+    Counters = this;
+}
+
+void Adapter::DumpStats(std::ostream &os) {
+    for (const Counter *c = Counters; c; c = c->next)
+        os << c->name << ": " << c->value() << "\n";
+}
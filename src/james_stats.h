@@ -0,0 +1,39 @@
+#ifndef JAMES_STATS_H
+#define JAMES_STATS_H
+
+#include <ostream>
+#include <stdint.h>
+
+namespace Adapter {
+
+    // A named, process-wide event counter. Counters are usually declared
+    // as file-level statics; they register themselves on construction and
+    // are reported by DumpStats(). Updates are atomic and never block.
+
+    class Counter {
+    public:
+        explicit Counter(const char *aName);
+
+        void add(uint64_t n = 1) {
+            __sync_fetch_and_add(&value_, n);
+        }
+
+        uint64_t value() const {
+            return __sync_fetch_and_add(&value_, 0);
+        }
+
+        const char *name;
+
+    private:
+        mutable uint64_t value_;
+        Counter *next; // registration list
+
+        friend void DumpStats(std::ostream &os);
+    };
+
+    // writes "name: value" lines for every registered counter
+    void DumpStats(std::ostream &os);
+
+} // namespace Adapter
+
+#endif /* JAMES_STATS_H */
@@ -0,0 +1,775 @@
+#include "james_ecap.h"
+#include "james_store.h"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <pthread.h>
+#include <libecap/common/errors.h>
+#include <mysql++/mysql++.h>
+#ifdef HAVE_SQLITE3
+#include <sqlite3.h>
+#endif
+
+// touches are written when this many clients are pending...
+#define TOUCH_BATCH 64
+// ... or when this many seconds have passed since the last write
+#define TOUCH_INTERVAL 1
+
+namespace Adapter {
+
+    // the `clients` and `client_volumes` tables in a MySQL database
+
+    class MysqlStore : public ClientStore {
+    public:
+        explicit MysqlStore(const DbConfig &aConfig);
+        virtual ~MysqlStore();
+
+        virtual bool connect();
+        virtual bool connected() const { return conn.connected(); }
+        virtual Lookup lookup(const std::string &clientIp, ClientRecord &record);
+        virtual bool upsert(const std::string &clientIp, const ClientRecord &record);
+        virtual bool endSessions(const ClientIps &clientIps, time_t before);
+        virtual bool addVolumes(const ClientVolumes &volumes);
+        virtual bool totalVolumes(const ClientIps &clientIps, ClientTotals &totals);
+
+    protected:
+        virtual bool writeTouches(const ClientIps &clientIps, time_t when);
+
+    private:
+        static std::string Time(time_t t);
+        std::string quote(const std::string &text); // an escaped string literal
+
+        const DbConfig config;
+        mysqlpp::Connection conn;
+    };
+
+#ifdef HAVE_SQLITE3
+    // the same tables in a local SQLite file, for single-box
+    // deployments that do not need a database server
+
+    class SqliteStore : public ClientStore {
+    public:
+        explicit SqliteStore(const DbConfig &aConfig);
+        virtual ~SqliteStore();
+
+        virtual bool connect();
+        virtual bool connected() const { return db != 0; }
+        virtual Lookup lookup(const std::string &clientIp, ClientRecord &record);
+        virtual bool upsert(const std::string &clientIp, const ClientRecord &record);
+        virtual bool endSessions(const ClientIps &clientIps, time_t before);
+        virtual bool addVolumes(const ClientVolumes &volumes);
+        virtual bool totalVolumes(const ClientIps &clientIps, ClientTotals &totals);
+
+    protected:
+        virtual bool writeTouches(const ClientIps &clientIps, time_t when);
+
+    private:
+        bool fail(const char *what); // reports the error; returns false
+        void close();
+
+        const DbConfig config;
+        sqlite3 *db;
+        sqlite3_stmt *selectStmt;
+        sqlite3_stmt *upsertStmt;
+        sqlite3_stmt *touchStmt;
+        sqlite3_stmt *endStmt;
+        sqlite3_stmt *volumeRowStmt;
+        sqlite3_stmt *volumeAddStmt;
+        sqlite3_stmt *volumeTotalStmt;
+    };
+#endif
+
+    // clients of all memory stores in the process, sharded by address
+    // so that host threads rarely wait for each other
+    class MemoryTable {
+    public:
+        MemoryTable();
+
+        bool find(const std::string &clientIp, ClientRecord &record);
+        void put(const std::string &clientIp, const ClientRecord &record);
+        void touch(const std::string &clientIp, time_t when);
+        void endSession(const std::string &clientIp, time_t before);
+        void addVolumes(const ClientStore::ClientVolumes &added);
+        void totalVolumes(const ClientStore::ClientIps &clientIps, ClientStore::ClientTotals &totals);
+
+    private:
+        enum { ShardCount = 16 };
+
+        class Shard {
+        public:
+            pthread_mutex_t mutex;
+            std::map<std::string, ClientRecord> clients;
+        };
+
+        Shard &shard(const std::string &clientIp);
+
+        Shard shards[ShardCount];
+
+        // written in batches by one thread per process, so not sharded
+        pthread_mutex_t volumeMutex;
+        ClientStore::ClientVolumes volumes;
+    };
+
+    static MemoryTable TheMemoryTable;
+
+    // Keeps clients in process memory, with configurable query latency
+    // and failures, so that adapters can be load-tested without a
+    // database server. Nothing survives a restart.
+
+    class MemoryStore : public ClientStore {
+    public:
+        explicit MemoryStore(const DbConfig &aConfig);
+
+        virtual bool connect() { return true; }
+        virtual bool connected() const { return true; }
+        virtual Lookup lookup(const std::string &clientIp, ClientRecord &record);
+        virtual bool upsert(const std::string &clientIp, const ClientRecord &record);
+        virtual bool endSessions(const ClientIps &clientIps, time_t before);
+        virtual bool addVolumes(const ClientVolumes &volumes);
+        virtual bool totalVolumes(const ClientIps &clientIps, ClientTotals &totals);
+
+    protected:
+        virtual bool writeTouches(const ClientIps &clientIps, time_t when);
+
+    private:
+        bool query(); // simulates a round trip; returns false on failure
+
+        const DbConfig config;
+        unsigned int seed; // for failure injection
+    };
+
+} // namespace Adapter
+
+Adapter::DbConfig::DbConfig() : dbdriver("mysql"), dbslow(500), dbtriprate(50),
+dbbackoff(30), dbsession(3600), dbcache(4096), dbhammer(120), dbidentity("ip"),
+dbaccount(0), dbquota(0), dblatency(0), dbfailrate(0) {
+}
+
+// a numeric james.conf value, from min to max
+static unsigned int ConfNumber(const char *tag, const char *val, unsigned long min,
+        unsigned long max, const std::string &conffile, const std::string &errorPrefix) {
+    char *end = 0;
+    const unsigned long number = strtoul(val, &end, 10);
+    if (!*val || *end || *val == '-' || number < min || number > max)
+        throw libecap::TextException(errorPrefix + "invalid " + tag + " value in " +
+            conffile + ": " + val);
+    return static_cast<unsigned int> (number);
+}
+
+void Adapter::DbConfig::load(const std::string &conffile, const std::string &errorPrefix) {
+    FUNCENTER();
+
+    char tag[24], val[100];
+    std::ifstream cfg(conffile.c_str());
+
+    std::string line;
+    while (std::getline(cfg, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        // tag = "value"; anything else (blank lines included) is skipped
+        if (sscanf(line.c_str(), "%23s = \"%99s", tag, val) != 2)
+            continue;
+        const size_t length = strlen(val);
+        if (length >= 2 && !strcmp(val + length - 2, "\";"))
+            val[length - 2] = 0;
+        else if (length >= 1 && val[length - 1] == '"')
+            val[length - 1] = 0;
+
+        if (!strcmp(tag, "dbhost")) {
+            if (dbhost.empty())
+                dbhost.assign(val);
+        }
+        if (!strcmp(tag, "dbname")) {
+            if (dbname.empty())
+                dbname.assign(val);
+        }
+        if (!strcmp(tag, "dblogin")) {
+            if (dblogin.empty())
+                dblogin.assign(val);
+        }
+        if (!strcmp(tag, "dbpassw")) {
+            if (dbpassw.empty())
+                dbpassw.assign(val);
+        }
+        if (!strcmp(tag, "dbdriver"))
+            dbdriver.assign(val);
+        // zero would disable the breaker's checks or its backoff
+        if (!strcmp(tag, "dbslow"))
+            dbslow = ConfNumber(tag, val, 1, 3600000, conffile, errorPrefix);
+        if (!strcmp(tag, "dbtriprate"))
+            dbtriprate = ConfNumber(tag, val, 1, 100, conffile, errorPrefix);
+        if (!strcmp(tag, "dbbackoff"))
+            dbbackoff = ConfNumber(tag, val, 1, 86400, conffile, errorPrefix);
+        if (!strcmp(tag, "dbsession"))
+            dbsession = ConfNumber(tag, val, 0, ~0U, conffile, errorPrefix);
+        if (!strcmp(tag, "dbcache"))
+            dbcache = ConfNumber(tag, val, 0, ~0U, conffile, errorPrefix);
+        if (!strcmp(tag, "dbhammer"))
+            dbhammer = ConfNumber(tag, val, 0, ~0U, conffile, errorPrefix);
+        if (!strcmp(tag, "dbidentity")) {
+            if (strcmp(val, "ip") && strcmp(val, "mac"))
+                throw libecap::TextException(errorPrefix + "invalid dbidentity value in " +
+                    conffile + ": " + val);
+            dbidentity.assign(val);
+        }
+        if (!strcmp(tag, "dbaccount"))
+            dbaccount = ConfNumber(tag, val, 0, ~0U, conffile, errorPrefix);
+        if (!strcmp(tag, "dbquota"))
+            dbquota = ConfNumber(tag, val, 0, ~0U, conffile, errorPrefix);
+        if (!strcmp(tag, "dblatency"))
+            dblatency = ConfNumber(tag, val, 0, 60000000, conffile, errorPrefix);
+        if (!strcmp(tag, "dbfailrate"))
+            dbfailrate = ConfNumber(tag, val, 0, 100, conffile, errorPrefix);
+    }
+    cfg.close();
+}
+
+Adapter::ClientStore *Adapter::ClientStore::Make(const DbConfig &config) {
+    if (config.dbdriver == "memory" || config.dbdriver == "fake")
+        return new MemoryStore(config);
+#ifdef HAVE_SQLITE3
+    if (config.dbdriver == "sqlite")
+        return new SqliteStore(config);
+#endif
+    if (config.dbdriver != "mysql")
+        std::cerr << "unsupported dbdriver " << config.dbdriver << ", using mysql" << std::endl;
+    return new MysqlStore(config);
+}
+
+void Adapter::ClientStore::ThreadStart() {
+    mysqlpp::Connection::thread_start();
+}
+
+Adapter::ClientStore::ClientStore() : lastFlush(::time(NULL)) {
+}
+
+bool Adapter::ClientStore::touch(const std::string &clientIp) {
+    touched.insert(clientIp);
+    if (touched.size() >= TOUCH_BATCH || ::time(NULL) - lastFlush >= TOUCH_INTERVAL)
+        return flush();
+    return true;
+}
+
+bool Adapter::ClientStore::flush() {
+    lastFlush = ::time(NULL);
+    if (touched.empty())
+        return true;
+    // a failed batch is dropped; the next touches will catch up
+    const bool written = writeTouches(touched, lastFlush);
+    touched.clear();
+    return written;
+}
+
+Adapter::MysqlStore::MysqlStore(const DbConfig &aConfig) : config(aConfig) {
+}
+
+Adapter::MysqlStore::~MysqlStore() {
+    if (conn.connected())
+        flush();
+}
+
+bool Adapter::MysqlStore::connect() {
+    if (conn.connected())
+        return true;
+
+    // a blackholed server must not hold the thread much longer than a slow
+    // query would; the client library counts whole seconds
+    const unsigned int timeout = (config.dbslow + 999) / 1000;
+    conn.set_option(new mysqlpp::ConnectTimeoutOption(timeout));
+    conn.set_option(new mysqlpp::ReadTimeoutOption(timeout));
+    conn.set_option(new mysqlpp::WriteTimeoutOption(timeout));
+
+    if (conn.connect(config.dbname.c_str(), config.dbhost.c_str(), config.dblogin.c_str(), config.dbpassw.c_str())) {
+        std::cout << "SQL reconnect" << std::endl;
+        return true;
+    }
+
+    std::cerr << "DB connection failed: " << conn.error() << std::endl;
+    return false;
+}
+
+// a DATETIME literal; the table uses the zero date for "never"
+std::string Adapter::MysqlStore::Time(time_t t) {
+    if (!t)
+        return "'0000-00-00 00:00:00'";
+    std::ostringstream os;
+    os << "FROM_UNIXTIME(" << t << ")";
+    return os.str();
+}
+
+Adapter::ClientStore::Lookup Adapter::MysqlStore::lookup(const std::string &clientIp, ClientRecord &record) {
+    if (!connect())
+        return lkFailed;
+
+    std::string ip_query = "SELECT cn, UNIX_TIMESTAMP(cntime), UNIX_TIMESTAMP(starttime), "
+        "UNIX_TIMESTAMP(time), enabled FROM `clients` WHERE `ip`='";
+    ip_query.append(clientIp).append("'");
+
+    mysqlpp::Query query = conn.query(ip_query);
+    mysqlpp::StoreQueryResult res = query.store();
+    if (!res) {
+        std::cerr << "Failed to get item list: " << query.error() << std::endl;
+        return lkFailed;
+    }
+    if (res.empty())
+        return lkMissing;
+
+    const mysqlpp::Row &row = res.front();
+    record.cn = row[0];
+    record.cntime = atol(row[1]);
+    record.starttime = atol(row[2]);
+    record.time = atol(row[3]);
+    record.enabled = static_cast<int> (row[4]) != 0;
+    return lkFound;
+}
+
+// one statement, so that an unchanged row is not taken for a missing one
+bool Adapter::MysqlStore::upsert(const std::string &clientIp, const ClientRecord &record) {
+    if (!connect())
+        return false;
+
+    std::ostringstream insert;
+    insert << "INSERT INTO clients SET `ip`='" << clientIp <<
+        "', `starttime`=" << Time(record.starttime) << ", `time`=" << Time(record.time) <<
+        ", `enabled`=" << record.enabled << ", `cn`=" << record.cn <<
+        ", `cntime`=" << Time(record.cntime) <<
+        " ON DUPLICATE KEY UPDATE `cntime`=VALUES(`cntime`), `cn`=VALUES(`cn`), "
+        "`time`=VALUES(`time`), `enabled`=VALUES(`enabled`)";
+    mysqlpp::Query query = conn.query(insert.str());
+    if (!query.exec()) {
+        std::cerr << "Failed to upsert client: " << query.error() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// one UPDATE for the whole batch
+bool Adapter::MysqlStore::writeTouches(const ClientIps &clientIps, time_t when) {
+    if (!connect())
+        return false;
+
+    std::ostringstream update;
+    update << "UPDATE clients SET `time`=" << Time(when) << " WHERE ip IN (";
+    for (ClientIps::const_iterator i = clientIps.begin(); i != clientIps.end(); ++i)
+        update << (i == clientIps.begin() ? "'" : ",'") << *i << "'";
+    update << ")";
+
+    mysqlpp::Query query = conn.query(update.str());
+    if (!query.exec()) {
+        std::cerr << "Failed to record client activity: " << query.error() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// one UPDATE for the whole batch; other processes may have seen the
+// clients since, so only sessions that are over everywhere are ended
+bool Adapter::MysqlStore::endSessions(const ClientIps &clientIps, time_t before) {
+    if (!connect())
+        return false;
+
+    std::ostringstream update;
+    update << "UPDATE clients SET `cntime`=" << Time(0) << " WHERE `cntime` > " << Time(0) <<
+        " AND `cntime` <= " << Time(before) << " AND ip IN (";
+    for (ClientIps::const_iterator i = clientIps.begin(); i != clientIps.end(); ++i)
+        update << (i == clientIps.begin() ? "'" : ",'") << *i << "'";
+    update << ")";
+
+    mysqlpp::Query query = conn.query(update.str());
+    if (!query.exec()) {
+        std::cerr << "Failed to end captive sessions: " << query.error() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+std::string Adapter::MysqlStore::quote(const std::string &text) {
+    std::string escaped;
+    conn.query().escape_string(&escaped, text.data(), text.size());
+    return "'" + escaped + "'";
+}
+
+// one INSERT for the whole batch; rows of other processes add up
+bool Adapter::MysqlStore::addVolumes(const ClientVolumes &volumes) {
+    if (!connect())
+        return false;
+
+    std::ostringstream insert;
+    insert << "INSERT INTO client_volumes (`ip`, `host`, `virgin`, `adapted`) VALUES ";
+    for (ClientVolumes::const_iterator i = volumes.begin(); i != volumes.end(); ++i) {
+        insert << (i == volumes.begin() ? "(" : ",(") << quote(i->first.first) << "," <<
+            quote(i->first.second) << "," << i->second.virgin << "," << i->second.adapted << ")";
+    }
+    insert << " ON DUPLICATE KEY UPDATE `virgin`=`virgin`+VALUES(`virgin`), "
+        "`adapted`=`adapted`+VALUES(`adapted`)";
+
+    mysqlpp::Query query = conn.query(insert.str());
+    if (!query.exec()) {
+        std::cerr << "Failed to record client volumes: " << query.error() << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool Adapter::MysqlStore::totalVolumes(const ClientIps &clientIps, ClientTotals &totals) {
+    if (!connect())
+        return false;
+
+    std::ostringstream select;
+    select << "SELECT `ip`, `adapted` FROM client_volumes WHERE `host`='' AND `ip` IN (";
+    for (ClientIps::const_iterator i = clientIps.begin(); i != clientIps.end(); ++i)
+        select << (i == clientIps.begin() ? "'" : ",'") << *i << "'";
+    select << ")";
+
+    mysqlpp::Query query = conn.query(select.str());
+    mysqlpp::StoreQueryResult res = query.store();
+    if (!res) {
+        std::cerr << "Failed to get client volumes: " << query.error() << std::endl;
+        return false;
+    }
+    for (mysqlpp::StoreQueryResult::const_iterator i = res.begin(); i != res.end(); ++i)
+        totals[std::string((*i)[0])] = strtoull((*i)[1], 0, 10);
+    return true;
+}
+
+#ifdef HAVE_SQLITE3
+Adapter::SqliteStore::SqliteStore(const DbConfig &aConfig) : config(aConfig), db(0),
+selectStmt(0), upsertStmt(0), touchStmt(0), endStmt(0),
+volumeRowStmt(0), volumeAddStmt(0), volumeTotalStmt(0) {
+}
+
+Adapter::SqliteStore::~SqliteStore() {
+    if (db)
+        flush();
+    close();
+}
+
+void Adapter::SqliteStore::close() {
+    sqlite3_finalize(selectStmt);
+    sqlite3_finalize(upsertStmt);
+    sqlite3_finalize(touchStmt);
+    sqlite3_finalize(endStmt);
+    sqlite3_finalize(volumeRowStmt);
+    sqlite3_finalize(volumeAddStmt);
+    sqlite3_finalize(volumeTotalStmt);
+    selectStmt = upsertStmt = touchStmt = endStmt = 0;
+    volumeRowStmt = volumeAddStmt = volumeTotalStmt = 0;
+    sqlite3_close(db);
+    db = 0;
+}
+
+bool Adapter::SqliteStore::fail(const char *what) {
+    std::cerr << "SQLite " << what << " failed: " << (db ? sqlite3_errmsg(db) : "out of memory") << std::endl;
+    return false;
+}
+
+bool Adapter::SqliteStore::connect() {
+    if (db)
+        return true;
+
+    // each thread has its own connection, so SQLite need not lock it
+    if (sqlite3_open_v2(config.dbname.c_str(), &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, 0) != SQLITE_OK) {
+        fail("open");
+        close();
+        return false;
+    }
+    // other threads' connections may be writing
+    sqlite3_busy_timeout(db, config.dbslow);
+
+    // the store is a cache of short-lived state; trade durability of the
+    // last few writes for not waiting on the disk
+    const char *schema =
+        "PRAGMA journal_mode=WAL;"
+        "PRAGMA synchronous=NORMAL;"
+        "CREATE TABLE IF NOT EXISTS clients ("
+        " ip TEXT PRIMARY KEY,"
+        " starttime INTEGER NOT NULL DEFAULT 0,"
+        " time INTEGER NOT NULL DEFAULT 0,"
+        " enabled INTEGER NOT NULL DEFAULT 0,"
+        " cn INTEGER NOT NULL DEFAULT 0,"
+        " cntime INTEGER NOT NULL DEFAULT 0);"
+        "CREATE TABLE IF NOT EXISTS client_volumes ("
+        " ip TEXT NOT NULL,"
+        " host TEXT NOT NULL,"
+        " virgin INTEGER NOT NULL DEFAULT 0,"
+        " adapted INTEGER NOT NULL DEFAULT 0,"
+        " PRIMARY KEY (ip, host));";
+    if (sqlite3_exec(db, schema, 0, 0, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "SELECT cn, cntime, starttime, time, enabled FROM clients WHERE ip=?", -1, &selectStmt, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "INSERT OR REPLACE INTO clients (ip, starttime, time, enabled, cn, cntime) VALUES (?, ?, ?, ?, ?, ?)", -1, &upsertStmt, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "UPDATE clients SET time=? WHERE ip=?", -1, &touchStmt, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "UPDATE clients SET cntime=0 WHERE ip=? AND cntime<=?", -1, &endStmt, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "INSERT OR IGNORE INTO client_volumes (ip, host) VALUES (?, ?)", -1, &volumeRowStmt, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "UPDATE client_volumes SET virgin=virgin+?, adapted=adapted+? WHERE ip=? AND host=?", -1, &volumeAddStmt, 0) != SQLITE_OK ||
+            sqlite3_prepare_v2(db, "SELECT adapted FROM client_volumes WHERE ip=? AND host=''", -1, &volumeTotalStmt, 0) != SQLITE_OK) {
+        fail("setup");
+        close();
+        return false;
+    }
+    return true;
+}
+
+Adapter::ClientStore::Lookup Adapter::SqliteStore::lookup(const std::string &clientIp, ClientRecord &record) {
+    if (!connect())
+        return lkFailed;
+
+    sqlite3_bind_text(selectStmt, 1, clientIp.data(), clientIp.size(), SQLITE_STATIC);
+    const int rc = sqlite3_step(selectStmt);
+    if (rc == SQLITE_ROW) {
+        record.cn = sqlite3_column_int(selectStmt, 0);
+        record.cntime = sqlite3_column_int64(selectStmt, 1);
+        record.starttime = sqlite3_column_int64(selectStmt, 2);
+        record.time = sqlite3_column_int64(selectStmt, 3);
+        record.enabled = sqlite3_column_int(selectStmt, 4) != 0;
+    }
+    sqlite3_reset(selectStmt);
+
+    if (rc == SQLITE_ROW)
+        return lkFound;
+    if (rc == SQLITE_DONE)
+        return lkMissing;
+    fail("lookup");
+    return lkFailed;
+}
+
+bool Adapter::SqliteStore::upsert(const std::string &clientIp, const ClientRecord &record) {
+    if (!connect())
+        return false;
+
+    sqlite3_bind_text(upsertStmt, 1, clientIp.data(), clientIp.size(), SQLITE_STATIC);
+    sqlite3_bind_int64(upsertStmt, 2, record.starttime);
+    sqlite3_bind_int64(upsertStmt, 3, record.time);
+    sqlite3_bind_int(upsertStmt, 4, record.enabled);
+    sqlite3_bind_int(upsertStmt, 5, record.cn);
+    sqlite3_bind_int64(upsertStmt, 6, record.cntime);
+    const int rc = sqlite3_step(upsertStmt);
+    sqlite3_reset(upsertStmt);
+    return rc == SQLITE_DONE || fail("upsert");
+}
+
+// one transaction for the whole batch
+bool Adapter::SqliteStore::writeTouches(const ClientIps &clientIps, time_t when) {
+    if (!connect())
+        return false;
+
+    if (sqlite3_exec(db, "BEGIN", 0, 0, 0) != SQLITE_OK)
+        return fail("begin");
+
+    bool ok = true;
+    for (ClientIps::const_iterator i = clientIps.begin(); ok && i != clientIps.end(); ++i) {
+        sqlite3_bind_int64(touchStmt, 1, when);
+        sqlite3_bind_text(touchStmt, 2, i->data(), i->size(), SQLITE_STATIC);
+        ok = sqlite3_step(touchStmt) == SQLITE_DONE;
+        sqlite3_reset(touchStmt);
+    }
+
+    if (!ok) {
+        fail("touch");
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        return false;
+    }
+    return sqlite3_exec(db, "COMMIT", 0, 0, 0) == SQLITE_OK || fail("commit");
+}
+
+// one transaction for the whole batch
+bool Adapter::SqliteStore::endSessions(const ClientIps &clientIps, time_t before) {
+    if (!connect())
+        return false;
+
+    if (sqlite3_exec(db, "BEGIN", 0, 0, 0) != SQLITE_OK)
+        return fail("begin");
+
+    bool ok = true;
+    for (ClientIps::const_iterator i = clientIps.begin(); ok && i != clientIps.end(); ++i) {
+        sqlite3_bind_text(endStmt, 1, i->data(), i->size(), SQLITE_STATIC);
+        sqlite3_bind_int64(endStmt, 2, before);
+        ok = sqlite3_step(endStmt) == SQLITE_DONE;
+        sqlite3_reset(endStmt);
+    }
+
+    if (!ok) {
+        fail("session end");
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        return false;
+    }
+    return sqlite3_exec(db, "COMMIT", 0, 0, 0) == SQLITE_OK || fail("commit");
+}
+
+// one transaction for the whole batch
+bool Adapter::SqliteStore::addVolumes(const ClientVolumes &volumes) {
+    if (!connect())
+        return false;
+
+    if (sqlite3_exec(db, "BEGIN", 0, 0, 0) != SQLITE_OK)
+        return fail("begin");
+
+    bool ok = true;
+    for (ClientVolumes::const_iterator i = volumes.begin(); ok && i != volumes.end(); ++i) {
+        const std::string &ip = i->first.first;
+        const std::string &host = i->first.second;
+        sqlite3_bind_text(volumeRowStmt, 1, ip.data(), ip.size(), SQLITE_STATIC);
+        sqlite3_bind_text(volumeRowStmt, 2, host.data(), host.size(), SQLITE_STATIC);
+        ok = sqlite3_step(volumeRowStmt) == SQLITE_DONE;
+        sqlite3_reset(volumeRowStmt);
+        if (!ok)
+            break;
+
+        sqlite3_bind_int64(volumeAddStmt, 1, i->second.virgin);
+        sqlite3_bind_int64(volumeAddStmt, 2, i->second.adapted);
+        sqlite3_bind_text(volumeAddStmt, 3, ip.data(), ip.size(), SQLITE_STATIC);
+        sqlite3_bind_text(volumeAddStmt, 4, host.data(), host.size(), SQLITE_STATIC);
+        ok = sqlite3_step(volumeAddStmt) == SQLITE_DONE;
+        sqlite3_reset(volumeAddStmt);
+    }
+
+    if (!ok) {
+        fail("volume update");
+        sqlite3_exec(db, "ROLLBACK", 0, 0, 0);
+        return false;
+    }
+    return sqlite3_exec(db, "COMMIT", 0, 0, 0) == SQLITE_OK || fail("commit");
+}
+
+bool Adapter::SqliteStore::totalVolumes(const ClientIps &clientIps, ClientTotals &totals) {
+    if (!connect())
+        return false;
+
+    for (ClientIps::const_iterator i = clientIps.begin(); i != clientIps.end(); ++i) {
+        sqlite3_bind_text(volumeTotalStmt, 1, i->data(), i->size(), SQLITE_STATIC);
+        const int rc = sqlite3_step(volumeTotalStmt);
+        if (rc == SQLITE_ROW)
+            totals[*i] = sqlite3_column_int64(volumeTotalStmt, 0);
+        sqlite3_reset(volumeTotalStmt);
+        if (rc != SQLITE_ROW && rc != SQLITE_DONE)
+            return fail("volume lookup");
+    }
+    return true;
+}
+#endif
+
+Adapter::MemoryTable::MemoryTable() {
+    for (int i = 0; i < ShardCount; ++i)
+        pthread_mutex_init(&shards[i].mutex, 0);
+    pthread_mutex_init(&volumeMutex, 0);
+}
+
+Adapter::MemoryTable::Shard &Adapter::MemoryTable::shard(const std::string &clientIp) {
+    unsigned int hash = 2166136261U; // FNV-1a
+    for (std::string::const_iterator i = clientIp.begin(); i != clientIp.end(); ++i)
+        hash = (hash ^ static_cast<unsigned char> (*i)) * 16777619U;
+    return shards[hash % ShardCount];
+}
+
+bool Adapter::MemoryTable::find(const std::string &clientIp, ClientRecord &record) {
+    Shard &s = shard(clientIp);
+    pthread_mutex_lock(&s.mutex);
+    std::map<std::string, ClientRecord>::const_iterator i = s.clients.find(clientIp);
+    const bool found = i != s.clients.end();
+    if (found)
+        record = i->second;
+    pthread_mutex_unlock(&s.mutex);
+    return found;
+}
+
+void Adapter::MemoryTable::put(const std::string &clientIp, const ClientRecord &record) {
+    Shard &s = shard(clientIp);
+    pthread_mutex_lock(&s.mutex);
+    s.clients[clientIp] = record;
+    pthread_mutex_unlock(&s.mutex);
+}
+
+void Adapter::MemoryTable::touch(const std::string &clientIp, time_t when) {
+    Shard &s = shard(clientIp);
+    pthread_mutex_lock(&s.mutex);
+    std::map<std::string, ClientRecord>::iterator i = s.clients.find(clientIp);
+    if (i != s.clients.end())
+        i->second.time = when;
+    pthread_mutex_unlock(&s.mutex);
+}
+
+void Adapter::MemoryTable::endSession(const std::string &clientIp, time_t before) {
+    Shard &s = shard(clientIp);
+    pthread_mutex_lock(&s.mutex);
+    std::map<std::string, ClientRecord>::iterator i = s.clients.find(clientIp);
+    if (i != s.clients.end() && i->second.cntime <= before)
+        i->second.cntime = 0;
+    pthread_mutex_unlock(&s.mutex);
+}
+
+void Adapter::MemoryTable::addVolumes(const ClientStore::ClientVolumes &added) {
+    pthread_mutex_lock(&volumeMutex);
+    for (ClientStore::ClientVolumes::const_iterator i = added.begin(); i != added.end(); ++i) {
+        ClientVolume &volume = volumes[i->first];
+        volume.virgin += i->second.virgin;
+        volume.adapted += i->second.adapted;
+    }
+    pthread_mutex_unlock(&volumeMutex);
+}
+
+void Adapter::MemoryTable::totalVolumes(const ClientStore::ClientIps &clientIps, ClientStore::ClientTotals &totals) {
+    pthread_mutex_lock(&volumeMutex);
+    for (ClientStore::ClientIps::const_iterator i = clientIps.begin(); i != clientIps.end(); ++i) {
+        const ClientStore::ClientVolumes::const_iterator total = volumes.find(std::make_pair(*i, std::string()));
+        if (total != volumes.end())
+            totals[*i] = total->second.adapted;
+    }
+    pthread_mutex_unlock(&volumeMutex);
+}
+
+Adapter::MemoryStore::MemoryStore(const DbConfig &aConfig) : config(aConfig), seed(1) {
+}
+
+bool Adapter::MemoryStore::query() {
+    if (config.dblatency) {
+        const struct timespec delay = {config.dblatency / 1000000, (config.dblatency % 1000000) * 1000};
+        nanosleep(&delay, 0);
+    }
+    return static_cast<unsigned int> (rand_r(&seed) % 100) >= config.dbfailrate;
+}
+
+Adapter::ClientStore::Lookup Adapter::MemoryStore::lookup(const std::string &clientIp, ClientRecord &record) {
+    if (!query())
+        return lkFailed;
+    return TheMemoryTable.find(clientIp, record) ? lkFound : lkMissing;
+}
+
+bool Adapter::MemoryStore::upsert(const std::string &clientIp, const ClientRecord &record) {
+    if (!query())
+        return false;
+    TheMemoryTable.put(clientIp, record);
+    return true;
+}
+
+bool Adapter::MemoryStore::writeTouches(const ClientIps &clientIps, time_t when) {
+    if (!query())
+        return false;
+    for (ClientIps::const_iterator i = clientIps.begin(); i != clientIps.end(); ++i)
+        TheMemoryTable.touch(*i, when);
+    return true;
+}
+
+bool Adapter::MemoryStore::endSessions(const ClientIps &clientIps, time_t before) {
+    if (!query())
+        return false;
+    for (ClientIps::const_iterator i = clientIps.begin(); i != clientIps.end(); ++i)
+        TheMemoryTable.endSession(*i, before);
+    return true;
+}
+
+bool Adapter::MemoryStore::addVolumes(const ClientVolumes &volumes) {
+    if (!query())
+        return false;
+    TheMemoryTable.addVolumes(volumes);
+    return true;
+}
+
+bool Adapter::MemoryStore::totalVolumes(const ClientIps &clientIps, ClientTotals &totals) {
+    if (!query())
+        return false;
+    TheMemoryTable.totalVolumes(clientIps, totals);
+    return true;
+}
@@ -0,0 +1,121 @@
+#ifndef JAMES_STORE_H
+#define JAMES_STORE_H
+
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <stdint.h>
+#include <time.h>
+
+namespace Adapter {
+
+    // database settings shared by the adapters that track clients
+    class DbConfig {
+    public:
+        DbConfig();
+
+        // reads a james.conf file; invalid values are thrown as
+        // libecap::TextException messages starting with errorPrefix
+        void load(const std::string &conffile, const std::string &errorPrefix);
+
+        std::string dbdriver; // "mysql" (default), "sqlite" or "memory"
+        std::string dbhost;
+        std::string dbname; // the database file for sqlite
+        std::string dblogin;
+        std::string dbpassw;
+
+        // circuit breaker and reconnection, see ClientDb
+        unsigned int dbslow; // milliseconds after which a query counts as failed
+        unsigned int dbtriprate; // percentage of failed queries that trips the breaker
+        unsigned int dbbackoff; // maximum seconds between reconnection attempts
+
+        // captive portal visits, see ClientDb
+        unsigned int dbsession; // seconds a captive session lasts after a visit
+        unsigned int dbcache; // client records cached in memory; 0 disables
+        unsigned int dbhammer; // recent visits above which a client is hammering
+        std::string dbidentity; // clients are "ip" addresses (default) or "mac" devices
+
+        // data volume accounting, see VolumeMeter
+        unsigned int dbaccount; // seconds between volume writes; 0 disables
+        unsigned int dbquota; // megabytes a client may receive; 0 disables
+
+        // memory driver behavior, for load testing without a database
+        unsigned int dblatency; // microseconds added to every query
+        unsigned int dbfailrate; // percentage of queries that fail
+    };
+
+    // one row of the `clients` table
+    class ClientRecord {
+    public:
+        ClientRecord() : starttime(0), time(0), enabled(false), cn(0), cntime(0) {}
+
+        time_t starttime; // first seen
+        time_t time; // last activity
+        bool enabled;
+        int cn; // captive portal visits
+        time_t cntime; // last captive portal visit; 0 if none
+    };
+
+    // bytes a client moved, in total or to one host
+    class ClientVolume {
+    public:
+        ClientVolume() : virgin(0), adapted(0) {}
+
+        uint64_t virgin; // as the origin sent them
+        uint64_t adapted; // as the client got them; quotas count these
+    };
+
+    // Where client state lives. Activity updates (touches) are frequent
+    // and need no answer, so they are buffered and written in batches.
+    // Not thread-safe: use one instance per thread. Instances of the memory
+    // and SQLite drivers share their data; MySQL ones share the server.
+
+    class ClientStore {
+    public:
+        typedef enum { lkFound, lkMissing, lkFailed } Lookup;
+        typedef std::set<std::string> ClientIps;
+        // by client address and host; the empty host is the client's total
+        typedef std::map<std::pair<std::string, std::string>, ClientVolume> ClientVolumes;
+        typedef std::map<std::string, uint64_t> ClientTotals; // adapted bytes
+
+        static ClientStore *Make(const DbConfig &config); // for config.dbdriver
+        static void ThreadStart(); // prepares the calling thread for store use
+
+        ClientStore();
+        virtual ~ClientStore() {}
+
+        virtual bool connect() = 0; // (re)connects if needed; returns whether connected
+        virtual bool connected() const = 0;
+
+        virtual Lookup lookup(const std::string &clientIp, ClientRecord &record) = 0;
+        virtual bool upsert(const std::string &clientIp, const ClientRecord &record) = 0;
+
+        // ends the captive sessions of the given clients that have not
+        // visited the portal since before; returns false on errors
+        virtual bool endSessions(const ClientIps &clientIps, time_t before) = 0;
+
+        // adds to the recorded volumes, creating missing rows; returns
+        // false on errors
+        virtual bool addVolumes(const ClientVolumes &volumes) = 0;
+
+        // gets the recorded totals of those of the given clients that have
+        // any; returns false on errors
+        virtual bool totalVolumes(const ClientIps &clientIps, ClientTotals &totals) = 0;
+
+        // records client activity, flushing when the batch is due
+        bool touch(const std::string &clientIp);
+        bool flush(); // writes buffered touches; returns false on errors
+
+    protected:
+        // sets the last activity time of the given existing clients
+        virtual bool writeTouches(const ClientIps &clientIps, time_t when) = 0;
+
+    private:
+        ClientIps touched; // not yet written
+        time_t lastFlush;
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_STORE_H */
@@ -0,0 +1,52 @@
+#!/bin/sh
+# james_tsan.sh: builds the adapters with ThreadSanitizer in a scratch
+# directory and drives each of them from several host threads with
+# james_load, using the in-memory client store. Exits non-zero if the
+# build or a measurement fails, or if ThreadSanitizer reports anything.
+#
+# Usage: james_tsan.sh [threads]; "make check-tsan" runs it with 8.
+
+threads=${1:-8}
+top=$(cd "${top_srcdir:-$(dirname "$0")/..}" && pwd)
+build=$(mktemp -d /tmp/james_tsan-XXXXXX) || exit 1
+trap 'rm -rf "$build"' EXIT
+
+cd "$build" || exit 1
+if ! "$top/configure" CXXFLAGS="-g -O1 -fsanitize=thread" \
+        LDFLAGS=-fsanitize=thread > configure.log 2>&1; then
+    cat configure.log
+    exit 1
+fi
+if ! make > make.log 2>&1; then
+    tail -50 make.log
+    exit 1
+fi
+
+echo 'document.title += "";' > script.js
+
+# the first report ends the run; any report fails the check
+TSAN_OPTIONS="halt_on_error=1 exitcode=66 log_path=$build/tsan"
+export TSAN_OPTIONS
+
+status=0
+
+# runs james_load with the given arguments on all threads
+run() {
+    echo "james_load -t $threads $*"
+    src/james_load -t "$threads" -c $((threads * 8)) -n 20000 "$@" || status=1
+}
+
+run -d 0 src/.libs/ecap_adapter_pipeline.so stages=captive,inject,log script=script.js
+run -d 0 src/.libs/ecap_adapter_captivating.so
+run -d 0 src/.libs/ecap_adapter_minimal.so
+run -d 0 src/.libs/ecap_adapter_passthru.so shape_rate=100000000
+run src/.libs/ecap_adapter_modifying.so script=script.js workers=2 \
+    offload_size=4096 shadow_rate=0.1 shadow_script=script.js
+
+for report in tsan.*; do
+    if [ -f "$report" ]; then
+        cat "$report"
+        status=1
+    fi
+done
+exit $status
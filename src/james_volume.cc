@@ -0,0 +1,325 @@
+#include "james_ecap.h"
+#include "james_volume.h"
+#include "james_stats.h"
+#include <algorithm>
+#include <cctype>
+#include <errno.h>
+#include <time.h>
+#include <libecap/common/errors.h>
+
+// slots in the shard of each host thread; a power of two
+#define SHARD_SLOTS 1024
+// slots a count looks at before it takes the overflow map
+#define PROBE_LIMIT 8
+// most rows written or read by one store query
+#define VOLUME_BATCH 256
+// most unwritten rows kept while the store is unavailable
+#define PENDING_LIMIT 65536
+// host names are cut to this length
+#define HOST_LENGTH 255
+
+namespace Adapter {
+
+    static Counter RowsWritten("volume.rows_written");
+    static Counter RowsDropped("volume.rows_dropped");
+    static Counter WriteFailures("volume.write_failures");
+    static Counter Overflows("volume.overflows");
+    static Counter QuotasExceeded("volume.quotas_exceeded");
+
+    class VolumeMeter::Slot {
+    public:
+        Slot() : used(0), hash(0), virgin(0), adapted(0) {}
+
+        int used; // atomic; set by the owner once the key is written
+        uint32_t hash; // of client and host
+        ClientAddress client;
+        std::string host;
+        uint64_t virgin; // atomic
+        uint64_t adapted; // atomic
+    };
+
+    class VolumeMeter::Shard {
+    public:
+        Slot slots[SHARD_SLOTS];
+    };
+
+    class VolumeMeter::ThreadMeter {
+    public:
+        ThreadMeter() : active(new Shard), retired(new Shard) {}
+        ~ThreadMeter() { delete active; delete retired; }
+
+        Shard *active; // atomic; counted into, swapped by the flusher
+        Shard *retired; // swapped out in the last round; flusher only
+
+    private:
+        ThreadMeter(const ThreadMeter &); // not implemented
+        ThreadMeter &operator=(const ThreadMeter &); // not implemented
+    };
+
+    static uint32_t Hash(const ClientAddress &client, const std::string &host) {
+        uint32_t hash = 2166136261U; // FNV-1a
+        for (size_t i = 0; i < sizeof(client.bytes); ++i)
+            hash = (hash ^ client.bytes[i]) * 16777619U;
+        for (std::string::const_iterator i = host.begin(); i != host.end(); ++i)
+            hash = (hash ^ static_cast<unsigned char> (*i)) * 16777619U;
+        return hash;
+    }
+
+    // the host as recorded: lowercase and without the port; "-" if the
+    // request had none, as the empty host is the client's total
+    static std::string HostName(const std::string &host) {
+        std::string name = host.substr(0, HOST_LENGTH);
+        const std::string::size_type colon = name.rfind(':');
+        if (colon != std::string::npos && name.find(']', colon) == std::string::npos)
+            name.erase(colon);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        return name.empty() ? "-" : name;
+    }
+
+} // namespace Adapter
+
+Adapter::VolumeMeter::VolumeMeter(const DbConfig &aConfig) : config(aConfig),
+stopping(false), overQuotaCount(0) {
+    Must(config.dbaccount > 0);
+    if (pthread_key_create(&key, 0))
+        throw libecap::TextException("cannot create the volume meter key");
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&wakeup, 0);
+    pthread_rwlock_init(&quotaLock, 0);
+    if (pthread_create(&flusher, 0, &VolumeMeter::Flush, this)) {
+        pthread_rwlock_destroy(&quotaLock);
+        pthread_cond_destroy(&wakeup);
+        pthread_mutex_destroy(&mutex);
+        pthread_key_delete(key);
+        throw libecap::TextException("cannot start the volume meter thread");
+    }
+}
+
+Adapter::VolumeMeter::~VolumeMeter() {
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&mutex);
+    pthread_join(flusher, 0);
+
+    for (std::vector<ThreadMeter*>::iterator i = meters.begin(); i != meters.end(); ++i)
+        delete *i;
+    pthread_key_delete(key);
+    pthread_rwlock_destroy(&quotaLock);
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&mutex);
+}
+
+void Adapter::VolumeMeter::count(const ClientAddress &client, const std::string &host,
+        uint64_t virgin, uint64_t adapted) {
+    if (!virgin && !adapted)
+        return;
+
+    Shard *const shard = __sync_fetch_and_add(&local().active, 0);
+    const uint32_t hash = Hash(client, host);
+    for (unsigned int probe = 0; probe < PROBE_LIMIT; ++probe) {
+        Slot &slot = shard->slots[(hash + probe) & (SHARD_SLOTS - 1)];
+        if (!__sync_fetch_and_add(&slot.used, 0)) {
+            // only this thread claims slots of its shards
+            slot.hash = hash;
+            slot.client = client;
+            slot.host = host;
+            __sync_bool_compare_and_swap(&slot.used, 0, 1);
+        } else if (slot.hash != hash || !(slot.client == client) || slot.host != host) {
+            continue;
+        }
+        __sync_fetch_and_add(&slot.virgin, virgin);
+        __sync_fetch_and_add(&slot.adapted, adapted);
+        return;
+    }
+
+    Overflows.add();
+    const std::pair<std::string, std::string> row(client.text(), HostName(host));
+    pthread_mutex_lock(&mutex);
+    ClientVolume &volume = overflow[row];
+    volume.virgin += virgin;
+    volume.adapted += adapted;
+    pthread_mutex_unlock(&mutex);
+}
+
+bool Adapter::VolumeMeter::overQuota(const ClientAddress &client) const {
+    if (!__sync_fetch_and_add(&overQuotaCount, 0))
+        return false;
+    pthread_rwlock_rdlock(&quotaLock);
+    const bool over = overQuotaClients.count(client) > 0;
+    pthread_rwlock_unlock(&quotaLock);
+    return over;
+}
+
+Adapter::VolumeMeter::ThreadMeter &Adapter::VolumeMeter::local() {
+    if (void *meter = pthread_getspecific(key))
+        return *static_cast<ThreadMeter*> (meter);
+
+    ThreadMeter *meter = new ThreadMeter;
+    pthread_setspecific(key, meter);
+    pthread_mutex_lock(&mutex);
+    meters.push_back(meter);
+    pthread_mutex_unlock(&mutex);
+    return *meter;
+}
+
+void *Adapter::VolumeMeter::Flush(void *meter) {
+    static_cast<VolumeMeter*> (meter)->flush();
+    return 0;
+}
+
+void Adapter::VolumeMeter::flush() {
+    ClientStore::ThreadStart();
+    ClientStore *store = 0; // made when there is something to write
+
+    pthread_mutex_lock(&mutex);
+    while (!stopping) {
+        const struct timespec tick = {time(NULL) + config.dbaccount, 0};
+        if (pthread_cond_timedwait(&wakeup, &mutex, &tick) != ETIMEDOUT)
+            continue; // stopping or spurious wakeup
+        pthread_mutex_unlock(&mutex);
+
+        rotate();
+        ClientStore::ClientIps written;
+        write(store, written);
+        enforce(store, written);
+
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+
+    // no host thread counts any more, so the active shards may be merged
+    // without waiting
+    rotate();
+    rotate();
+    ClientStore::ClientIps written;
+    write(store, written);
+    delete store;
+}
+
+void Adapter::VolumeMeter::rotate() {
+    pthread_mutex_lock(&mutex);
+    const std::vector<ThreadMeter*> all = meters;
+    ClientStore::ClientVolumes overflowed;
+    overflowed.swap(overflow);
+    pthread_mutex_unlock(&mutex);
+
+    for (ClientStore::ClientVolumes::const_iterator i = overflowed.begin(); i != overflowed.end(); ++i)
+        pend(i->first.first, i->first.second, i->second.virgin, i->second.adapted);
+
+    // the shards swapped out last round have had an interval for counts
+    // that were under way to land
+    for (std::vector<ThreadMeter*>::const_iterator i = all.begin(); i != all.end(); ++i) {
+        ThreadMeter &meter = **i;
+        merge(*meter.retired);
+        // we are the only writer; the full barrier publishes the merge
+        Shard *const active = __sync_fetch_and_add(&meter.active, 0);
+        __sync_bool_compare_and_swap(&meter.active, active, meter.retired);
+        meter.retired = active;
+    }
+}
+
+void Adapter::VolumeMeter::merge(Shard &shard) {
+    for (unsigned int i = 0; i < SHARD_SLOTS; ++i) {
+        Slot &slot = shard.slots[i];
+        if (!__sync_fetch_and_add(&slot.used, 0))
+            continue;
+        pend(slot.client.text(), HostName(slot.host),
+            __sync_lock_test_and_set(&slot.virgin, 0), __sync_lock_test_and_set(&slot.adapted, 0));
+        slot.host.clear();
+        __sync_bool_compare_and_swap(&slot.used, 1, 0);
+    }
+}
+
+void Adapter::VolumeMeter::pend(const std::string &clientIp, const std::string &host,
+        uint64_t virgin, uint64_t adapted) {
+    const std::string hosts[2] = {host, std::string()};
+    for (int i = 0; i < 2; ++i) {
+        const std::pair<std::string, std::string> row(clientIp, hosts[i]);
+        ClientStore::ClientVolumes::iterator volume = pending.find(row);
+        if (volume == pending.end()) {
+            if (pending.size() >= PENDING_LIMIT) {
+                RowsDropped.add();
+                continue;
+            }
+            volume = pending.insert(std::make_pair(row, ClientVolume())).first;
+        }
+        volume->second.virgin += virgin;
+        volume->second.adapted += adapted;
+    }
+}
+
+// rows of a failed batch stay pending for the next round
+void Adapter::VolumeMeter::write(ClientStore *&store, ClientStore::ClientIps &written) {
+    if (pending.empty())
+        return;
+    if (!store)
+        store = ClientStore::Make(config);
+
+    while (!pending.empty()) {
+        ClientStore::ClientVolumes::iterator end = pending.begin();
+        for (unsigned int n = 0; n < VOLUME_BATCH && end != pending.end(); ++n)
+            ++end;
+        const ClientStore::ClientVolumes batch(pending.begin(), end);
+        if (!store->connect() || !store->addVolumes(batch)) {
+            WriteFailures.add();
+            return;
+        }
+        for (ClientStore::ClientVolumes::const_iterator i = batch.begin(); i != batch.end(); ++i)
+            written.insert(i->first.first);
+        RowsWritten.add(batch.size());
+        pending.erase(pending.begin(), end);
+    }
+}
+
+// Clients stay over quota until their total is found below it, so that
+// an operator may lift the block by resetting the client's rows.
+void Adapter::VolumeMeter::enforce(ClientStore *&store, const ClientStore::ClientIps &written) {
+    if (!config.dbquota)
+        return;
+
+    pthread_rwlock_rdlock(&quotaLock);
+    std::set<ClientAddress> over = overQuotaClients;
+    pthread_rwlock_unlock(&quotaLock);
+
+    ClientStore::ClientIps clientIps = written;
+    for (std::set<ClientAddress>::const_iterator i = over.begin(); i != over.end(); ++i)
+        clientIps.insert(i->text());
+    if (clientIps.empty())
+        return;
+    if (!store)
+        store = ClientStore::Make(config);
+
+    const uint64_t limit = config.dbquota * 1048576ULL;
+    ClientStore::ClientIps::const_iterator next = clientIps.begin();
+    while (next != clientIps.end()) {
+        ClientStore::ClientIps::const_iterator end = next;
+        for (unsigned int n = 0; n < VOLUME_BATCH && end != clientIps.end(); ++n)
+            ++end;
+        const ClientStore::ClientIps batch(next, end);
+        next = end;
+
+        ClientStore::ClientTotals totals;
+        if (!store->connect() || !store->totalVolumes(batch, totals)) {
+            WriteFailures.add();
+            continue; // these clients keep their state
+        }
+        for (ClientStore::ClientIps::const_iterator i = batch.begin(); i != batch.end(); ++i) {
+            ClientAddress client;
+            if (!client.parse(i->data(), i->size()))
+                continue;
+            const ClientStore::ClientTotals::const_iterator total = totals.find(*i);
+            if (total != totals.end() && total->second >= limit) {
+                if (over.insert(client).second)
+                    QuotasExceeded.add();
+            } else {
+                over.erase(client);
+            }
+        }
+    }
+
+    pthread_rwlock_wrlock(&quotaLock);
+    overQuotaClients.swap(over);
+    __sync_lock_test_and_set(&overQuotaCount, static_cast<int> (overQuotaClients.size()));
+    pthread_rwlock_unlock(&quotaLock);
+}
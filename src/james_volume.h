@@ -0,0 +1,79 @@
+#ifndef JAMES_VOLUME_H
+#define JAMES_VOLUME_H
+
+#include "james_address.h"
+#include "james_store.h"
+#include <set>
+#include <string>
+#include <vector>
+#include <stdint.h>
+#include <pthread.h>
+
+namespace Adapter {
+
+    // Bytes moved per client and per client and host, for data caps.
+    //
+    // Each host thread counts into its own fixed-size slot table (shard),
+    // which only that thread writes: a transaction costs two atomic adds,
+    // or a slot claim the first time a client and host meet in an interval.
+    // Every config.dbaccount seconds a background thread swaps in a fresh
+    // shard for each thread, merges the shards it swapped out the round
+    // before (so late writers have had a whole interval to finish), and
+    // adds the result to the store in batches. Then it reads the totals
+    // of the clients it wrote and of those already over config.dbquota,
+    // and publishes the clients that are over it.
+    //
+    // Counts that find their shard full take a locked overflow map; rows
+    // the store refuses are retried in later rounds, up to a limit.
+
+    class VolumeMeter {
+    public:
+        explicit VolumeMeter(const DbConfig &aConfig);
+        ~VolumeMeter(); // writes what is left; no count() calls may be running
+
+        // adds the bytes of one transaction between client and host
+        void count(const ClientAddress &client, const std::string &host,
+            uint64_t virgin, uint64_t adapted);
+
+        // whether the client received more than its quota, as of the last round
+        bool overQuota(const ClientAddress &client) const;
+
+    private:
+        VolumeMeter(const VolumeMeter &); // not implemented
+        VolumeMeter &operator=(const VolumeMeter &); // not implemented
+
+        class Slot;
+        class Shard;
+        class ThreadMeter;
+
+        ThreadMeter &local(); // the calling thread's
+
+        static void *Flush(void *meter);
+        void flush(); // the background thread loop
+        void rotate(); // swaps shards; merges the retired ones into pending
+        void merge(Shard &shard); // and empties it
+        void pend(const std::string &clientIp, const std::string &host,
+            uint64_t virgin, uint64_t adapted); // adds to the host and total rows
+        void write(ClientStore *&store, ClientStore::ClientIps &written);
+        void enforce(ClientStore *&store, const ClientStore::ClientIps &written);
+
+        const DbConfig config;
+        pthread_key_t key; // the thread's ThreadMeter
+
+        pthread_mutex_t mutex; // protects the members below, up to stopping
+        std::vector<ThreadMeter*> meters; // all of them, for the flusher
+        ClientStore::ClientVolumes overflow; // counts that found no slot
+        pthread_cond_t wakeup;
+        pthread_t flusher;
+        bool stopping;
+
+        ClientStore::ClientVolumes pending; // merged, not yet written; flusher only
+
+        std::set<ClientAddress> overQuotaClients;
+        mutable int overQuotaCount; // atomic; spares the lock when nobody is over
+        mutable pthread_rwlock_t quotaLock; // protects overQuotaClients
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_VOLUME_H */
@@ -0,0 +1,69 @@
+#include "james_ecap.h"
+#include "james_wheel.h"
+
+Adapter::TimerWheel::TimerWheel(time_t now) : current(now) {
+}
+
+void Adapter::TimerWheel::schedule(const std::string &key, time_t deadline) {
+    const std::map<std::string, time_t>::iterator i = deadlines.find(key);
+    if (i == deadlines.end()) {
+        deadlines.insert(std::make_pair(key, deadline));
+        place(key, deadline);
+    } else if (deadline > i->second) {
+        i->second = deadline; // moved when its current place comes up
+    }
+}
+
+time_t Adapter::TimerWheel::deadline(const std::string &key) const {
+    const std::map<std::string, time_t>::const_iterator i = deadlines.find(key);
+    return i == deadlines.end() ? 0 : i->second;
+}
+
+void Adapter::TimerWheel::advance(time_t now, Keys &expired) {
+    while (current <= now)
+        tick(expired);
+}
+
+void Adapter::TimerWheel::place(const std::string &key, time_t deadline) {
+    if (deadline < current)
+        deadline = current; // overdue; expires at the next tick
+    const time_t delta = deadline - current;
+    if (delta < InnerSlots)
+        inner[deadline % InnerSlots].push_back(key);
+    else if (delta < InnerSlots * OuterSlots)
+        outer[(deadline / InnerSlots) % OuterSlots].push_back(key);
+    else
+        overflow.push_back(key);
+}
+
+void Adapter::TimerWheel::tick(Keys &expired) {
+    const time_t now = current;
+    Keys due;
+
+    // bring the timers of the coming inner revolution closer
+    if (now % InnerSlots == 0) {
+        if (now % (InnerSlots * OuterSlots) == 0) {
+            due.swap(overflow);
+            for (Keys::const_iterator i = due.begin(); i != due.end(); ++i)
+                place(*i, deadlines[*i]);
+            due.clear();
+        }
+        due.swap(outer[(now / InnerSlots) % OuterSlots]);
+        for (Keys::const_iterator i = due.begin(); i != due.end(); ++i)
+            place(*i, deadlines[*i]);
+        due.clear();
+    }
+
+    due.swap(inner[now % InnerSlots]);
+    for (Keys::const_iterator i = due.begin(); i != due.end(); ++i) {
+        const std::map<std::string, time_t>::iterator timer = deadlines.find(*i);
+        if (timer->second <= now) {
+            expired.push_back(*i);
+            deadlines.erase(timer);
+        } else {
+            place(*i, timer->second); // extended since it was placed
+        }
+    }
+
+    current = now + 1;
+}
@@ -0,0 +1,51 @@
+#ifndef JAMES_WHEEL_H
+#define JAMES_WHEEL_H
+
+#include <map>
+#include <string>
+#include <vector>
+#include <time.h>
+
+namespace Adapter {
+
+    // Deadlines of named timers, kept in a two-level hierarchical timer
+    // wheel with one-second ticks: the inner wheel holds the next 256
+    // seconds, the outer one the next 256 * 64 seconds (about four and a
+    // half hours), and later deadlines wait in an overflow list. Scheduling
+    // is O(1). A deadline may only be extended: the key keeps its place and
+    // is moved when that place comes up, so advancing is O(1) amortized per
+    // timer however often it is extended. Not thread-safe.
+
+    class TimerWheel {
+    public:
+        typedef std::vector<std::string> Keys;
+
+        explicit TimerWheel(time_t now);
+
+        // starts or extends the timer of key
+        void schedule(const std::string &key, time_t deadline);
+
+        // the deadline of key, or zero if it has none
+        time_t deadline(const std::string &key) const;
+
+        // runs the clock up to now; adds the keys that expired to expired
+        void advance(time_t now, Keys &expired);
+
+        size_t size() const { return deadlines.size(); }
+
+    private:
+        enum { InnerSlots = 256, OuterSlots = 64 };
+
+        void place(const std::string &key, time_t deadline);
+        void tick(Keys &expired); // processes the current second
+
+        std::map<std::string, time_t> deadlines; // of all scheduled keys
+        Keys inner[InnerSlots]; // one slot per second
+        Keys outer[OuterSlots]; // one slot per InnerSlots seconds
+        Keys overflow; // the rest
+        time_t current; // the next second to process
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_WHEEL_H */
@@ -0,0 +1,194 @@
+#include "james_ecap.h"
+#include "james_workers.h"
+#include "james_stats.h"
+#include <algorithm>
+#include <libecap/common/errors.h>
+
+namespace Adapter {
+
+    static Counter JobsRun("workers.jobs");
+    static Counter JobsStolen("workers.steals");
+    static Counter JobsRefused("workers.refusals");
+    static Counter JobsFailed("workers.failures");
+
+} // namespace Adapter
+
+Adapter::WorkerPool::WorkerPool(unsigned int aDepth) : depth(aDepth), started(0),
+dealt(0), outstanding(0), queued(0), stopping(false) {
+    if (pthread_key_create(&key, 0))
+        throw libecap::TextException("cannot create the worker pool key");
+    pthread_mutex_init(&mutex, 0);
+    pthread_cond_init(&wakeup, 0);
+}
+
+Adapter::WorkerPool::~WorkerPool() {
+    pthread_mutex_lock(&mutex);
+    stopping = true;
+    pthread_cond_broadcast(&wakeup);
+    pthread_mutex_unlock(&mutex);
+
+    const unsigned int count = threads();
+    for (unsigned int i = 0; i < count; ++i)
+        pthread_join(workers[i].thread, 0);
+
+    // no worker runs any more
+    for (unsigned int i = 0; i < count; ++i) {
+        for (std::deque<Job*>::iterator j = workers[i].jobs.begin(); j != workers[i].jobs.end(); ++j)
+            delete *j;
+    }
+    for (std::vector<Job**>::iterator i = inboxes.begin(); i != inboxes.end(); ++i) {
+        for (Job *job = **i; job;) {
+            Job *next = job->next;
+            delete job;
+            job = next;
+        }
+        delete *i;
+    }
+
+    pthread_key_delete(key);
+    pthread_cond_destroy(&wakeup);
+    pthread_mutex_destroy(&mutex);
+}
+
+void Adapter::WorkerPool::start(unsigned int threads) {
+    Must(threads <= WORKER_LIMIT);
+    for (unsigned int i = this->threads(); i < threads; ++i) {
+        Worker &worker = workers[i];
+        worker.pool = this;
+        worker.index = i;
+        if (pthread_create(&worker.thread, 0, &WorkerPool::Work, &worker))
+            throw libecap::TextException("cannot start a worker thread");
+        __sync_fetch_and_add(&started, 1);
+    }
+}
+
+bool Adapter::WorkerPool::submit(Job *job) {
+    const unsigned int count = threads();
+    const int limit = static_cast<int> (count * depth);
+    int jobs;
+    do {
+        jobs = __sync_fetch_and_add(&outstanding, 0);
+        if (!count || jobs >= limit) {
+            JobsRefused.add();
+            return false;
+        }
+    } while (!__sync_bool_compare_and_swap(&outstanding, jobs, jobs + 1));
+
+    job->failed = false;
+    job->inbox = local();
+    job->next = 0;
+    Worker &worker = workers[__sync_fetch_and_add(&dealt, 1) % count];
+    pthread_mutex_lock(&worker.mutex);
+    worker.jobs.push_back(job);
+    pthread_mutex_unlock(&worker.mutex);
+
+    // queued only once the job is in a queue, so a claim always finds one
+    pthread_mutex_lock(&mutex);
+    ++queued;
+    pthread_cond_signal(&wakeup);
+    pthread_mutex_unlock(&mutex);
+    return true;
+}
+
+void Adapter::WorkerPool::completed(std::vector<Job*> &jobs) {
+    Job **finished = local();
+    Job *head;
+    do {
+        head = __sync_fetch_and_add(finished, 0);
+    } while (head && !__sync_bool_compare_and_swap(finished, head, static_cast<Job*> (0)));
+
+    const std::vector<Job*>::size_type first = jobs.size();
+    for (Job *job = head; job; job = job->next)
+        jobs.push_back(job);
+    std::reverse(jobs.begin() + first, jobs.end());
+    __sync_fetch_and_sub(&outstanding, static_cast<int> (jobs.size() - first));
+}
+
+bool Adapter::WorkerPool::busy() const {
+    return __sync_fetch_and_add(&outstanding, 0) > 0;
+}
+
+unsigned int Adapter::WorkerPool::threads() const {
+    return __sync_fetch_and_add(&started, 0);
+}
+
+void *Adapter::WorkerPool::Work(void *worker) {
+    Worker &self = *static_cast<Worker*> (worker);
+    self.pool->work(self);
+    return 0;
+}
+
+void Adapter::WorkerPool::work(Worker &worker) {
+    pthread_mutex_lock(&mutex);
+    while (true) {
+        while (!queued && !stopping)
+            pthread_cond_wait(&wakeup, &mutex);
+        if (stopping)
+            break;
+        --queued; // claims one of the queued jobs
+        pthread_mutex_unlock(&mutex);
+
+        Job *job = take(worker);
+        try {
+            job->run();
+        } catch (...) {
+            job->failed = true;
+            JobsFailed.add();
+        }
+        JobsRun.add();
+        finish(job);
+
+        pthread_mutex_lock(&mutex);
+    }
+    pthread_mutex_unlock(&mutex);
+}
+
+// Every claim is backed by a job in some queue, but another worker may
+// take the one we saw first, so we look until we get one.
+Adapter::WorkerPool::Job *Adapter::WorkerPool::take(Worker &worker) {
+    while (true) {
+        pthread_mutex_lock(&worker.mutex);
+        if (!worker.jobs.empty()) {
+            Job *job = worker.jobs.front();
+            worker.jobs.pop_front();
+            pthread_mutex_unlock(&worker.mutex);
+            return job;
+        }
+        pthread_mutex_unlock(&worker.mutex);
+
+        const unsigned int count = threads();
+        for (unsigned int i = 1; i < count; ++i) {
+            Worker &victim = workers[(worker.index + i) % count];
+            pthread_mutex_lock(&victim.mutex);
+            if (!victim.jobs.empty()) {
+                Job *job = victim.jobs.back();
+                victim.jobs.pop_back();
+                pthread_mutex_unlock(&victim.mutex);
+                JobsStolen.add();
+                return job;
+            }
+            pthread_mutex_unlock(&victim.mutex);
+        }
+    }
+}
+
+void Adapter::WorkerPool::finish(Job *job) {
+    Job **finished = job->inbox;
+    Job *head;
+    do {
+        head = __sync_fetch_and_add(finished, 0);
+        job->next = head;
+    } while (!__sync_bool_compare_and_swap(finished, head, job));
+}
+
+Adapter::WorkerPool::Job **Adapter::WorkerPool::local() {
+    if (void *inbox = pthread_getspecific(key))
+        return static_cast<Job**> (inbox);
+
+    Job **inbox = new Job*(0);
+    pthread_setspecific(key, inbox);
+    pthread_mutex_lock(&mutex);
+    inboxes.push_back(inbox);
+    pthread_mutex_unlock(&mutex);
+    return inbox;
+}
@@ -0,0 +1,98 @@
+#ifndef JAMES_WORKERS_H
+#define JAMES_WORKERS_H
+
+#include <deque>
+#include <vector>
+#include <pthread.h>
+
+// most worker threads of one pool
+#define WORKER_LIMIT 64
+
+namespace Adapter {
+
+    // Threads that run CPU-heavy jobs off the host thread.
+    //
+    // Each worker has its own queue; submit() deals jobs out round-robin,
+    // and a worker whose queue is empty steals from the back of the
+    // others'. Jobs submitted but not yet collected are bounded, so a
+    // busy pool makes callers do the work themselves rather than queue it.
+    //
+    // Finished jobs go onto a lock-free stack of the thread that
+    // submitted them, which that thread collects from its suspend/resume
+    // polling (see completed()), so each host thread gets back only its
+    // own jobs. Jobs of one submitter may finish in any order; submit the
+    // next one only when the last has been collected if order matters.
+
+    class WorkerPool {
+    public:
+        class Job {
+        public:
+            Job() : failed(false), inbox(0), next(0) {}
+            virtual ~Job() {}
+
+            virtual void run() = 0; // on a worker thread
+
+            bool failed; // run() threw
+
+        private:
+            friend class WorkerPool;
+            Job **inbox; // the completion stack of the submitting thread
+            Job *next; // on the completion stack
+        };
+
+        explicit WorkerPool(unsigned int aDepth); // jobs per worker
+        ~WorkerPool(); // deletes the jobs nobody collected
+
+        // grows the pool to the given number of threads; never shrinks it
+        void start(unsigned int threads);
+
+        // queues the job, giving it to the pool; returns false, leaving
+        // the job with the caller, if there is no worker or no room
+        bool submit(Job *job);
+
+        // adds the jobs of the calling thread that finished, oldest first,
+        // to jobs; they belong to the caller again
+        void completed(std::vector<Job*> &jobs);
+
+        bool busy() const; // whether any job is yet to be collected
+        unsigned int threads() const;
+
+    private:
+        WorkerPool(const WorkerPool &); // not implemented
+        WorkerPool &operator=(const WorkerPool &); // not implemented
+
+        class Worker {
+        public:
+            Worker() : pool(0), index(0) { pthread_mutex_init(&mutex, 0); }
+            ~Worker() { pthread_mutex_destroy(&mutex); }
+
+            WorkerPool *pool;
+            unsigned int index;
+            pthread_t thread;
+            pthread_mutex_t mutex; // protects jobs
+            std::deque<Job*> jobs; // taken from the front, stolen from the back
+        };
+
+        static void *Work(void *worker);
+        void work(Worker &worker); // the worker thread loop
+        Job *take(Worker &worker); // its own job or one stolen from others
+        void finish(Job *job); // pushes onto its completion stack
+        Job **local(); // the completion stack of the calling thread
+
+        const unsigned int depth;
+        Worker workers[WORKER_LIMIT];
+        mutable unsigned int started; // atomic; workers running
+        unsigned int dealt; // atomic; submissions, for round-robin
+        mutable int outstanding; // atomic; submitted and not yet collected
+        pthread_key_t key; // the thread's completion stack, newest first
+
+        pthread_mutex_t mutex; // protects the members below
+        std::vector<Job**> inboxes; // all completion stacks, for cleanup
+        pthread_cond_t wakeup;
+        unsigned int queued; // jobs in the queues that no worker claimed
+        bool stopping;
+    };
+
+} // namespace Adapter
+
+#endif /* JAMES_WORKERS_H */